@@ -0,0 +1,7 @@
+#include "header.h"
+
+void callee() {}
+
+void caller() {
+    second();
+}
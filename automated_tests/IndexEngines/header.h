@@ -0,0 +1,14 @@
+#pragma once
+
+void callee();
+
+inline void first()
+{
+    callee();
+}
+
+inline void second()
+{
+    callee();
+    first();
+}
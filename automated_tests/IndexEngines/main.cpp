@@ -0,0 +1,8 @@
+#include "header.h"
+
+int main()
+{
+    first();
+    second();
+    return 0;
+}
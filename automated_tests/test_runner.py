@@ -11,11 +11,12 @@ import os
 import sys
 import json
 import subprocess as sp
-from hamcrest import assert_that, has_length, has_item
+from hamcrest import assert_that, equal_to, has_length, has_item
 
 sys.dont_write_bytecode = True
 os.environ["PYTHONDONTWRITEBYTECODE"] = "1"
 socket_file = "/var/tmp/rdm_dev"
+index_engines = ["cursor", "callbacks"]
 
 
 def create_compile_commands(test_dir, test_files):
@@ -64,8 +65,15 @@ def wait_for(p, match):
             break
 
 
-def run(rdm, project_dir, test_dir, test_files, rc_command, expected_locations):
+def reindex(rdm, test_dir, files):
+    for f in files:
+        run_rc(["--reindex=" + f.format(test_dir)])
+        wait_for(rdm, "Jobs took")
+
+
+def run(rdm, project_dir, test_dir, test_files, rc_command, expected_locations, reindex_files):
     print 'running test'
+    reindex(rdm, test_dir, reindex_files)
     actual_locations = \
         read_locations(project_dir,
                        run_rc([c.format(test_dir) for c in rc_command]))
@@ -75,6 +83,38 @@ def run(rdm, project_dir, test_dir, test_files, rc_command, expected_locations):
     for expected_location_string in expected_locations:
         expected_location = Location.from_str(expected_location_string.format(test_dir))
         assert_that(actual_locations, has_item(expected_location))
+    return actual_locations
+
+
+def set_index_engine(test_dir, engine):
+    config = os.path.join(test_dir, ".rtags-config")
+    if engine is None:
+        if os.path.exists(config):
+            os.remove(config)
+    else:
+        with open(config, "w") as f:
+            f.write("index-engine: %s\n" % engine)
+
+
+# Indexes the test with every engine in turn, the results have to be the
+# same.
+def run_engines(project_dir, test_dir, test_files, rc_command, expected_locations, reindex_files):
+    results = {}
+    try:
+        for engine in index_engines:
+            print 'index engine:', engine
+            set_index_engine(test_dir, engine)
+            rdm = setup_rdm(test_dir, test_files)
+            try:
+                results[engine] = sorted(repr(l) for l in run(rdm, project_dir, test_dir, test_files, rc_command,
+                                                              expected_locations, reindex_files))
+            finally:
+                rdm.terminate()
+                rdm.wait()
+    finally:
+        set_index_engine(test_dir, None)
+    for engine in index_engines[1:]:
+        assert_that(results[engine], equal_to(results[index_engines[0]]))
 
 def setup_rdm(test_dir, test_files):
     rdm = sp.Popen(["rdm", "-n", socket_file, "-d", "~/.rtags_dev", "-o", "-B", "-C"],
@@ -96,9 +136,16 @@ def test_generator():
         if "ForwardDeclaration" in test_dir:
           continue
         expectations = json.load(open(os.path.join(test_dir, "expectation.json"), 'r'))
+        test_generator.__name__ = os.path.basename(test_dir)
+        for e in expectations:
+            if e.get("compare-engines"):
+                yield run_engines, project_dir, test_dir, test_files, e["rc-command"], e["expectation"], \
+                    e.get("reindex", [])
+        expectations = [e for e in expectations if not e.get("compare-engines")]
+        if not expectations:
+            continue
         rdm = setup_rdm(test_dir, test_files)
         for e in expectations:
-            test_generator.__name__ = os.path.basename(test_dir)
-            yield run, rdm, project_dir, test_dir, test_files, e["rc-command"], e["expectation"]
+            yield run, rdm, project_dir, test_dir, test_files, e["rc-command"], e["expectation"], e.get("reindex", [])
         rdm.terminate()
         rdm.wait()
@@ -16,6 +16,8 @@
 #define RTAGS_SINGLE_THREAD
 #include "ClangIndexer.h"
 
+#include <stdio.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #if CINDEX_VERSION >= CINDEX_VERSION_ENCODE(0, 25)
 #include <clang-c/Documentation.h>
@@ -30,6 +32,8 @@
 #include "rct/SHA256.h"
 #include "RTags.h"
 #include "RTagsVersion.h"
+#include "Segment.h"
+#include "TokenMap.h"
 #include "VisitFileMessage.h"
 #include "VisitFileResponseMessage.h"
 #include "Location.h"
@@ -77,14 +81,50 @@ struct VerboseVisitorUserData {
     ClangIndexer *indexer;
 };
 
+// rp processes are reused so ru_maxrss only ever grows. On Linux the peak
+// (VmHWM) can be reset for each job.
+static void resetPeakMemory()
+{
+#ifdef OS_Linux
+    if (FILE *f = fopen("/proc/self/clear_refs", "w")) {
+        fputs("5", f);
+        fclose(f);
+    }
+#endif
+}
+
+static uint64_t peakMemory()
+{
+#ifdef OS_Linux
+    if (FILE *f = fopen("/proc/self/status", "r")) {
+        unsigned long long kb = 0;
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "VmHWM: %llu kB", &kb) == 1)
+                break;
+        }
+        fclose(f);
+        if (kb)
+            return kb * 1024;
+    }
+#endif
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+#ifdef OS_Darwin
+    return usage.ru_maxrss;
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
 Flags<Server::Option> ClangIndexer::sServerOpts;
 Path ClangIndexer::sServerSandboxRoot;
-ClangIndexer::ClangIndexer()
-    : mLastCursor(nullCursor), mLastCallExprSymbol(0), mVisitFileResponseMessageFileId(0),
-      mVisitFileResponseMessageVisit(0), mParseDuration(0), mVisitDuration(0), mBlocked(0),
+ClangIndexer::ClangIndexer(const std::shared_ptr<Connection> &connection)
+    : mEngine(CursorEngine), mLastCursor(nullCursor), mLastCallExprSymbol(0), mParseDuration(0), mVisitDuration(0), mBlocked(0),
       mAllowed(0), mIndexed(1), mVisitFileTimeout(0), mIndexDataMessageTimeout(0),
-      mFileIdsQueried(0), mFileIdsQueriedTime(0), mCursorsVisited(0), mLogFile(0),
-      mConnection(Connection::create(RClient::NumOptions)), mUnionRecursion(false)
+      mFileIdsQueried(0), mFileIdsQueriedTime(0), mCursorsVisited(0), mSegment(0), mLogFile(0),
+      mConnection(connection ? connection : Connection::create(RClient::NumOptions)), mUnionRecursion(false)
 {
     mConnection->newMessage().connect(std::bind(&ClangIndexer::onMessage, this,
                                                 std::placeholders::_1, std::placeholders::_2));
@@ -92,12 +132,14 @@ ClangIndexer::ClangIndexer()
 
 ClangIndexer::~ClangIndexer()
 {
+    mConnection->newMessage().disconnect();
     if (mLogFile)
         fclose(mLogFile);
 }
 
 bool ClangIndexer::exec(const String &data)
 {
+    resetPeakMemory();
     Deserializer deserializer(data);
     uint16_t protocolVersion;
     deserializer >> protocolVersion;
@@ -109,8 +151,8 @@ bool ClangIndexer::exec(const String &data)
     String socketFile;
     Flags<IndexerJob::Flag> indexerJobFlags;
     uint32_t connectTimeout, connectAttempts;
-    int32_t niceValue;
-    Hash<uint32_t, Path> blockedFiles;
+    Path blockedFilesSnapshot;
+    Set<uint32_t> unblockedFiles;
 
     deserializer >> sServerSandboxRoot;
     deserializer >> id;
@@ -123,12 +165,12 @@ bool ClangIndexer::exec(const String &data)
     deserializer >> mIndexDataMessageTimeout;
     deserializer >> connectTimeout;
     deserializer >> connectAttempts;
-    deserializer >> niceValue;
     deserializer >> sServerOpts;
     deserializer >> mUnsavedFiles;
     deserializer >> mDataDir;
     deserializer >> mDebugLocations;
-    deserializer >> blockedFiles;
+    deserializer >> mSegment;
+    deserializer >> blockedFilesSnapshot >> mBlockedFiles >> unblockedFiles;
 
     if (sServerOpts & Server::NoRealPath) {
         Path::setRealPathEnabled(false);
@@ -150,13 +192,6 @@ bool ClangIndexer::exec(const String &data)
 
     const uint64_t parseTime = Rct::currentTimeMs();
 
-    if (niceValue != INT_MIN) {
-        errno = 0;
-        if (nice(niceValue) == -1) {
-            error() << "Failed to nice rp" << Rct::strerror();
-        }
-    }
-
     if (mSourceFile.isEmpty()) {
         error("No sourcefile");
         return false;
@@ -171,9 +206,25 @@ bool ClangIndexer::exec(const String &data)
         return false;
     }
 
-    Location::init(blockedFiles);
+    // A worker keeps the file ids it has learned from previous jobs, they
+    // stay valid for as long as it talks to the same rdm. Whether a file is
+    // blocked for this job is decided by isBlocked() alone.
+    const bool connected = mConnection->isConnected();
+    if (connected) {
+        for (const auto &it : mBlockedFiles)
+            Location::set(it.second, it.first);
+    } else {
+        Location::init(mBlockedFiles);
+    }
+    String snapshotError;
+    if (!Location::initSnapshot(blockedFilesSnapshot, unblockedFiles, &snapshotError)) {
+        error("Failed to load visited files from %s: %s", blockedFilesSnapshot.constData(), snapshotError.constData());
+        return false;
+    }
     Location::set(mSourceFile, mSource.fileId);
-    while (true) {
+    if (RTags::rtagsConfig(mSourceFile).value("index-engine") == "callbacks")
+        mEngine = CallbackEngine;
+    while (!connected) {
         if (mConnection->connectUnix(socketFile, connectTimeout))
             break;
         if (!--connectAttempts) {
@@ -192,7 +243,7 @@ bool ClangIndexer::exec(const String &data)
     assert(mConnection->isConnected());
     assert(mSource.fileId);
     mIndexDataMessage.files()[mSource.fileId] |= IndexDataMessage::Visited;
-    parse() && visit() && diagnose();
+    parse() && visitInclusions() && visit() && diagnose();
     String message = mSourceFile.toTilde();
     String err;
     StopWatch sw;
@@ -204,6 +255,10 @@ bool ClangIndexer::exec(const String &data)
     } else {
         writeDuration = sw.elapsed();
     }
+    mIndexDataMessage.setParseDuration(mParseDuration);
+    mIndexDataMessage.setVisitDuration(mVisitDuration);
+    mIndexDataMessage.setWriteDuration(std::max(writeDuration, 0));
+    mIndexDataMessage.setPeakMemory(peakMemory());
     message += String::format<16>(" in %lldms. ", mTimer.elapsed());
     int cursorCount = 0;
     int symbolNameCount = 0;
@@ -229,6 +284,8 @@ bool ClangIndexer::exec(const String &data)
     } else if (mIndexDataMessage.indexerJobFlags() & IndexerJob::Reindex) {
         message += " (reindex)";
     }
+    if (mEngine == CallbackEngine)
+        message += " (callbacks)";
 
 
     mIndexDataMessage.setMessage(message);
@@ -238,7 +295,9 @@ bool ClangIndexer::exec(const String &data)
         return false;
     }
     mConnection->finished().connect(std::bind(&EventLoop::quit, EventLoop::eventLoop()));
-    if (EventLoop::eventLoop()->exec(mIndexDataMessageTimeout) == EventLoop::Timeout) {
+    const bool timedOut = EventLoop::eventLoop()->exec(mIndexDataMessageTimeout) == EventLoop::Timeout;
+    mConnection->finished().disconnect();
+    if (timedOut) {
         error() << "Timed out sending IndexDataMessage" << mSourceFile;
         return false;
     }
@@ -253,7 +312,7 @@ void ClangIndexer::onMessage(const std::shared_ptr<Message> &msg, const std::sha
     assert(msg->messageId() == VisitFileResponseMessage::MessageId);
     const std::shared_ptr<VisitFileResponseMessage> vm = std::static_pointer_cast<VisitFileResponseMessage>(msg);
     mVisitFileResponseMessageVisit = vm->visit();
-    mVisitFileResponseMessageFileId = vm->fileId();
+    mVisitFileResponseMessageFileIds = vm->fileIds();
     assert(EventLoop::eventLoop());
     EventLoop::eventLoop()->quit();
 }
@@ -284,71 +343,136 @@ Location ClangIndexer::createLocation(const Path &sourceFile, unsigned int line,
         if (blockedPtr) {
             Hash<uint32_t, Flags<IndexDataMessage::FileFlag> >::iterator it = mIndexDataMessage.files().find(id);
             if (it == mIndexDataMessage.files().end()) {
-                // the only reason we already have an id for a file that isn't
-                // in the mIndexDataMessage.mFiles is that it's blocked from the outset.
-                // The assumption is that we never will go and fetch a file id
-                // for a location without passing blockedPtr since any reference
-                // to a symbol in another file should have been preceded by that
-                // header in which case we would have to make a decision on
-                // whether or not to index it. This is a little hairy but we
-                // have to try to optimize this process.
-#ifndef NDEBUG
+                if (isBlocked(id)) {
+                    // blocked from the outset. The assumption is that we
+                    // never will go and fetch a file id for a location
+                    // without passing blockedPtr since any reference to a
+                    // symbol in another file should have been preceded by
+                    // that header in which case we would have to make a
+                    // decision on whether or not to index it.
+                    mIndexDataMessage.files()[id] = IndexDataMessage::NoFileFlag;
+                    *blockedPtr = true;
+                    return Location();
+                }
+                // an id a worker remembers from an earlier job, this job
+                // hasn't asked about the file yet
                 if (resolved.isEmpty())
-                    resolved = sourceFile.resolved();
-#endif
-                assert(id);
-                mIndexDataMessage.files()[id] = IndexDataMessage::NoFileFlag;
-                *blockedPtr = true;
-                return Location();
+                    resolved = Location::path(id);
             } else if (!it->second) {
                 *blockedPtr = true;
                 return Location();
+            } else {
+                return Location(id, line, col);
             }
+        } else {
+            return Location(id, line, col);
         }
-        return Location(id, line, col);
     }
 
-    ++mFileIdsQueried;
-    VisitFileMessage msg(resolved, mProject, mIndexDataMessage.key());
+    // normally visitInclusions() has already claimed all files
+    visitFiles(List<Path>() << resolved);
+    id = Location::fileId(resolved);
+    if (!id)
+        return Location();
+
+    if (resolved != sourceFile)
+        Location::set(sourceFile, id);
+
+    if (blockedPtr && !(mIndexDataMessage.files().value(id) & IndexDataMessage::Visited)) {
+        *blockedPtr = true;
+        return Location();
+    }
+    return Location(id, line, col);
+}
+
+void ClangIndexer::visitFiles(const List<Path> &files)
+{
+    assert(!files.isEmpty());
+    mFileIdsQueried += files.size();
+    VisitFileMessage msg(files, mProject, mIndexDataMessage.key());
 
-    mVisitFileResponseMessageFileId = UINT_MAX;
-    mVisitFileResponseMessageVisit = false;
+    mVisitFileResponseMessageFileIds.clear();
+    mVisitFileResponseMessageVisit.clear();
     mConnection->send(msg);
     StopWatch sw;
     EventLoop::eventLoop()->exec(mVisitFileTimeout);
     const int elapsed = sw.elapsed();
     mFileIdsQueriedTime += elapsed;
-    switch (mVisitFileResponseMessageFileId) {
-    case 0:
-        return Location();
-    case UINT_MAX:
+    if (mVisitFileResponseMessageFileIds.size() != files.size()) {
         // timed out.
-        if (mVisitFileResponseMessageFileId == UINT_MAX) {
-            error() << "Error getting fileId for" << resolved << mLastCursor
-                    << elapsed << mVisitFileTimeout;
-        }
+        error() << "Error getting fileIds for" << files << mLastCursor
+                << elapsed << mVisitFileTimeout;
         exit(1);
-    default:
-        id = mVisitFileResponseMessageFileId;
-        break;
     }
-    assert(id);
-    Flags<IndexDataMessage::FileFlag> &flags = mIndexDataMessage.files()[id];
-    if (mVisitFileResponseMessageVisit) {
-        flags |= IndexDataMessage::Visited;
-        ++mIndexed;
+
+    for (size_t i=0; i<files.size(); ++i) {
+        const uint32_t id = mVisitFileResponseMessageFileIds.at(i);
+        if (!id)
+            continue;
+        Flags<IndexDataMessage::FileFlag> &flags = mIndexDataMessage.files()[id];
+        if (mVisitFileResponseMessageVisit.contains(id) && !(flags & IndexDataMessage::Visited)) {
+            flags |= IndexDataMessage::Visited;
+            ++mIndexed;
+        }
+        Location::set(files.at(i), id);
     }
-    // fprintf(mLogFile, "%s %s\n", file.second ? "WON" : "LOST", resolved.constData());
+}
 
-    Location::set(resolved, id);
-    if (resolved != sourceFile)
-        Location::set(sourceFile, id);
+static void inclusionVisitor(CXFile includedFile, CXSourceLocation *, unsigned int, CXClientData userData)
+{
+    CXString fn = clang_getFileName(includedFile);
+    const char *cstr = clang_getCString(fn);
+    if (cstr && *cstr)
+        reinterpret_cast<Set<Path> *>(userData)->insert(cstr);
+    clang_disposeString(fn);
+}
 
-    if (blockedPtr && !mVisitFileResponseMessageVisit) {
-        *blockedPtr = true;
-        return Location();
+// Claims all the files in the translation unit with a single VisitFileMessage
+// rather than one round trip per file from createLocation.
+bool ClangIndexer::visitInclusions()
+{
+    Set<Path> included;
+    clang_getInclusions(mTranslationUnit->unit, inclusionVisitor, &included);
+    List<Path> files;
+    Set<Path> seen;
+    Hash<Path, Path> unresolved;
+    // a worker remembers ids from earlier jobs, those files still have to
+    // be claimed for this one
+    auto claimed = [this](uint32_t id) {
+        return mIndexDataMessage.files().contains(id) || isBlocked(id);
+    };
+    for (const Path &path : included) {
+        if (const uint32_t id = Location::fileId(path)) {
+            if (!claimed(id)) {
+                const Path resolved = Location::path(id);
+                if (seen.insert(resolved))
+                    files << resolved;
+            }
+            continue;
+        }
+        bool ok;
+        const Path resolved = path.resolved(Path::RealPath, Path(), &ok);
+        if (!ok)
+            continue;
+        if (const uint32_t id = Location::fileId(resolved)) {
+            Location::set(path, id);
+            if (!claimed(id) && seen.insert(resolved))
+                files << resolved;
+            continue;
+        }
+        if (seen.insert(resolved))
+            files << resolved;
+        if (resolved != path)
+            unresolved[path] = resolved;
     }
-    return Location(id, line, col);
+    if (!files.isEmpty()) {
+        visitFiles(files);
+        for (const auto &it : unresolved) {
+            if (const uint32_t id = Location::fileId(it.second))
+                Location::set(it.first, id);
+        }
+    }
+    return true;
 }
 
 static inline void tokenize(const char *buf, int start,
@@ -1773,7 +1897,7 @@ bool ClangIndexer::parse()
     StopWatch sw;
     assert(!mTranslationUnit);
     Flags<Source::CommandLineFlag> commandLineFlags = Source::Default;
-    if (ClangIndexer::serverOpts() & Server::PCHEnabled)
+    if (ClangIndexer::serverOpts() & (Server::PCHEnabled|Server::AutoPCH))
         commandLineFlags |= Source::PCHEnabled;
 
     Flags<CXTranslationUnit_Flags> flags = CXTranslationUnit_DetailedPreprocessingRecord;
@@ -1811,8 +1935,12 @@ bool ClangIndexer::parse()
     if (usedPch)
         mIndexDataMessage.setFlag(IndexDataMessage::UsedPCH);
 
-    mTranslationUnit = RTags::TranslationUnit::create(mSourceFile, args, &unsavedFiles[0],
-                                                      unsavedIndex, flags);
+    if (mEngine == CallbackEngine) {
+        mTranslationUnit = indexSourceFile(args, &unsavedFiles[0], unsavedIndex, flags);
+    } else {
+        mTranslationUnit = RTags::TranslationUnit::create(mSourceFile, args, &unsavedFiles[0],
+                                                          unsavedIndex, flags);
+    }
 
     warning() << "CI::parse loading unit:" << mTranslationUnit->clangLine << " " << (mTranslationUnit->unit != 0);
     if (mTranslationUnit->unit) {
@@ -1834,6 +1962,108 @@ bool ClangIndexer::parse()
     return false;
 }
 
+// The index action lives as long as the rp process so that
+// CXIndexOpt_SkipParsedBodiesInSession skips the function bodies of every file
+// an earlier job parsed. Those files are normally blocked, if this job may
+// index one of them the session is started over.
+struct IndexSession {
+    IndexSession()
+        : index(0), action(0), connection(0)
+    {}
+    ~IndexSession()
+    {
+        reset();
+    }
+    void reset()
+    {
+        if (action)
+            clang_IndexAction_dispose(action);
+        if (index)
+            clang_disposeIndex(index);
+        index = 0;
+        action = 0;
+        files.clear();
+    }
+    CXIndex index;
+    CXIndexAction action;
+    Set<Path> files;
+    Connection *connection;
+};
+static IndexSession sSession;
+
+static void addSessionFile(CXFile file)
+{
+    CXString fn = clang_getFileName(file);
+    const char *cstr = clang_getCString(fn);
+    if (cstr && *cstr)
+        sSession.files.insert(Path::resolved(cstr));
+    clang_disposeString(fn);
+}
+
+static int indexAbortQuery(CXClientData, void *)
+{
+    // no one is waiting for the result
+    return !sSession.connection->isConnected();
+}
+
+static CXIdxClientFile indexEnteredMainFile(CXClientData, CXFile file, void *)
+{
+    addSessionFile(file);
+    return 0;
+}
+
+static CXIdxClientFile indexIncludedFile(CXClientData, const CXIdxIncludedFileInfo *info)
+{
+    addSessionFile(info->file);
+    return 0;
+}
+
+std::shared_ptr<RTags::TranslationUnit> ClangIndexer::indexSourceFile(const List<String> &args,
+                                                                      CXUnsavedFile *unsaved, int unsavedCount,
+                                                                      Flags<CXTranslationUnit_Flags> flags)
+{
+    for (const Path &file : sSession.files) {
+        const uint32_t fileId = Location::fileId(file);
+        if (file == mSourceFile || !fileId || !isBlocked(fileId)) {
+            sSession.reset();
+            break;
+        }
+    }
+    if (!sSession.index) {
+        sSession.index = clang_createIndex(0, 1);
+        sSession.action = clang_IndexAction_create(sSession.index);
+    }
+    sSession.connection = mConnection.get();
+
+    // the TranslationUnit doesn't own the session's index
+    std::shared_ptr<RTags::TranslationUnit> ret(new RTags::TranslationUnit);
+    ret->clangLine = "clang ";
+    List<const char*> clangArgs;
+    clangArgs.reserve(args.size());
+    for (const String &arg : args) {
+        clangArgs.append(arg.constData());
+        String quoted = arg;
+        quoted.replace("\"", "\\\"");
+        ret->clangLine += '"' + quoted + "\" ";
+    }
+    ret->clangLine += mSourceFile;
+
+    IndexerCallbacks callbacks = {
+        indexAbortQuery, 0, indexEnteredMainFile, indexIncludedFile, 0, 0, 0, 0
+    };
+    if (clang_indexSourceFile(sSession.action, 0, &callbacks, sizeof(callbacks), CXIndexOpt_SkipParsedBodiesInSession,
+                              mSourceFile.constData(), clangArgs.data(), clangArgs.size(), unsaved, unsavedCount,
+                              &ret->unit, flags.cast<unsigned int>())) {
+        if (ret->unit) {
+            clang_disposeTranslationUnit(ret->unit);
+            ret->unit = 0;
+        }
+        // the session may know about files that weren't parsed completely
+        sSession.reset();
+    }
+    return ret;
+}
+
 static inline Map<String, Set<Location> > convertTargets(const Map<Location, Map<String, uint16_t> > &in, bool hasRoot)
 {
     Map<String, Set<Location> > ret;
@@ -1867,9 +2097,9 @@ static inline void encodeSymbols(Map<Location, Symbol> &symbols)
 
 bool ClangIndexer::writeFiles(const Path &root, String &error)
 {
-    size_t bytesWritten = 0;
-    const Path p = Sandbox::encoded(mSourceFile);
     const bool hasRoot = Sandbox::hasRoot();
+    String segment;
+    auto &entries = mIndexDataMessage.segmentEntries();
     for (const auto &unit : mUnits) {
         if (!(mIndexDataMessage.files().value(unit.first) & IndexDataMessage::Visited)) {
             ::error() << "Wanting to write something for"
@@ -1883,24 +2113,6 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
             continue;
         }
         assert(mIndexDataMessage.files().value(unit.first) & IndexDataMessage::Visited);
-        String unitRoot = root;
-        unitRoot << unit.first;
-        Path::mkdir(unitRoot, Path::Recursive);
-        if (unit.first != mSource.fileId) {
-            FILE *f = fopen((unitRoot + "/info").constData(), "w");
-            if (!f)
-                return false;
-            bytesWritten += fprintf(f, "Indexed by %s at %llu\n", p.constData(), static_cast<unsigned long long>(mIndexDataMessage.parseTime()));
-            fclose(f);
-        }
-
-        // ::error() << "Writing file" << Location::path(unit.first) << unitRoot << unit.second->symbols.size()
-        //           << unit.second->targets.size()
-        //           << unit.second->usrs.size()
-        //           << unit.second->symbolNames.size();
-        uint32_t fileMapOpts = 0;
-        if (ClangIndexer::serverOpts() & Server::NoFileLock)
-            fileMapOpts |= FileMap<int, int>::NoLock;
 
         if (hasRoot) {
             encodeSymbols(unit.second->symbols);
@@ -1908,56 +2120,29 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
             Sandbox::encode(unit.second->symbolNames);
         }
 
-        size_t w;
-        // for (const char *name : { "/symbols", "/targets", "/usrs", "/symnames", "/tokens" }) {
-        //     if (Path::exists(unitRoot + "/symbols"))
-        //         ::error() << (unitRoot + name) << "already exists";
-        // }
-        if (!(w = FileMap<Location, Symbol>::write(unitRoot + "/symbols", unit.second->symbols, fileMapOpts))) {
-            error = "Failed to write symbols";
-            return false;
-        }
-        bytesWritten += w;
-
-        if (!(w = FileMap<String, Set<Location> >::write(unitRoot + "/targets", convertTargets(unit.second->targets, hasRoot), fileMapOpts))) {
-            error = "Failed to write targets";
-            return false;
-        }
-        bytesWritten += w;
-
-        if (!(w += FileMap<String, Set<Location> >::write(unitRoot + "/usrs", unit.second->usrs, fileMapOpts))) {
-            error = "Failed to write usrs";
-            return false;
-        }
-        bytesWritten += w;
-
-        if (!(w += FileMap<String, Set<Location> >::write(unitRoot + "/symnames", unit.second->symbolNames, fileMapOpts))) {
-            error = "Failed to write symbolNames";
-            return false;
-        }
-        bytesWritten += w;
-
-        if (!(w += FileMap<uint32_t, Token>::write(unitRoot + "/tokens", unit.second->tokens, fileMapOpts))) {
-            error = "Failed to write symbolNames";
-            return false;
-        }
-        bytesWritten += w;
+        SegmentEntry &entry = entries[unit.first];
+        entry.segment = mSegment;
+        auto append = [&segment, &entry](SegmentEntry::FileMapType type, const String &data) {
+            entry.offsets[type] = segment.size();
+            entry.sizes[type] = data.size();
+            segment.append(data);
+        };
+        append(SegmentEntry::Symbols, FileMap<Location, Symbol>::encode(unit.second->symbols));
+        append(SegmentEntry::SymbolNames, FileMap<String, Set<Location> >::encode(unit.second->symbolNames));
+        append(SegmentEntry::Targets, FileMap<String, Set<Location> >::encode(convertTargets(unit.second->targets, hasRoot)));
+        append(SegmentEntry::Usrs, FileMap<String, Set<Location> >::encode(unit.second->usrs));
+        append(SegmentEntry::Tokens, TokenMap::encode(unit.first, unit.second->tokens));
     }
-    String sourceRoot = root;
-    sourceRoot << mSource.fileId;
-    Path::mkdir(sourceRoot, Path::Recursive);
-    sourceRoot << "/info";
-    FILE *f = fopen(sourceRoot.constData(), "w");
-    if (!f) {
+
+    if (entries.isEmpty())
+        return true;
+    const Path path = SegmentEntry::path(root, mSegment);
+    if (!SegmentEntry::write(path, segment)) {
+        entries.clear();
+        error = "Failed to write " + path;
         return false;
     }
-
-    const String args = Sandbox::encoded(String::join(mSource.toCommandLine(Source::Default|Source::IncludeCompiler|Source::IncludeSourceFile), ' '));
-
-    bytesWritten += fprintf(f, "%s\n%s\nIndexed at %llu\n", p.constData(), args.constData(),
-                            static_cast<unsigned long long>(mIndexDataMessage.parseTime()));
-    fclose(f);
-    mIndexDataMessage.setBytesWritten(bytesWritten);
+    mIndexDataMessage.setBytesWritten(segment.size());
     return true;
 }
 
@@ -34,7 +34,8 @@ public:
     static const CXSourceLocation nullLocation;
     static const CXCursor nullCursor;
 
-    ClangIndexer();
+    // rp --worker passes the same connection to the indexer of every job
+    ClangIndexer(const std::shared_ptr<Connection> &connection = std::shared_ptr<Connection>());
     ~ClangIndexer();
 
     bool exec(const String &data);
@@ -44,6 +45,11 @@ private:
     bool diagnose();
     bool visit();
     bool parse();
+    std::shared_ptr<RTags::TranslationUnit> indexSourceFile(const List<String> &args,
+                                                            CXUnsavedFile *unsaved, int unsavedCount,
+                                                            Flags<CXTranslationUnit_Flags> flags);
+    bool visitInclusions();
+    void visitFiles(const List<Path> &files);
     void tokenize(CXFile file, uint32_t fileId, const Path &path);
     bool writeFiles(const Path &root, String &error);
 
@@ -101,6 +107,11 @@ private:
         return createLocation(location, blocked, offset);
     }
     Location createLocation(const Path &file, unsigned int line, unsigned int col, bool *blocked = 0);
+    // whether other jobs had claimed fileId when rdm started this one
+    bool isBlocked(uint32_t fileId) const
+    {
+        return mBlockedFiles.contains(fileId) || Location::inSnapshot(fileId);
+    }
     String addNamePermutations(const CXCursor &cursor,
                                Location location,
                                RTags::CursorType cursorType);
@@ -168,21 +179,32 @@ private:
 
     Hash<uint32_t, std::shared_ptr<Unit> > mUnits;
 
+    // Selected with "index-engine: callbacks" in .rtags-config. The
+    // callbacks engine parses with clang_indexSourceFile() and skips the
+    // function bodies of files this rp has already parsed, the result is
+    // walked the same way.
+    enum IndexEngine {
+        CursorEngine,
+        CallbackEngine
+    } mEngine;
+
     Path mProject;
     Source mSource;
     Path mSourceFile;
     IndexDataMessage mIndexDataMessage;
+    Hash<uint32_t, Path> mBlockedFiles;
     std::shared_ptr<RTags::TranslationUnit> mTranslationUnit;
     CXCursor mLastCursor;
     Symbol *mLastCallExprSymbol;
     Location mLastClass;
-    uint32_t mVisitFileResponseMessageFileId;
-    bool mVisitFileResponseMessageVisit;
+    List<uint32_t> mVisitFileResponseMessageFileIds;
+    Set<uint32_t> mVisitFileResponseMessageVisit;
     Path mSocketFile;
     StopWatch mTimer;
     int mParseDuration, mVisitDuration, mBlocked, mAllowed,
         mIndexed, mVisitFileTimeout, mIndexDataMessageTimeout,
         mFileIdsQueried, mFileIdsQueriedTime, mCursorsVisited;
+    uint32_t mSegment;
     UnsavedFiles mUnsavedFiles;
     List<String> mDebugLocations;
     FILE *mLogFile;
@@ -0,0 +1,296 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "CompileCommandsReader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+CompileCommandsReader::CompileCommandsReader()
+    : mMapped(0), mSize(0), mPos(0), mEnd(0)
+{
+}
+
+CompileCommandsReader::~CompileCommandsReader()
+{
+    if (mMapped)
+        munmap(mMapped, mSize);
+}
+
+bool CompileCommandsReader::open(const Path &path, String *error)
+{
+    const int fd = ::open(path.constData(), O_RDONLY);
+    if (fd == -1) {
+        mError = String::format<256>("Can't open %s (%d)", path.constData(), errno);
+    } else {
+        struct stat st;
+        if (fstat(fd, &st)) {
+            mError = String::format<256>("Can't stat %s (%d)", path.constData(), errno);
+        } else if (st.st_size) {
+            mSize = st.st_size;
+            mMapped = mmap(0, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mMapped == MAP_FAILED) {
+                mMapped = 0;
+                mError = String::format<256>("Can't map %s (%d)", path.constData(), errno);
+            } else {
+                madvise(mMapped, mSize, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+    }
+    if (!mMapped && mError.isEmpty())
+        mError = path + " is empty";
+    if (!mError.isEmpty()) {
+        if (error)
+            *error = mError;
+        return false;
+    }
+    mPos = static_cast<const char*>(mMapped);
+    mEnd = mPos + mSize;
+    return true;
+}
+
+static inline const char *skipSpace(const char *pos, const char *end)
+{
+    while (pos < end && (*pos == ' ' || *pos == '\n' || *pos == '\r' || *pos == '\t'))
+        ++pos;
+    return pos;
+}
+
+// pos is at the opening quote, returns the position after the closing one
+static inline const char *skipString(const char *pos, const char *end)
+{
+    for (++pos; pos < end; ++pos) {
+        if (*pos == '\\') {
+            ++pos;
+        } else if (*pos == '"') {
+            return pos + 1;
+        }
+    }
+    return 0;
+}
+
+// Skips an object, array, string or literal
+static const char *skipValue(const char *pos, const char *end)
+{
+    int depth = 0;
+    while (pos < end) {
+        switch (*pos) {
+        case '"':
+            pos = skipString(pos, end);
+            if (!pos)
+                return 0;
+            if (!depth)
+                return pos;
+            continue;
+        case '{':
+        case '[':
+            ++depth;
+            break;
+        case '}':
+        case ']':
+            if (!depth)
+                return pos;
+            if (!--depth)
+                return pos + 1;
+            break;
+        case ',':
+            if (!depth)
+                return pos;
+            break;
+        }
+        ++pos;
+    }
+    return depth ? 0 : pos;
+}
+
+bool CompileCommandsReader::next(const char **begin, const char **end)
+{
+    if (!mPos)
+        return false;
+    if (mPos == static_cast<const char*>(mMapped)) {
+        mPos = skipSpace(mPos, mEnd);
+        if (mPos == mEnd || *mPos != '[') {
+            mError = "Expected [";
+            mPos = 0;
+            return false;
+        }
+        ++mPos;
+    }
+    mPos = skipSpace(mPos, mEnd);
+    if (mPos < mEnd && *mPos == ',')
+        mPos = skipSpace(mPos + 1, mEnd);
+    if (mPos < mEnd && *mPos == ']') {
+        mPos = 0;
+        return false;
+    }
+    if (mPos == mEnd || *mPos != '{') {
+        mError = String::format<64>("Expected { at offset %zu", static_cast<size_t>(mPos - static_cast<const char*>(mMapped)));
+        mPos = 0;
+        return false;
+    }
+    const char *objectEnd = skipValue(mPos, mEnd);
+    if (!objectEnd) {
+        mError = "Unterminated entry";
+        mPos = 0;
+        return false;
+    }
+    *begin = mPos;
+    *end = objectEnd;
+    mPos = objectEnd;
+    return true;
+}
+
+static inline void appendUtf8(String &out, uint32_t c)
+{
+    if (c < 0x80) {
+        out.append(static_cast<char>(c));
+    } else if (c < 0x800) {
+        out.append(static_cast<char>(0xc0 | (c >> 6)));
+        out.append(static_cast<char>(0x80 | (c & 0x3f)));
+    } else if (c < 0x10000) {
+        out.append(static_cast<char>(0xe0 | (c >> 12)));
+        out.append(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+        out.append(static_cast<char>(0x80 | (c & 0x3f)));
+    } else {
+        out.append(static_cast<char>(0xf0 | (c >> 18)));
+        out.append(static_cast<char>(0x80 | ((c >> 12) & 0x3f)));
+        out.append(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+        out.append(static_cast<char>(0x80 | (c & 0x3f)));
+    }
+}
+
+static inline bool readHex(const char *pos, const char *end, uint32_t *out)
+{
+    if (end - pos < 4)
+        return false;
+    uint32_t ret = 0;
+    for (int i=0; i<4; ++i) {
+        const char ch = pos[i];
+        ret <<= 4;
+        if (ch >= '0' && ch <= '9') {
+            ret |= ch - '0';
+        } else if (ch >= 'a' && ch <= 'f') {
+            ret |= ch - 'a' + 10;
+        } else if (ch >= 'A' && ch <= 'F') {
+            ret |= ch - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+    *out = ret;
+    return true;
+}
+
+// pos is at the opening quote
+static const char *readString(const char *pos, const char *end, String &out)
+{
+    out.clear();
+    const char *start = ++pos;
+    while (pos < end) {
+        if (*pos == '"') {
+            out.append(start, pos - start);
+            return pos + 1;
+        } else if (*pos != '\\') {
+            ++pos;
+            continue;
+        }
+        out.append(start, pos - start);
+        if (++pos == end)
+            return 0;
+        switch (*pos) {
+        case 'b': out.append('\b'); break;
+        case 'f': out.append('\f'); break;
+        case 'n': out.append('\n'); break;
+        case 'r': out.append('\r'); break;
+        case 't': out.append('\t'); break;
+        case 'u': {
+            uint32_t c;
+            if (!readHex(pos + 1, end, &c))
+                return 0;
+            pos += 4;
+            if (c >= 0xd800 && c < 0xdc00 && end - pos > 6 && pos[1] == '\\' && pos[2] == 'u') {
+                uint32_t low;
+                if (readHex(pos + 3, end, &low) && low >= 0xdc00 && low < 0xe000) {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                    pos += 6;
+                }
+            }
+            appendUtf8(out, c);
+            break; }
+        default:
+            out.append(*pos);
+            break;
+        }
+        start = ++pos;
+    }
+    return 0;
+}
+
+bool CompileCommandsReader::parse(const char *pos, const char *end, Command &command)
+{
+    if (pos == end || *pos != '{')
+        return false;
+    bool hasArguments = false;
+    String key, value;
+    pos = skipSpace(pos + 1, end);
+    while (pos < end && *pos != '}') {
+        if (*pos != '"' || !(pos = readString(pos, end, key)))
+            return false;
+        pos = skipSpace(pos, end);
+        if (pos == end || *pos != ':')
+            return false;
+        pos = skipSpace(pos + 1, end);
+        if (pos == end)
+            return false;
+        if (key == "arguments" && *pos == '[') {
+            hasArguments = true;
+            pos = skipSpace(pos + 1, end);
+            while (pos < end && *pos != ']') {
+                if (*pos != '"' || !(pos = readString(pos, end, value)))
+                    return false;
+                command.arguments.append(value);
+                pos = skipSpace(pos, end);
+                if (pos < end && *pos == ',')
+                    pos = skipSpace(pos + 1, end);
+            }
+            if (pos == end)
+                return false;
+            ++pos;
+        } else if (*pos == '"' && (key == "directory" || key == "file" || key == "command")) {
+            if (!(pos = readString(pos, end, value)))
+                return false;
+            if (key == "directory") {
+                command.directory = value;
+            } else if (key == "file") {
+                command.file = value;
+            } else {
+                command.command = value;
+            }
+        } else if (!(pos = skipValue(pos, end))) {
+            return false;
+        }
+        pos = skipSpace(pos, end);
+        if (pos < end && *pos == ',')
+            pos = skipSpace(pos + 1, end);
+    }
+    if (hasArguments)
+        command.command.clear();
+    return pos < end && !command.directory.isEmpty() && (hasArguments || !command.command.isEmpty());
+}
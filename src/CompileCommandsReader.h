@@ -0,0 +1,51 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef CompileCommandsReader_h
+#define CompileCommandsReader_h
+
+#include "rct/List.h"
+#include "rct/Path.h"
+#include "rct/String.h"
+
+// Reads a compile_commands.json an entry at a time without building a
+// document. The file is mapped, next() only finds where the next entry
+// starts and ends so the entries can be parsed on other threads.
+class CompileCommandsReader
+{
+public:
+    CompileCommandsReader();
+    ~CompileCommandsReader();
+
+    bool open(const Path &path, String *error = 0);
+    // false at the end of the array or if the file is malformed, see error()
+    bool next(const char **begin, const char **end);
+    const String &error() const { return mError; }
+
+    struct Command {
+        Path directory, file;
+        // an entry has either "arguments" or "command"
+        String command;
+        List<String> arguments;
+    };
+    static bool parse(const char *begin, const char *end, Command &command);
+private:
+    void *mMapped;
+    size_t mSize;
+    const char *mPos, *mEnd;
+    String mError;
+};
+
+#endif
@@ -0,0 +1,143 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ConcurrencyController.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "rct/Rct.h"
+#include "rct/ThreadPool.h"
+
+enum {
+    MemoryPressureHigh = 10,
+    CPUPressureHigh = 40,
+    // PSI avg10 lags a cut by about this long, wait it out before cutting
+    // again or growing
+    SettleTime = 10000
+};
+
+ConcurrencyController::ConcurrencyController()
+    : mLimit(0), mLastSample(0), mLastCut(0), mPeakMemory(0), mReason("")
+{
+}
+
+static double readPressure(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    double ret = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "some avg10=%lf", &ret) == 1)
+            break;
+    }
+    fclose(f);
+    return ret;
+}
+
+static uint64_t readMemoryAvailable()
+{
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (!f)
+        return 0;
+    unsigned long long kb = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+ConcurrencyController::Load ConcurrencyController::load()
+{
+    Load ret;
+    ret.memoryAvailable = readMemoryAvailable();
+    ret.memoryPressure = readPressure("/proc/pressure/memory");
+    ret.cpuPressure = readPressure("/proc/pressure/cpu");
+    double avg;
+    if (getloadavg(&avg, 1) == 1)
+        ret.loadAverage = avg;
+    return ret;
+}
+
+size_t ConcurrencyController::limit(size_t max, size_t active)
+{
+    max = std::max<size_t>(max, 1);
+    const uint64_t now = Rct::monoMs();
+    if (mLimit && now - mLastSample < SampleInterval)
+        return std::min(mLimit, max);
+    mLastSample = now;
+    mLoad = load();
+
+    size_t limit = mLimit ? mLimit : max;
+    const size_t cpus = std::max(ThreadPool::idealThreadCount(), 1);
+    const bool settling = mLastCut && now - mLastCut < SettleTime;
+    if (mLoad.memoryPressure >= MemoryPressureHigh) {
+        // tasks are stalling on memory, back off hard before the OOM killer
+        // gets involved
+        if (!settling) {
+            limit = std::max<size_t>(1, std::min(limit, active) / 2);
+            mLastCut = now;
+        }
+        mReason = "memory pressure";
+    } else if (mLoad.cpuPressure >= CPUPressureHigh || mLoad.loadAverage >= cpus * 1.5) {
+        limit = std::max<size_t>(std::min(limit, active), 2) - 1;
+        mReason = "load";
+    } else {
+        if (!settling)
+            ++limit;
+        mReason = "";
+    }
+
+    // Leave room for one more rp the size of the largest recent one
+    if (mPeakMemory && mLoad.memoryAvailable) {
+        const size_t fits = mLoad.memoryAvailable / mPeakMemory;
+        const size_t memoryLimit = std::max<size_t>(1, active + (fits ? fits - 1 : 0));
+        if (memoryLimit < limit) {
+            limit = memoryLimit;
+            mReason = "available memory";
+        }
+    }
+
+    mLimit = std::min(limit, max);
+    return mLimit;
+}
+
+void ConcurrencyController::onJobFinished(uint64_t peakMemory)
+{
+    if (peakMemory >= mPeakMemory) {
+        mPeakMemory = peakMemory;
+    } else {
+        mPeakMemory = ((mPeakMemory * 3) + peakMemory) / 4;
+    }
+}
+
+String ConcurrencyController::toString() const
+{
+    String ret = String::format<256>("%zu jobs", mLimit);
+    if (*mReason)
+        ret += String::format<64>(" (limited by %s)", mReason);
+    ret += String::format<256>(", rp peak %lluMB, %lluMB available, pressure memory %.1f cpu %.1f, load %.2f",
+                               static_cast<unsigned long long>(mPeakMemory / (1024 * 1024)),
+                               static_cast<unsigned long long>(mLoad.memoryAvailable / (1024 * 1024)),
+                               mLoad.memoryPressure, mLoad.cpuPressure, mLoad.loadAverage);
+    return ret;
+}
@@ -0,0 +1,57 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ConcurrencyController_h
+#define ConcurrencyController_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "rct/String.h"
+
+// Decides how many rp processes may run at once when rdm runs with
+// --adaptive-jobs. The limit backs off when the system is short on memory or
+// overloaded and creeps back up to the configured job count when it isn't.
+class ConcurrencyController
+{
+public:
+    ConcurrencyController();
+
+    enum { SampleInterval = 1000 };
+
+    // max is the configured job count, active the number of running rp's
+    size_t limit(size_t max, size_t active);
+    size_t current() const { return mLimit; }
+    void onJobFinished(uint64_t peakMemory);
+    String toString() const;
+
+    struct Load {
+        Load()
+            : memoryAvailable(0), memoryPressure(-1), cpuPressure(-1), loadAverage(-1)
+        {}
+        uint64_t memoryAvailable;
+        // PSI "some" avg10, -1 if /proc/pressure isn't there
+        double memoryPressure, cpuPressure;
+        double loadAverage;
+    };
+    static Load load();
+private:
+    size_t mLimit;
+    uint64_t mLastSample, mLastCut, mPeakMemory;
+    Load mLoad;
+    const char *mReason;
+};
+
+#endif
@@ -0,0 +1,385 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#include "DependencyGraph.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <iterator>
+
+size_t DependencyGraph::edgeCount(uint32_t fileId, Direction direction) const
+{
+    const int idx = indexOf(fileId);
+    if (idx == -1)
+        return 0;
+    size_t ret = mRows[direction].at(idx).count;
+    auto delta = mDeltas[direction].find(fileId);
+    if (delta != mDeltas[direction].end())
+        ret += delta->second.added.size() - delta->second.removed.size();
+    return ret;
+}
+
+bool DependencyGraph::hasEdge(uint32_t fileId, uint32_t other, Direction direction) const
+{
+    const int idx = indexOf(fileId);
+    if (idx == -1)
+        return false;
+    auto delta = mDeltas[direction].find(fileId);
+    if (delta != mDeltas[direction].end()) {
+        if (delta->second.added.contains(other))
+            return true;
+        if (delta->second.removed.contains(other))
+            return false;
+    }
+    return packedEdge(idx, other, direction);
+}
+
+// max number of file ids kept in cached closures
+static const size_t MaxClosureCacheSize = 8 * 1024 * 1024;
+
+std::shared_ptr<const List<uint32_t> > DependencyGraph::closure(uint32_t fileId, Direction direction) const
+{
+    {
+        std::lock_guard<std::mutex> lock(mClosureMutex);
+        auto it = mClosures[direction].find(fileId);
+        if (it != mClosures[direction].end())
+            return it->second;
+    }
+
+    std::shared_ptr<List<uint32_t> > ret = std::make_shared<List<uint32_t> >();
+    if (contains(fileId)) {
+        List<bool> seen;
+        seen.resize(mFiles.size(), false);
+        List<uint32_t> stack;
+        stack.append(fileId);
+        while (!stack.isEmpty()) {
+            const uint32_t file = stack.last();
+            stack.removeLast();
+            visit(file, direction, [&](uint32_t next) {
+                    const int idx = indexOf(next);
+                    if (!seen[idx]) {
+                        seen[idx] = true;
+                        ret->append(next);
+                        stack.append(next);
+                    }
+                });
+        }
+        std::sort(ret->begin(), ret->end());
+    }
+
+    std::lock_guard<std::mutex> lock(mClosureMutex);
+    if (mClosureSize + ret->size() > MaxClosureCacheSize) {
+        for (auto &closures : mClosures)
+            closures.clear();
+        mClosureSize = 0;
+    }
+    auto &cached = mClosures[direction][fileId];
+    if (!cached) {
+        cached = ret;
+        mClosureSize += ret->size();
+    }
+    return cached;
+}
+
+void DependencyGraph::invalidateClosures()
+{
+    std::lock_guard<std::mutex> lock(mClosureMutex);
+    if (mClosureSize || !mClosures[Includes].isEmpty() || !mClosures[Dependents].isEmpty()) {
+        for (auto &closures : mClosures)
+            closures.clear();
+        mClosureSize = 0;
+    }
+}
+
+void DependencyGraph::invalidateClosures(Direction direction, uint32_t fileId)
+{
+    std::lock_guard<std::mutex> lock(mClosureMutex);
+    auto &closures = mClosures[direction];
+    auto it = closures.begin();
+    while (it != closures.end()) {
+        const List<uint32_t> &files = *it->second;
+        if (it->first == fileId || std::binary_search(files.begin(), files.end(), fileId)) {
+            mClosureSize -= files.size();
+            closures.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void DependencyGraph::addEdge(uint32_t fileId, uint32_t other, Direction direction)
+{
+    Delta &delta = mDeltas[direction][fileId];
+    if (delta.removed.remove(other)) {
+        --mDeltaEdges;
+    } else if (delta.added.insert(other)) {
+        ++mDeltaEdges;
+    }
+    if (delta.added.isEmpty() && delta.removed.isEmpty())
+        mDeltas[direction].remove(fileId);
+}
+
+void DependencyGraph::removeEdge(uint32_t fileId, uint32_t other, Direction direction)
+{
+    Delta &delta = mDeltas[direction][fileId];
+    if (delta.added.remove(other)) {
+        --mDeltaEdges;
+    } else if (packedEdge(indexOf(fileId), other, direction) && delta.removed.insert(other)) {
+        ++mDeltaEdges;
+    }
+    if (delta.added.isEmpty() && delta.removed.isEmpty())
+        mDeltas[direction].remove(fileId);
+}
+
+void DependencyGraph::insert(uint32_t fileId)
+{
+    assert(fileId);
+    if (contains(fileId))
+        return;
+    if (fileId >= mSlots.size())
+        mSlots.resize(fileId + 1, 0);
+    mFiles.append(fileId);
+    mSlots[fileId] = mFiles.size();
+    const Row row = { 0, 0 };
+    for (List<Row> &rows : mRows)
+        rows.append(row);
+}
+
+void DependencyGraph::addInclude(uint32_t fileId, uint32_t included)
+{
+    insert(fileId);
+    insert(included);
+    if (hasEdge(fileId, included, Includes))
+        return;
+    addEdge(fileId, included, Includes);
+    addEdge(included, fileId, Dependents);
+    invalidateClosures(Includes, fileId);
+    invalidateClosures(Dependents, included);
+}
+
+void DependencyGraph::setIncludes(uint32_t fileId, const List<uint32_t> &includes)
+{
+    assert(std::is_sorted(includes.begin(), includes.end()));
+    if (!contains(fileId)) {
+        if (includes.isEmpty())
+            return;
+        insert(fileId);
+    }
+    List<uint32_t> current;
+    current.reserve(edgeCount(fileId, Includes));
+    visit(fileId, Includes, [&current](uint32_t included) { current.append(included); });
+    std::sort(current.begin(), current.end());
+    if (current == includes)
+        return;
+
+    List<uint32_t> added, removed;
+    std::set_difference(includes.begin(), includes.end(), current.begin(), current.end(), std::back_inserter(added));
+    std::set_difference(current.begin(), current.end(), includes.begin(), includes.end(), std::back_inserter(removed));
+    for (uint32_t included : added) {
+        insert(included);
+        addEdge(fileId, included, Includes);
+        addEdge(included, fileId, Dependents);
+        invalidateClosures(Dependents, included);
+    }
+    for (uint32_t included : removed) {
+        removeEdge(fileId, included, Includes);
+        removeEdge(included, fileId, Dependents);
+        invalidateClosures(Dependents, included);
+    }
+    invalidateClosures(Includes, fileId);
+}
+
+void DependencyGraph::remove(uint32_t fileId)
+{
+    const int idx = indexOf(fileId);
+    if (idx == -1)
+        return;
+    invalidateClosures();
+    visit(fileId, Includes, [this, fileId](uint32_t included) {
+            removeEdge(included, fileId, Dependents);
+        });
+    visit(fileId, Dependents, [this, fileId](uint32_t dependent) {
+            removeEdge(dependent, fileId, Includes);
+        });
+    for (int direction=Includes; direction<=Dependents; ++direction) {
+        mStaleEdges += mRows[direction].at(idx).count;
+        auto delta = mDeltas[direction].find(fileId);
+        if (delta != mDeltas[direction].end()) {
+            mDeltaEdges -= delta->second.added.size() + delta->second.removed.size();
+            mDeltas[direction].erase(delta);
+        }
+    }
+
+    const uint32_t last = mFiles.last();
+    mFiles[idx] = last;
+    mFiles.removeLast();
+    for (List<Row> &rows : mRows) {
+        rows[idx] = rows.last();
+        rows.removeLast();
+    }
+    mSlots[last] = idx + 1;
+    mSlots[fileId] = 0;
+}
+
+void DependencyGraph::clear()
+{
+    mSlots.clear();
+    mFiles.clear();
+    for (int direction=Includes; direction<=Dependents; ++direction) {
+        mRows[direction].clear();
+        mEdges[direction].clear();
+        mDeltas[direction].clear();
+    }
+    mStaleEdges = mDeltaEdges = 0;
+    invalidateClosures();
+}
+
+void DependencyGraph::compactIfNeeded()
+{
+    const size_t edges = mEdges[Includes].size() + mEdges[Dependents].size();
+    if (mDeltaEdges > std::max<size_t>(4096, edges / 8) || mStaleEdges > std::max<size_t>(4096, edges / 2))
+        compact();
+}
+
+void DependencyGraph::compact()
+{
+    if (!mDeltaEdges && !mStaleEdges)
+        return;
+    for (int direction=Includes; direction<=Dependents; ++direction) {
+        List<uint32_t> edges;
+        edges.reserve(mEdges[direction].size() + mDeltaEdges - std::min(mStaleEdges, mEdges[direction].size()));
+        for (size_t idx=0; idx<mFiles.size(); ++idx) {
+            Row &row = mRows[direction][idx];
+            const uint32_t offset = edges.size();
+            const uint32_t *packed = mEdges[direction].data() + row.offset;
+            auto delta = mDeltas[direction].find(mFiles.at(idx));
+            if (delta != mDeltas[direction].end()) {
+                // merge the packed row minus the removed edges with the added ones, both sorted
+                auto added = delta->second.added.begin();
+                const auto addedEnd = delta->second.added.end();
+                for (uint32_t i=0; i<row.count; ++i) {
+                    if (delta->second.removed.contains(packed[i]))
+                        continue;
+                    while (added != addedEnd && *added < packed[i])
+                        edges.append(*added++);
+                    edges.append(packed[i]);
+                }
+                while (added != addedEnd)
+                    edges.append(*added++);
+            } else {
+                for (uint32_t i=0; i<row.count; ++i)
+                    edges.append(packed[i]);
+            }
+            row.offset = offset;
+            row.count = edges.size() - offset;
+        }
+        mEdges[direction] = std::move(edges);
+        mDeltas[direction].clear();
+    }
+    mStaleEdges = mDeltaEdges = 0;
+}
+
+size_t DependencyGraph::memoryUsage() const
+{
+    size_t ret = (mSlots.capacity() + mFiles.capacity()) * sizeof(uint32_t);
+    for (int direction=Includes; direction<=Dependents; ++direction) {
+        ret += mRows[direction].capacity() * sizeof(Row);
+        ret += mEdges[direction].capacity() * sizeof(uint32_t);
+        for (const auto &delta : mDeltas[direction]) {
+            // rough cost of a hash node and the set nodes
+            ret += 64 + ((delta.second.added.size() + delta.second.removed.size()) * 40);
+        }
+    }
+    std::lock_guard<std::mutex> lock(mClosureMutex);
+    ret += mClosureSize * sizeof(uint32_t);
+    return ret;
+}
+
+bool DependencyGraph::init(List<uint32_t> &&files, const List<uint32_t> &counts, List<uint32_t> &&includes)
+{
+    clear();
+    mFiles = std::move(files);
+    mEdges[Includes] = std::move(includes);
+    if (counts.size() != mFiles.size()) {
+        clear();
+        return false;
+    }
+
+    for (size_t idx=0; idx<mFiles.size(); ++idx) {
+        const uint32_t fileId = mFiles.at(idx);
+        if (!fileId) {
+            clear();
+            return false;
+        }
+        if (fileId >= mSlots.size())
+            mSlots.resize(fileId + 1, 0);
+        if (mSlots.at(fileId)) {
+            clear();
+            return false;
+        }
+        mSlots[fileId] = idx + 1;
+    }
+
+    List<uint32_t> dependentCounts;
+    dependentCounts.resize(mFiles.size(), 0);
+    uint32_t offset = 0;
+    mRows[Includes].reserve(mFiles.size());
+    for (uint32_t count : counts) {
+        if (offset + count > mEdges[Includes].size()) {
+            clear();
+            return false;
+        }
+        uint32_t *edges = mEdges[Includes].data() + offset;
+        std::sort(edges, edges + count);
+        for (uint32_t i=0; i<count; ++i) {
+            const int included = indexOf(edges[i]);
+            if (included == -1) {
+                clear();
+                return false;
+            }
+            ++dependentCounts[included];
+        }
+        const Row row = { offset, count };
+        mRows[Includes].append(row);
+        offset += count;
+    }
+    if (offset != mEdges[Includes].size()) {
+        clear();
+        return false;
+    }
+
+    // transpose the includes into the dependents
+    mRows[Dependents].reserve(mFiles.size());
+    offset = 0;
+    for (uint32_t count : dependentCounts) {
+        const Row row = { offset, 0 };
+        mRows[Dependents].append(row);
+        offset += count;
+    }
+    mEdges[Dependents].resize(offset);
+    for (size_t idx=0; idx<mFiles.size(); ++idx) {
+        const Row &row = mRows[Includes].at(idx);
+        for (uint32_t i=0; i<row.count; ++i) {
+            Row &dependents = mRows[Dependents][indexOf(mEdges[Includes].at(row.offset + i))];
+            mEdges[Dependents][dependents.offset + dependents.count++] = mFiles.at(idx);
+        }
+    }
+    for (const Row &row : mRows[Dependents]) {
+        uint32_t *edges = mEdges[Dependents].data() + row.offset;
+        std::sort(edges, edges + row.count);
+    }
+    return true;
+}
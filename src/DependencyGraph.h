@@ -0,0 +1,166 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#ifndef DependencyGraph_h
+#define DependencyGraph_h
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/Set.h"
+
+// The include graph of a project. Edges live in one packed, sorted array per
+// direction with a (offset, count) row per file. Edges added or removed after
+// the last compaction are kept in a per file delta on top of the packed row
+// until compact() folds them back in.
+//
+// Transitive queries go through closure() which caches the sorted set of
+// files reachable from a file. A change only drops the cached closures it
+// can affect.
+class DependencyGraph
+{
+public:
+    enum Direction {
+        Includes,
+        Dependents
+    };
+
+    DependencyGraph()
+        : mStaleEdges(0), mDeltaEdges(0), mClosureSize(0)
+    {}
+
+    bool contains(uint32_t fileId) const { return indexOf(fileId) != -1; }
+    bool isEmpty() const { return mFiles.isEmpty(); }
+    size_t size() const { return mFiles.size(); }
+    // in no particular order
+    const List<uint32_t> &files() const { return mFiles; }
+
+    template <typename Func>
+    void visit(uint32_t fileId, Direction direction, Func &&func) const
+    {
+        const int idx = indexOf(fileId);
+        if (idx == -1)
+            return;
+        const Row &row = mRows[direction].at(idx);
+        const uint32_t *edges = mEdges[direction].data() + row.offset;
+        auto delta = mDeltas[direction].find(fileId);
+        if (delta == mDeltas[direction].end()) {
+            for (uint32_t i=0; i<row.count; ++i)
+                func(edges[i]);
+            return;
+        }
+        for (uint32_t i=0; i<row.count; ++i) {
+            if (!delta->second.removed.contains(edges[i]))
+                func(edges[i]);
+        }
+        for (uint32_t file : delta->second.added)
+            func(file);
+    }
+    Set<uint32_t> edges(uint32_t fileId, Direction direction) const
+    {
+        Set<uint32_t> ret;
+        visit(fileId, direction, [&ret](uint32_t file) { ret.insert(file); });
+        return ret;
+    }
+    size_t edgeCount(uint32_t fileId, Direction direction) const;
+    bool hasEdge(uint32_t fileId, uint32_t other, Direction direction) const;
+
+    // Files reachable from fileId through one or more edges, sorted
+    std::shared_ptr<const List<uint32_t> > closure(uint32_t fileId, Direction direction) const;
+    bool reaches(uint32_t fileId, uint32_t other, Direction direction) const
+    {
+        const std::shared_ptr<const List<uint32_t> > files = closure(fileId, direction);
+        return std::binary_search(files->begin(), files->end(), other);
+    }
+
+    void insert(uint32_t fileId);
+    // fileId includes included
+    void addInclude(uint32_t fileId, uint32_t included);
+    // Replaces what fileId includes, only the edges that differ are touched.
+    // includes must be sorted and unique.
+    void setIncludes(uint32_t fileId, const List<uint32_t> &includes);
+    void clearIncludes(uint32_t fileId) { setIncludes(fileId, List<uint32_t>()); }
+    void remove(uint32_t fileId);
+    void clear();
+
+    // Folds the deltas back into the packed rows if they have grown large
+    void compactIfNeeded();
+    void compact();
+    size_t memoryUsage() const;
+
+    // [files][include counts][includes], the dependents are rebuilt on load
+    template <typename Stream>
+    void save(Stream &out)
+    {
+        compact();
+        List<uint32_t> counts;
+        counts.reserve(mFiles.size());
+        for (const Row &row : mRows[Includes])
+            counts.append(row.count);
+        out << mFiles << counts << mEdges[Includes];
+    }
+    template <typename Stream>
+    bool load(Stream &in)
+    {
+        List<uint32_t> files, counts, includes;
+        in >> files >> counts >> includes;
+        return init(std::move(files), counts, std::move(includes));
+    }
+private:
+    struct Row {
+        uint32_t offset, count;
+    };
+    // removed is a subset of the packed row, added is disjoint from it
+    struct Delta {
+        Set<uint32_t> added, removed;
+    };
+
+    int indexOf(uint32_t fileId) const
+    {
+        return fileId < mSlots.size() ? static_cast<int>(mSlots.at(fileId)) - 1 : -1;
+    }
+    bool packedEdge(int idx, uint32_t other, Direction direction) const
+    {
+        const Row &row = mRows[direction].at(idx);
+        const uint32_t *edges = mEdges[direction].data() + row.offset;
+        return std::binary_search(edges, edges + row.count, other);
+    }
+    void addEdge(uint32_t fileId, uint32_t other, Direction direction);
+    void removeEdge(uint32_t fileId, uint32_t other, Direction direction);
+    bool init(List<uint32_t> &&files, const List<uint32_t> &counts, List<uint32_t> &&includes);
+    void invalidateClosures();
+    // drops the cached closures of key and the ones that contain fileId
+    void invalidateClosures(Direction direction, uint32_t fileId);
+
+    // fileId -> index + 1, 0 for files not in the graph
+    List<uint32_t> mSlots;
+    List<uint32_t> mFiles;
+    List<Row> mRows[2];
+    List<uint32_t> mEdges[2];
+    Hash<uint32_t, Delta> mDeltas[2];
+    // packed edges of removed files, and the number of edges in mDeltas
+    size_t mStaleEdges, mDeltaEdges;
+
+    mutable std::mutex mClosureMutex;
+    mutable Hash<uint32_t, std::shared_ptr<const List<uint32_t> > > mClosures[2];
+    mutable size_t mClosureSize;
+};
+
+#endif
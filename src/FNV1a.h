@@ -0,0 +1,37 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef FNV1a_h
+#define FNV1a_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace RTags {
+enum : uint64_t { FNV1aSeed = 14695981039346656037ull };
+
+// 64 bit FNV-1a. Some of these end up in the project file, don't change it.
+inline uint64_t fnv1a(const void *data, size_t size, uint64_t h = FNV1aSeed)
+{
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    for (size_t i=0; i<size; ++i) {
+        h ^= bytes[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+}
+
+#endif
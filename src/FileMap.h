@@ -21,6 +21,7 @@
 #include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <algorithm>
 #include <functional>
 #include <limits>
 
@@ -46,19 +47,81 @@ template <> inline int compare(const Location &l, const Location &r)
     return l.compare(r);
 }
 
+// Maps size bytes at offset in path read-only and returns a pointer to them.
+// *mapped and *mappedSize are what needs to be passed to munmap. Segments are
+// never modified once written so no lock is taken and the file is closed
+// right away.
+static inline const char *mapSlice(const Path &path, uint64_t offset, uint32_t size,
+                                   void **mapped, size_t *mappedSize, String *error)
+{
+    int fd;
+    eintrwrap(fd, open(path.constData(), O_RDONLY));
+    if (fd == -1) {
+        if (error) {
+            *error = Rct::strerror();
+            *error << " " << __LINE__;
+        }
+        return 0;
+    }
+    static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    const uint64_t start = offset - (offset % pageSize);
+    const size_t len = size + (offset - start);
+    void *pointer = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, start);
+    int ret;
+    eintrwrap(ret, close(fd));
+    if (pointer == MAP_FAILED) {
+        if (error) {
+            *error = Rct::strerror();
+            *error << " " << __LINE__;
+        }
+        return 0;
+    }
+    *mapped = pointer;
+    *mappedSize = len;
+    return static_cast<const char*>(pointer) + (offset - start);
+}
+
+// String keys are compared in place, without deserializing them.
+template <typename T> struct FileMapStringKey
+{
+    enum { Enabled = 0 };
+    static const char *data(const T &) { return 0; }
+    static uint32_t size(const T &) { return 0; }
+};
+
+template <> struct FileMapStringKey<String>
+{
+    enum { Enabled = 1 };
+    static const char *data(const String &key) { return key.constData(); }
+    static uint32_t size(const String &key) { return key.size(); }
+};
+
+template <> struct FileMapStringKey<Path> : public FileMapStringKey<String> {};
+
+// Layout:
+// [count][valuesOffset][keys][values]
+// Fixed size keys and values are stored inline. Otherwise there is a table of
+// offsets followed by the serialized data. String keys also have a table of
+// fixed width, zero padded key prefixes after the offsets so that most
+// comparisons in lowerBound() don't leave the prefix table.
 template <typename Key, typename Value>
 class FileMap
 {
 public:
+    typedef Key KeyType;
+    typedef Value ValueType;
+    enum { PrefixSize = 8 };
+
     FileMap()
-        : mPointer(0), mSize(0), mCount(0), mValuesOffset(0), mFD(-1), mOptions(0)
+        : mPointer(0), mSize(0), mCount(0), mValuesOffset(0), mFD(-1), mOptions(0),
+          mMapped(0), mMappedSize(0)
     {}
 
     ~FileMap()
     {
+        if (mMapped)
+            munmap(mMapped, mMappedSize);
         if (mFD != -1) {
-            assert(mPointer);
-            munmap(const_cast<char*>(mPointer), mSize);
             if (!(mOptions & NoLock))
                 lock(mFD, Unlock);
             int ret;
@@ -127,10 +190,24 @@ public:
         }
 
         mOptions = options;
+        mMapped = const_cast<char*>(pointer);
+        mMappedSize = st.st_size;
         init(pointer, st.st_size);
         return true;
     }
 
+    // Maps size bytes at offset in path. Used for FileMaps that are packed
+    // into a segment file.
+    bool load(const Path &path, uint64_t offset, uint32_t size, String *error = 0)
+    {
+        const char *pointer = mapSlice(path, offset, size, &mMapped, &mMappedSize, error);
+        if (!pointer)
+            return false;
+        mOptions = NoLock;
+        init(pointer, size);
+        return true;
+    }
+
     Value value(const Key &key, bool *matched = 0) const
     {
         bool match;
@@ -144,6 +221,7 @@ public:
     }
 
     uint32_t count() const { return mCount; }
+    uint32_t size() const { return mSize; }
 
     Key keyAt(uint32_t index) const
     {
@@ -157,36 +235,30 @@ public:
         return read<Value>(valuesSegment(), index);
     }
 
-    uint32_t lowerBound(const Key &k, bool *match = 0) const
+    // The serialized value at index, for types that can be read in place
+    const char *valueData(uint32_t index) const
     {
-        if (!mCount) {
-            if (match)
-                *match = false;
-            return std::numeric_limits<uint32_t>::max();
+        assert(index < mCount);
+        if (const uint32_t size = FixedSize<Value>::value)
+            return valuesSegment() + (index * size);
+        uint32_t offset;
+        memcpy(&offset, valuesSegment() + (sizeof(uint32_t) * index), sizeof(offset));
+        return mPointer + offset;
+    }
 
+    uint32_t lowerBound(const Key &k, bool *match = 0) const
+    {
+        if (FileMapStringKey<Key>::Enabled && !FixedSize<Key>::value) {
+            const char *data = FileMapStringKey<Key>::data(k);
+            const uint32_t size = FileMapStringKey<Key>::size(k);
+            char prefix[PrefixSize];
+            makePrefix(data, size, prefix);
+            return search([this, data, size, &prefix](uint32_t index) {
+                    const int cmp = memcmp(prefix, prefixesSegment() + (index * PrefixSize), PrefixSize);
+                    return cmp ? cmp : compareStringKey(data, size, index);
+                }, match);
         }
-        int lower = 0;
-        int upper = mCount - 1;
-
-        do {
-            const int mid = lower + ((upper - lower) / 2);
-            const int cmp = compare<Key>(k, keyAt(mid));
-            if (cmp < 0) {
-                upper = mid - 1;
-            } else if (cmp > 0) {
-                lower = mid + 1;
-            } else {
-                if (match)
-                    *match = true;
-                return mid;
-            }
-        } while (lower <= upper);
-
-        if (lower == static_cast<int>(mCount))
-            lower = std::numeric_limits<uint32_t>::max();
-        if (match)
-            *match = false;
-        return lower;
+        return search([this, &k](uint32_t index) { return compare<Key>(k, keyAt(index)); }, match);
     }
 
     static String encode(const Map<Key, Value> &map)
@@ -204,13 +276,23 @@ public:
         } else {
             serializer << static_cast<uint32_t>(0); // values offset
             uint32_t offset = sizeof(uint32_t) * 2 + (map.size() * sizeof(uint32_t));
+            String prefixes;
+            if (FileMapStringKey<Key>::Enabled) {
+                offset += map.size() * PrefixSize;
+            }
             String keyData;
             Serializer keySerializer(keyData);
             for (const std::pair<Key, Value> &pair : map) {
                 const uint32_t pos = offset + keyData.size();
                 out.append(reinterpret_cast<const char*>(&pos), sizeof(pos));
                 keySerializer << pair.first;
+                if (FileMapStringKey<Key>::Enabled) {
+                    char prefix[PrefixSize];
+                    makePrefix(FileMapStringKey<Key>::data(pair.first), FileMapStringKey<Key>::size(pair.first), prefix);
+                    prefixes.append(prefix, PrefixSize);
+                }
             }
+            out.append(prefixes);
             out.append(keyData);
             valuesOffset = out.size();
             memcpy(out.data() + sizeof(uint32_t), &valuesOffset, sizeof(valuesOffset));
@@ -286,6 +368,59 @@ private:
     }
     const char *valuesSegment() const { return mPointer + mValuesOffset; }
     const char *keysSegment() const { return mPointer + (sizeof(uint32_t) * 2); }
+    const char *prefixesSegment() const { return keysSegment() + (sizeof(uint32_t) * mCount); }
+
+    static void makePrefix(const char *data, uint32_t size, char *prefix)
+    {
+        const uint32_t len = std::min<uint32_t>(size, PrefixSize);
+        memcpy(prefix, data, len);
+        memset(prefix + len, 0, PrefixSize - len);
+    }
+
+    // Strings are serialized as a uint32_t size followed by the data
+    int compareStringKey(const char *data, uint32_t size, uint32_t index) const
+    {
+        uint32_t offset, keySize;
+        memcpy(&offset, keysSegment() + (sizeof(uint32_t) * index), sizeof(offset));
+        memcpy(&keySize, mPointer + offset, sizeof(keySize));
+        const int cmp = memcmp(data, mPointer + offset + sizeof(uint32_t), std::min(size, keySize));
+        if (cmp)
+            return cmp;
+        return size < keySize ? -1 : (size > keySize ? 1 : 0);
+    }
+
+    template <typename Compare>
+    uint32_t search(const Compare &cmpAt, bool *match) const
+    {
+        if (!mCount) {
+            if (match)
+                *match = false;
+            return std::numeric_limits<uint32_t>::max();
+
+        }
+        int lower = 0;
+        int upper = mCount - 1;
+
+        do {
+            const int mid = lower + ((upper - lower) / 2);
+            const int cmp = cmpAt(mid);
+            if (cmp < 0) {
+                upper = mid - 1;
+            } else if (cmp > 0) {
+                lower = mid + 1;
+            } else {
+                if (match)
+                    *match = true;
+                return mid;
+            }
+        } while (lower <= upper);
+
+        if (lower == static_cast<int>(mCount))
+            lower = std::numeric_limits<uint32_t>::max();
+        if (match)
+            *match = false;
+        return lower;
+    }
 
     template <typename T>
     inline T read(const char *base, uint32_t index) const
@@ -309,6 +444,8 @@ private:
     uint32_t mValuesOffset;
     int mFD;
     uint32_t mOptions;
+    void *mMapped;
+    size_t mMappedSize;
 };
 
 #endif
@@ -0,0 +1,68 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef FileSignature_h
+#define FileSignature_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "FNV1a.h"
+#include "rct/Path.h"
+#include "rct/Serializer.h"
+
+// What rdm last saw of a file. The content hash lets the dirty checks tell a
+// file that was only touched (checkout round trips, generated headers that
+// were rewritten with the same content) from one that actually changed.
+// changed is the modification time of the first write that produced the
+// current content.
+struct FileSignature
+{
+    FileSignature()
+        : size(0), lastModified(0), changed(0), hash(0)
+    {}
+
+    static bool hashFile(const Path &path, uint64_t *hash)
+    {
+        FILE *f = fopen(path.constData(), "r");
+        if (!f)
+            return false;
+        uint64_t h = RTags::FNV1aSeed;
+        char buf[65536];
+        size_t read;
+        while ((read = fread(buf, 1, sizeof(buf), f)))
+            h = RTags::fnv1a(buf, read, h);
+        const bool ok = !ferror(f);
+        fclose(f);
+        *hash = h;
+        return ok;
+    }
+
+    uint64_t size, lastModified, changed, hash;
+};
+
+template <> inline Serializer &operator<<(Serializer &s, const FileSignature &t)
+{
+    s.write(reinterpret_cast<const char*>(&t), sizeof(FileSignature));
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, FileSignature &t)
+{
+    s.read(reinterpret_cast<char*>(&t), sizeof(FileSignature));
+    return s;
+}
+
+#endif
@@ -41,12 +41,12 @@ int FollowLocationJob::execute()
         auto symbols = project()->openSymbols(location.fileId());
         if (!symbols || !symbols->count())
             return 1;
-        const Symbol prev = symbols->valueAt(idx - 1);
-        if (prev.kind == CXCursor_MemberRefExpr
-            && prev.location.column() == symbol.location.column() - 1
-            && prev.location.line() == symbol.location.line()
-            && prev.symbolName.contains("~")) {
-            symbol = prev;
+        const SymbolView prev(symbols->valueData(idx - 1));
+        if (prev.kind() == CXCursor_MemberRefExpr
+            && prev.location().column() == symbol.location.column() - 1
+            && prev.location().line() == symbol.location.line()
+            && prev.symbolName().contains("~")) {
+            symbol = prev.symbol();
         }
     }
 
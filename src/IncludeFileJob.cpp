@@ -40,14 +40,13 @@ static inline List<Path> headersForSymbol(const std::shared_ptr<Project> &projec
     const Path &path = loc.path();
     if (path.isHeader()) {
         ret.append(path);
-        if (const DependencyNode *node = project->dependencies().value(loc.fileId())) {
-            for (const auto &dependent : node->dependents) {
-                const Path p = Location::path(dependent.first);
-                if (p.isHeader() && dependent.second->includes.size() == 1) {
-                    ret.append(p);
-                    // allow headers that only include one header if we don't
-                    // find anything for the real header
-                }
+        const DependencyGraph &deps = project->dependencies();
+        for (uint32_t dependent : deps.edges(loc.fileId(), DependencyGraph::Dependents)) {
+            const Path p = Location::path(dependent);
+            if (p.isHeader() && deps.edgeCount(dependent, DependencyGraph::Includes) == 1) {
+                ret.append(p);
+                // allow headers that only include one header if we don't
+                // find anything for the real header
             }
         }
     }
@@ -22,6 +22,7 @@
 #include "rct/Serializer.h"
 #include "rct/String.h"
 #include "RTagsMessage.h"
+#include "Segment.h"
 
 class IndexDataMessage : public RTagsMessage
 {
@@ -30,11 +31,13 @@ public:
 
     IndexDataMessage(const std::shared_ptr<IndexerJob> &job)
         : RTagsMessage(MessageId), mParseTime(0), mKey(job->source.key()), mId(0),
-          mIndexerJobFlags(job->flags), mBytesWritten(0)
+          mIndexerJobFlags(job->flags), mBytesWritten(0), mParseDuration(0), mVisitDuration(0),
+          mWriteDuration(0), mPeakMemory(0)
     {}
 
     IndexDataMessage()
-        : RTagsMessage(MessageId), mParseTime(0), mKey(0), mId(0), mBytesWritten(0)
+        : RTagsMessage(MessageId), mParseTime(0), mKey(0), mId(0), mBytesWritten(0), mParseDuration(0),
+          mVisitDuration(0), mWriteDuration(0), mPeakMemory(0)
     {}
 
     void encode(Serializer &serializer) const;
@@ -106,8 +109,24 @@ public:
     Hash<uint32_t, Flags<FileFlag> > &files() { return mFiles; }
     const Hash<uint32_t, Flags<FileFlag> > &files() const { return mFiles; }
 
+    Hash<uint32_t, SegmentEntry> &segmentEntries() { return mSegmentEntries; }
+    const Hash<uint32_t, SegmentEntry> &segmentEntries() const { return mSegmentEntries; }
+
     size_t bytesWritten() const { return mBytesWritten; }
     void setBytesWritten(size_t bytesWritten) { mBytesWritten = bytesWritten; }
+
+    uint32_t parseDuration() const { return mParseDuration; }
+    void setParseDuration(uint32_t duration) { mParseDuration = duration; }
+
+    uint32_t visitDuration() const { return mVisitDuration; }
+    void setVisitDuration(uint32_t duration) { mVisitDuration = duration; }
+
+    uint32_t writeDuration() const { return mWriteDuration; }
+    void setWriteDuration(uint32_t duration) { mWriteDuration = duration; }
+
+    // peak resident set size of the rp process in bytes
+    uint64_t peakMemory() const { return mPeakMemory; }
+    void setPeakMemory(uint64_t peakMemory) { mPeakMemory = peakMemory; }
 private:
     Path mProject;
     uint64_t mParseTime, mKey, mId;
@@ -117,8 +136,11 @@ private:
     Diagnostics mDiagnostics;
     Includes mIncludes;
     Hash<uint32_t, Flags<FileFlag> > mFiles;
+    Hash<uint32_t, SegmentEntry> mSegmentEntries;
     Flags<Flag> mFlags;
     size_t mBytesWritten;
+    uint32_t mParseDuration, mVisitDuration, mWriteDuration;
+    uint64_t mPeakMemory;
 };
 
 RCT_FLAGS(IndexDataMessage::Flag);
@@ -127,13 +149,15 @@ RCT_FLAGS(IndexDataMessage::FileFlag);
 inline void IndexDataMessage::encode(Serializer &serializer) const
 {
     serializer << mProject << mParseTime << mKey << mId << mIndexerJobFlags << mMessage
-               << mFixIts << mIncludes << mDiagnostics << mFiles << mFlags << mBytesWritten;
+               << mFixIts << mIncludes << mDiagnostics << mFiles << mSegmentEntries << mFlags << mBytesWritten
+               << mParseDuration << mVisitDuration << mWriteDuration << mPeakMemory;
 }
 
 inline void IndexDataMessage::decode(Deserializer &deserializer)
 {
     deserializer >> mProject >> mParseTime >> mKey >> mId >> mIndexerJobFlags >> mMessage
-                 >> mFixIts >> mIncludes >> mDiagnostics >> mFiles >> mFlags >> mBytesWritten;
+                 >> mFixIts >> mIncludes >> mDiagnostics >> mFiles >> mSegmentEntries >> mFlags >> mBytesWritten
+                 >> mParseDuration >> mVisitDuration >> mWriteDuration >> mPeakMemory;
 }
 
 #endif
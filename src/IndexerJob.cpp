@@ -16,6 +16,7 @@
 #include "IndexerJob.h"
 
 #include "CompilerManager.h"
+#include "PCHManager.h"
 #include "Project.h"
 #include "rct/Process.h"
 #include "RTags.h"
@@ -40,21 +41,14 @@ IndexerJob::IndexerJob(const Source &s,
     assert(server);
     if (server->isActiveBuffer(source.fileId)) {
         priority += 8;
-    } else if (DependencyNode *node = p->dependencyNode(source.fileId)) {
-        Set<DependencyNode*> seen;
-        seen.insert(node);
-        std::function<bool(const DependencyNode *node)> func = [&seen, server, &func](const DependencyNode *n) {
-            for (const auto &inc : n->includes) {
-                if (seen.insert(inc.second)
-                    && !Location::path(n->fileId).isSystem()
-                    && (server->isActiveBuffer(n->fileId) || func(inc.second))) {
-                    return true;
-                }
+    } else if (p->dependencies().contains(source.fileId)) {
+        // bump files that include a file open in an editor
+        for (uint32_t buffer : server->activeBuffers()) {
+            if (!Location::path(buffer).isSystem() && p->dependsOn(source.fileId, buffer)) {
+                priority += 2;
+                break;
             }
-            return false;
-        };
-        if (func(node))
-            priority += 2;
+        }
     }
     visited.insert(s.fileId);
 }
@@ -69,66 +63,75 @@ void IndexerJob::acquireId()
     id = sNextId++;
 }
 
-String IndexerJob::encode() const
+// The arguments rp gets for a source, PCHManager builds its PCHs with the
+// same ones so they can be used by the sources they are built for.
+void IndexerJob::applyServerOptions(Source &source)
 {
-    String ret;
-    {
-        Serializer serializer(ret);
-        serializer.write("1234", sizeof(int)); // for size
-        std::shared_ptr<Project> proj = Server::instance()->project(project);
-        const Server::Options &options = Server::instance()->options();
-        Source copy = source;
-        if (!(options.options & Server::AllowWErrorAndWFatalErrors)) {
-            int idx = source.arguments.indexOf("-Werror");
-            if (idx != -1)
-                copy.arguments.removeAt(idx);
-            idx = source.arguments.indexOf("-Wfatal-error");
-            if (idx != -1)
-                copy.arguments.removeAt(idx);
-        }
-        copy.arguments << options.defaultArguments;
+    const Server::Options &options = Server::instance()->options();
+    if (!(options.options & Server::AllowWErrorAndWFatalErrors)) {
+        int idx = source.arguments.indexOf("-Werror");
+        if (idx != -1)
+            source.arguments.removeAt(idx);
+        idx = source.arguments.indexOf("-Wfatal-error");
+        if (idx != -1)
+            source.arguments.removeAt(idx);
+    }
+    source.arguments << options.defaultArguments;
 
-        if (!(options.options & Server::AllowPedantic)) {
-            const int idx = copy.arguments.indexOf("-Wpedantic");
-            if (idx != -1) {
-                copy.arguments.removeAt(idx);
-            }
+    if (!(options.options & Server::AllowPedantic)) {
+        const int idx = source.arguments.indexOf("-Wpedantic");
+        if (idx != -1) {
+            source.arguments.removeAt(idx);
         }
+    }
 
-        if (options.options & Server::EnableCompilerManager) {
-            CompilerManager::applyToSource(copy, CompilerManager::IncludeIncludePaths);
-        }
+    if (options.options & Server::EnableCompilerManager) {
+        CompilerManager::applyToSource(source, CompilerManager::IncludeIncludePaths);
+    }
 
-        for (const String &blocked : options.blockedArguments) {
-            if (blocked.endsWith("=")) {
-                size_t i = 0;
-                while (i<copy.arguments.size()) {
-                    if (copy.arguments.at(i).startsWith(blocked)) {
-                        // error() << "Removing" << copy.arguments.at(i);
-                        copy.arguments.remove(i, 1);
-                    } else if (!strncmp(blocked.constData(), copy.arguments.at(i).constData(), blocked.size() - 1)) {
-                        const size_t count = (i + 1 < copy.arguments.size()) ? 2 : 1;
-                        // error() << "Removing" << copy.arguments.mid(i, count);
-                        copy.arguments.remove(i, count);
-                    } else {
-                        ++i;
-                    }
+    for (const String &blocked : options.blockedArguments) {
+        if (blocked.endsWith("=")) {
+            size_t i = 0;
+            while (i<source.arguments.size()) {
+                if (source.arguments.at(i).startsWith(blocked)) {
+                    // error() << "Removing" << source.arguments.at(i);
+                    source.arguments.remove(i, 1);
+                } else if (!strncmp(blocked.constData(), source.arguments.at(i).constData(), blocked.size() - 1)) {
+                    const size_t count = (i + 1 < source.arguments.size()) ? 2 : 1;
+                    // error() << "Removing" << source.arguments.mid(i, count);
+                    source.arguments.remove(i, count);
+                } else {
+                    ++i;
                 }
-            } else {
-                copy.arguments.remove(blocked);
             }
+        } else {
+            source.arguments.remove(blocked);
         }
+    }
 
-        for (const auto &inc : options.includePaths) {
-            copy.includePaths << inc;
-        }
+    for (const auto &inc : options.includePaths) {
+        source.includePaths << inc;
+    }
+    source.defines << options.defines;
+    if (!(options.options & Server::EnableNDEBUG)) {
+        source.defines.remove(Source::Define("NDEBUG"));
+    }
+}
+
+String IndexerJob::encode() const
+{
+    String ret;
+    {
+        Serializer serializer(ret);
+        serializer.write("1234", sizeof(int)); // for size
+        std::shared_ptr<Project> proj = Server::instance()->project(project);
+        const Server::Options &options = Server::instance()->options();
+        Source copy = source;
+        applyServerOptions(copy);
         if (Server::instance()->options().options & Server::PCHEnabled)
             proj->fixPCH(copy);
-
-        copy.defines << options.defines;
-        if (!(options.options & Server::EnableNDEBUG)) {
-            copy.defines.remove(Source::Define("NDEBUG"));
-        }
+        if (PCHManager *pch = proj->pchManager())
+            pch->apply(copy);
         assert(!sourceFile.isEmpty());
         serializer << static_cast<uint16_t>(RTags::DatabaseVersion)
                    << options.sandboxRoot
@@ -142,13 +145,13 @@ String IndexerJob::encode() const
                    << static_cast<uint32_t>(options.rpIndexDataMessageTimeout)
                    << static_cast<uint32_t>(options.rpConnectTimeout)
                    << static_cast<uint32_t>(options.rpConnectAttempts)
-                   << static_cast<int32_t>(options.rpNiceValue)
                    << options.options
                    << unsavedFiles
                    << options.dataDir
                    << options.debugLocations;
         assert(proj);
-        proj->encodeVisitedFiles(serializer);
+        serializer << proj->nextSegmentId();
+        proj->encodeVisitedFiles(serializer, id);
     }
     const uint32_t size = ret.size() - sizeof(int);
     memcpy(&ret[0], &size, sizeof(size));
@@ -45,6 +45,8 @@ public:
     ~IndexerJob();
     void acquireId();
     String encode() const;
+    // removes and adds arguments according to the server's options
+    static void applyServerOptions(Source &source);
 
     uint64_t id;
     Source source;
@@ -15,76 +15,165 @@
 
 #include "JobScheduler.h"
 
+#include <climits>
+#include <queue>
+
 #include "IndexDataMessage.h"
 #include "IndexerJob.h"
 #include "Project.h"
 #include "rct/Connection.h"
 #include "rct/Process.h"
+#include "rct/Rct.h"
 #include "Server.h"
 
 enum { MaxPriority = 10 };
 // we set the priority to be this when a job has been requested and we couldn't load it
 JobScheduler::JobScheduler()
-    : mProcrastination(0)
+    : mProcrastination(0), mConcurrencyTimer(false)
 {}
 
 JobScheduler::~JobScheduler()
 {
-    mPendingJobs.deleteAll();
     if (!mActiveByProcess.isEmpty()) {
         for (const auto &job : mActiveByProcess) {
             job.first->kill();
         }
     }
+    for (Process *process : mIdleProcesses)
+        process->kill();
 }
 
 void JobScheduler::add(const std::shared_ptr<IndexerJob> &job)
 {
     assert(!(job->flags & ~IndexerJob::Type_Mask));
-    std::shared_ptr<Node> node(new Node({ job, 0, 0, 0, String() }));
-    node->job = job;
+    std::shared_ptr<Node> node(new Node({ job, 0, String(), 0, 0, 0 }));
+    // Within a priority the most expensive jobs go first so a long job
+    // doesn't start last and leave the other processes idle at the end
+    if (std::shared_ptr<Project> project = Server::instance()->project(job->project))
+        node->cost = project->estimatedCost(job->source);
     // error() << job->priority << job->sourceFile << mProcrastination;
-    if (mPendingJobs.isEmpty() || job->priority > mPendingJobs.first()->job->priority) {
-        mPendingJobs.prepend(node);
-    } else {
-        std::shared_ptr<Node> after = mPendingJobs.last();
-        while (job->priority > after->job->priority) {
-            after = after->prev;
-            assert(after);
-        }
-        mPendingJobs.insert(node, after);
-    }
+    mPendingJobs.insert(node);
     assert(!mInactiveById.contains(job->id));
     mInactiveById[job->id] = node;
+    mInactiveByFile[job->source.fileId].insert(job->id);
     // error() << "procrash" << mProcrastination << job->sourceFile;
     if (!mProcrastination)
         startJobs();
 }
 
-uint32_t JobScheduler::hasHeaderError(DependencyNode *node, Set<uint32_t> &seen) const
+uint32_t JobScheduler::hasHeaderError(uint32_t file, const std::shared_ptr<Project> &project) const
 {
-    assert(node);
-    for (auto dep : node->includes) {
-        if (!seen.insert(dep.first))
-            continue;
+    if (mHeaderErrors.isEmpty())
+        return 0;
+    const std::shared_ptr<const List<uint32_t> > includes = project->dependencies().closure(file, DependencyGraph::Includes);
+    for (uint32_t header : mHeaderErrors) {
+        if (std::binary_search(includes->begin(), includes->end(), header))
+            return header;
+    }
+    return 0;
+}
+
+size_t JobScheduler::jobLimit()
+{
+    const auto &options = Server::instance()->options();
+    if (!(options.options & Server::AdaptiveJobs))
+        return options.jobCount;
+    return mConcurrency.limit(options.jobCount, mActiveByProcess.size());
+}
 
-        if (mHeaderErrors.contains(dep.first)) {
-            return dep.first;
+// Looks at the next few jobs of the same priority and a similar cost as
+// first for the one whose includes have the most files that haven't been
+// visited and no job started in this round has claimed. Jobs with the same
+// number are picked by how many includes they share with the last job started
+// so the headers are still in the page cache. Jobs whose sources haven't been
+// indexed have no includes in the graph yet, among those one from a directory
+// no job in this round is from is picked since sources in one directory tend
+// to include the same headers. Otherwise the order from add() stands.
+JobScheduler::NodeQueue::iterator JobScheduler::pickJob(Claims &claims)
+{
+    enum { Window = 16 };
+    assert(!mPendingJobs.empty());
+    const NodeQueue::iterator first = mPendingJobs.begin();
+    NodeQueue::iterator best = first, unknown = mPendingJobs.end();
+    size_t bestUnclaimed = 0, bestShared = 0;
+    std::shared_ptr<Project> project;
+    int i = 0;
+    for (NodeQueue::iterator it = first; it != mPendingJobs.end() && i < Window; ++it, ++i) {
+        const std::shared_ptr<Node> &node = *it;
+        if (node->job->priority != (*first)->job->priority || node->cost < (*first)->cost / 2)
+            break;
+        if (!project || project->path() != node->job->project) {
+            project = Server::instance()->project(node->job->project);
+            if (!project)
+                continue;
+        }
+        const auto includes = project->dependencies().closure(node->job->source.fileId, DependencyGraph::Includes);
+        if (includes->size() <= 1) {
+            if (unknown == mPendingJobs.end() && !claims.directories.contains(node->job->sourceFile.parentDir()))
+                unknown = it;
+            continue;
         }
-        if (uint32_t fileId = hasHeaderError(dep.second, seen)) {
-            return fileId;
+        auto unvisited = claims.unvisited.find(node->job->id);
+        if (unvisited == claims.unvisited.end())
+            unvisited = claims.unvisited.insert(std::make_pair(node->job->id, project->unvisited(*includes))).first;
+        size_t unclaimed = 0;
+        for (uint32_t fileId : unvisited->second) {
+            if (!claims.files.contains(fileId))
+                ++unclaimed;
+        }
+        if (!unclaimed || unclaimed < bestUnclaimed)
+            continue;
+        size_t shared = 0;
+        if (mLastIncludes) {
+            List<uint32_t>::const_iterator a = includes->begin(), b = mLastIncludes->begin();
+            while (a != includes->end() && b != mLastIncludes->end()) {
+                if (*a < *b) {
+                    ++a;
+                } else if (*b < *a) {
+                    ++b;
+                } else {
+                    ++shared;
+                    ++a;
+                    ++b;
+                }
+            }
+        }
+        if (unclaimed > bestUnclaimed || shared > bestShared) {
+            best = it;
+            bestUnclaimed = unclaimed;
+            bestShared = shared;
         }
     }
-    return 0;
+    if (!bestUnclaimed && unknown != mPendingJobs.end())
+        return unknown;
+    return best;
 }
 
-uint32_t JobScheduler::hasHeaderError(uint32_t file, const std::shared_ptr<Project> &project) const
+void JobScheduler::removeInactive(const std::shared_ptr<Node> &node)
 {
-    DependencyNode *node = project->dependencies().value(file);
-    if (!node)
-        return false;
-    Set<uint32_t> seen;
-    return hasHeaderError(node, seen);
+    mInactiveById.remove(node->job->id);
+    auto it = mInactiveByFile.find(node->job->source.fileId);
+    if (it != mInactiveByFile.end()) {
+        it->second.remove(node->job->id);
+        if (it->second.isEmpty())
+            mInactiveByFile.erase(it);
+    }
+}
+
+void JobScheduler::unparkJobs()
+{
+    NodeQueue::iterator it = mParkedJobs.begin();
+    while (it != mParkedJobs.end()) {
+        const std::shared_ptr<Node> node = *it;
+        std::shared_ptr<Project> project = Server::instance()->project(node->job->project);
+        node->headerError = project ? hasHeaderError(node->job->source.fileId, project) : 0;
+        if (node->headerError) {
+            ++it;
+        } else {
+            mPendingJobs.insert(node);
+            it = mParkedJobs.erase(it);
+        }
+    }
 }
 
 void JobScheduler::startJobs()
@@ -96,116 +185,199 @@ void JobScheduler::startJobs()
         return;
     }
     const auto &options = server->options();
-    std::shared_ptr<Node> jobNode = mPendingJobs.first();
-    auto cont = [&jobNode, this]() {
-        auto tmp = jobNode->next;
-        mPendingJobs.remove(jobNode);
-        jobNode = tmp;
-    };
-
-    while (mActiveByProcess.size() < options.jobCount && jobNode) {
-        assert(jobNode);
+
+    const size_t jobCount = jobLimit();
+    const size_t headerErrorJobCount = std::min(options.headerErrorJobCount, jobCount);
+    Claims claims;
+    while (mActiveByProcess.size() < jobCount) {
+        const bool headerErrorSlot = mHeaderErrorJobIds.size() < headerErrorJobCount;
+        NodeQueue::iterator it = mPendingJobs.end();
+        if (!mPendingJobs.empty())
+            it = pickJob(claims);
+        // parked jobs only compete for the header error slots
+        const bool parked = (headerErrorSlot && !mParkedJobs.empty()
+                             && (it == mPendingJobs.end() || NodeCompare()(*mParkedJobs.begin(), *it)));
+        if (parked) {
+            it = mParkedJobs.begin();
+        } else if (it == mPendingJobs.end()) {
+            break;
+        }
+        const std::shared_ptr<Node> jobNode = *it;
+        (parked ? mParkedJobs : mPendingJobs).erase(it);
         assert(jobNode->job);
         assert(!(jobNode->job->flags & (IndexerJob::Running|IndexerJob::Complete|IndexerJob::Crashed|IndexerJob::Aborted)));
         std::shared_ptr<Project> project = Server::instance()->project(jobNode->job->project);
         if (!project) {
-            cont();
+            removeInactive(jobNode);
             debug() << jobNode->job->sourceFile << "doesn't have a project, discarding";
             continue;
         }
 
-        uint32_t headerError = 0;
-        if (!mHeaderErrors.isEmpty()) {
+        uint32_t headerError = jobNode->headerError;
+        if (!parked && !mHeaderErrors.isEmpty()) {
             headerError = hasHeaderError(jobNode->job->source.fileId, project);
-            if (headerError) {
+            if (headerError && !headerErrorSlot) {
                 // error() << "We got a headerError" << Location::path(headerError) << "for" << node->job->source.sourceFile()
                 //         << mHeaderErrorMaxJobs << mHeaderErrorJobIds;
-                if (options.headerErrorJobCount <= mHeaderErrorJobIds.size()) {
-                    warning() << "Holding off on" << jobNode->job->sourceFile << "it's got a header error from" << Location::path(headerError);
-                    jobNode = jobNode->next;
-                    continue;
-                }
+                warning() << "Holding off on" << jobNode->job->sourceFile << "it's got a header error from" << Location::path(headerError);
+                jobNode->headerError = headerError;
+                mParkedJobs.insert(jobNode);
+                continue;
             }
         }
+        jobNode->headerError = 0;
 
         const uint64_t jobId = jobNode->job->id;
-        Process *process = new Process;
-        debug() << "Starting process for" << jobId << jobNode->job->source.key() << jobNode->job.get();
-        List<String> arguments;
-        arguments << "--priority" << String::number(jobNode->job->priority);
-
-        for (int i=logLevel().toInt(); i>0; --i)
-            arguments << "-v";
-
-        process->readyReadStdOut().connect([this](Process *proc) {
-                std::shared_ptr<Node> n = mActiveByProcess[proc];
-                assert(n);
-                n->stdOut.append(proc->readAllStdOut());
-
-                std::regex rx("@CRASH@([^@]*)@CRASH@");
-                std::smatch match;
-                while (std::regex_search(n->stdOut.ref(), match, rx)) {
-                    error() << match[1].str();
-                    n->stdOut.remove(match.position(), match.length());
-                }
-            });
-
-        if (!process->start(options.rp, arguments)) {
-            error() << "Couldn't start rp" << options.rp << process->errorString();
-            delete process;
-            jobNode->job->flags |= IndexerJob::Crashed;
-            debug() << "job crashed (didn't start)" << jobId << jobNode->job->source.key() << jobNode->job.get();
-            std::shared_ptr<IndexDataMessage> msg(new IndexDataMessage(jobNode->job));
-            msg->setFlag(IndexDataMessage::ParseFailure);
-            jobFinished(jobNode->job, msg);
-            cont();
-            continue;
+        Process *process = 0;
+        if (!mIdleProcesses.isEmpty()) {
+            process = *mIdleProcesses.begin();
+            mIdleProcesses.erase(mIdleProcesses.begin());
+            debug() << "Reusing process for" << jobId << jobNode->job->source.key() << jobNode->job.get();
+        } else {
+            String err;
+            process = startProcess(jobNode->job->priority, &err);
+            if (!process) {
+                error() << "Couldn't start rp" << options.rp << err;
+                jobNode->job->flags |= IndexerJob::Crashed;
+                debug() << "job crashed (didn't start)" << jobId << jobNode->job->source.key() << jobNode->job.get();
+                removeInactive(jobNode);
+                std::shared_ptr<IndexDataMessage> msg(new IndexDataMessage(jobNode->job));
+                msg->setFlag(IndexDataMessage::ParseFailure);
+                jobFinished(jobNode->job, msg);
+                continue;
+            }
         }
         if (headerError) {
             jobNode->job->priority = IndexerJob::HeaderError;
             warning() << "Letting" << jobNode->job->sourceFile << "go even with a headerheader error from" << Location::path(headerError);
             mHeaderErrorJobIds.insert(jobId);
         }
-        process->finished().connect([this, jobId](Process *proc) {
-                EventLoop::deleteLater(proc);
-                auto n = mActiveByProcess.take(proc);
-                assert(!n || n->process == proc);
-                const String stdErr = proc->readAllStdErr();
-                if ((n && !n->stdOut.isEmpty()) || !stdErr.isEmpty()) {
-                    error() << (n ? ("Output from " + n->job->sourceFile + ":") : String("Orphaned process:"))
-                            << '\n' << stdErr << (n ? n->stdOut : String());
-                }
-
-                if (n) {
-                    assert(n->process == proc);
-                    n->process = 0;
-                    assert(!(n->job->flags & IndexerJob::Aborted));
-                    if (!(n->job->flags & IndexerJob::Complete) && proc->returnCode() != 0) {
-                        auto nodeById = mActiveById.take(jobId);
-                        assert(nodeById);
-                        assert(nodeById == n);
-                        // job failed, probably no IndexDataMessage coming
-                        n->job->flags |= IndexerJob::Crashed;
-                        debug() << "job crashed" << jobId << n->job->source.key() << n->job.get();
-                        std::shared_ptr<IndexDataMessage> msg(new IndexDataMessage(n->job));
-                        msg->setFlag(IndexDataMessage::ParseFailure);
-                        jobFinished(n->job, msg);
-                    }
-                }
-                mHeaderErrorJobIds.remove(jobId);
-                startJobs();
-            });
-
 
         jobNode->process = process;
+        jobNode->stdOut.clear();
+        jobNode->started = Rct::monoMs();
+        mLastIncludes = project->dependencies().closure(jobNode->job->source.fileId, DependencyGraph::Includes);
+        if (mLastIncludes->size() <= 1) {
+            claims.directories.insert(jobNode->job->sourceFile.parentDir());
+        } else {
+            auto unvisited = claims.unvisited.find(jobId);
+            if (unvisited == claims.unvisited.end())
+                unvisited = claims.unvisited.insert(std::make_pair(jobId, project->unvisited(*mLastIncludes))).first;
+            for (uint32_t fileId : unvisited->second)
+                claims.files.insert(fileId);
+        }
         assert(!(jobNode->job->flags & ~IndexerJob::Type_Mask));
         jobNode->job->flags |= IndexerJob::Running;
         process->write(jobNode->job->encode());
         mActiveByProcess[process] = jobNode;
         // error() << "STARTING JOB" << node->job->source.sourceFile();
-        mInactiveById.remove(jobId);
+        removeInactive(jobNode);
         mActiveById[jobId] = jobNode;
-        cont();
+    }
+
+    // Nothing may finish for a while, look again once the load has been
+    // sampled again
+    if (!mPendingJobs.empty() && jobCount < options.jobCount && !mConcurrencyTimer) {
+        mConcurrencyTimer = true;
+        std::weak_ptr<JobScheduler> weak = shared_from_this();
+        EventLoop::eventLoop()->registerTimer([weak](int) {
+                if (std::shared_ptr<JobScheduler> scheduler = weak.lock()) {
+                    scheduler->mConcurrencyTimer = false;
+                    scheduler->startJobs();
+                }
+            }, ConcurrencyController::SampleInterval, Timer::SingleShot);
+    }
+}
+
+Process *JobScheduler::startProcess(int priority, String *err)
+{
+    const auto &options = Server::instance()->options();
+    Process *process = new Process;
+    debug() << "Starting process" << process;
+    List<String> arguments;
+    arguments << "--priority" << String::number(priority);
+    if (options.rpJobsPerProcess > 1)
+        arguments << "--worker";
+    if (options.rpNiceValue != INT_MIN)
+        arguments << "--nice" << String::number(options.rpNiceValue);
+
+    for (int i=logLevel().toInt(); i>0; --i)
+        arguments << "-v";
+
+    process->readyReadStdOut().connect([this](Process *proc) {
+            std::shared_ptr<Node> n = mActiveByProcess.value(proc);
+            if (!n) {
+                const String out = proc->readAllStdOut();
+                if (!out.isEmpty())
+                    error() << "Output from idle rp:" << '\n' << out;
+                return;
+            }
+            n->stdOut.append(proc->readAllStdOut());
+
+            std::regex rx("@CRASH@([^@]*)@CRASH@");
+            std::smatch match;
+            while (std::regex_search(n->stdOut.ref(), match, rx)) {
+                error() << match[1].str();
+                n->stdOut.remove(match.position(), match.length());
+            }
+        });
+
+    if (!process->start(options.rp, arguments)) {
+        if (err)
+            *err = process->errorString();
+        delete process;
+        return 0;
+    }
+
+    process->finished().connect([this](Process *proc) {
+            EventLoop::deleteLater(proc);
+            mIdleProcesses.remove(proc);
+            mProcessJobCounts.remove(proc);
+            auto n = mActiveByProcess.take(proc);
+            assert(!n || n->process == proc);
+            const String stdErr = proc->readAllStdErr();
+            if ((n && !n->stdOut.isEmpty()) || !stdErr.isEmpty()) {
+                error() << (n ? ("Output from " + n->job->sourceFile + ":") : String("Output from rp:"))
+                        << '\n' << stdErr << (n ? n->stdOut : String());
+            }
+
+            if (n) {
+                const uint64_t jobId = n->job->id;
+                n->process = 0;
+                assert(!(n->job->flags & IndexerJob::Aborted));
+                if (!(n->job->flags & IndexerJob::Complete) && proc->returnCode() != 0) {
+                    auto nodeById = mActiveById.take(jobId);
+                    assert(nodeById);
+                    assert(nodeById == n);
+                    // job failed, probably no IndexDataMessage coming
+                    n->job->flags |= IndexerJob::Crashed;
+                    debug() << "job crashed" << jobId << n->job->source.key() << n->job.get();
+                    std::shared_ptr<IndexDataMessage> msg(new IndexDataMessage(n->job));
+                    msg->setFlag(IndexDataMessage::ParseFailure);
+                    jobFinished(n->job, msg);
+                }
+                mHeaderErrorJobIds.remove(jobId);
+            }
+            startJobs();
+        });
+    return process;
+}
+
+void JobScheduler::releaseProcess(const std::shared_ptr<Node> &node)
+{
+    mHeaderErrorJobIds.remove(node->job->id);
+    Process *process = node->process;
+    if (!process)
+        return;
+    node->process = 0;
+    mActiveByProcess.remove(process);
+    if (!node->stdOut.isEmpty())
+        error() << ("Output from " + node->job->sourceFile + ":") << '\n' << node->stdOut;
+    if (++mProcessJobCounts[process] >= Server::instance()->options().rpJobsPerProcess) {
+        // rp exits once it's done with its current job
+        process->closeStdIn();
+    } else {
+        mIdleProcesses.insert(process);
     }
 }
 
@@ -214,21 +386,34 @@ void JobScheduler::handleIndexDataMessage(const std::shared_ptr<IndexDataMessage
     auto node = mActiveById.take(message->id());
     if (!node) {
         debug() << "Got IndexDataMessage for unknown job";
+        // most likely aborted, nothing will refer to what it wrote
+        if (std::shared_ptr<Project> project = Server::instance()->project(message->project()))
+            project->discardSegments(message);
         return;
     }
     debug() << "job got index data message" << node->job->id << node->job->source.key() << node->job.get();
+    releaseProcess(node);
     jobFinished(node->job, message);
+    startJobs();
 }
 
 void JobScheduler::jobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &message)
 {
+    if (message->peakMemory())
+        mConcurrency.onJobFinished(message->peakMemory());
+    bool headerErrorsChanged = false;
     for (const auto &it : message->files()) {
         if (it.second & IndexDataMessage::HeaderError) {
-            mHeaderErrors.insert(it.first);
-        } else {
-            mHeaderErrors.remove(it.first);
+            if (!mHeaderErrors.contains(it.first)) {
+                mHeaderErrors.insert(it.first);
+                headerErrorsChanged = true;
+            }
+        } else if (mHeaderErrors.remove(it.first)) {
+            headerErrorsChanged = true;
         }
     }
+    if (headerErrorsChanged)
+        unparkJobs();
     // mHeaderErrors.unite(message->headerErrors());
     assert(!(job->flags & IndexerJob::Aborted));
     assert(job);
@@ -237,6 +422,9 @@ void JobScheduler::jobFinished(const std::shared_ptr<IndexerJob> &job, const std
     if (!project)
         return;
 
+    // the rp is done with the job's visited files snapshot, a retry gets a
+    // new id and encodes again
+    project->releaseVisitedFilesSnapshot(job->id);
     job->flags &= ~IndexerJob::Running;
     if (!(job->flags & IndexerJob::Crashed)) {
         job->flags |= IndexerJob::Complete;
@@ -260,26 +448,87 @@ void JobScheduler::jobFinished(const std::shared_ptr<IndexerJob> &job, const std
     project->onJobFinished(job, message);
 }
 
+// Plays the queue out over jobCount processes using the estimated cost of
+// each job. Jobs without an estimate count as free and are returned in unknown.
+uint64_t JobScheduler::predictedCompletion(size_t *unknown) const
+{
+    *unknown = 0;
+    std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<uint64_t> > processes;
+    const uint64_t now = Rct::monoMs();
+    for (const auto &node : mActiveById) {
+        const uint64_t elapsed = now - node.second->started;
+        if (!node.second->cost)
+            ++*unknown;
+        processes.push(node.second->cost > elapsed ? node.second->cost - elapsed : 0);
+    }
+    const auto &options = Server::instance()->options();
+    size_t jobCount = options.jobCount;
+    if (options.options & Server::AdaptiveJobs && mConcurrency.current())
+        jobCount = std::min(jobCount, mConcurrency.current());
+    jobCount = std::max<size_t>(jobCount, 1);
+    while (processes.size() < jobCount)
+        processes.push(0);
+    uint64_t ret = 0;
+    for (const NodeQueue *queue : { &mPendingJobs, &mParkedJobs }) {
+        for (const auto &node : *queue) {
+            if (!node->cost)
+                ++*unknown;
+            const uint64_t done = processes.top() + node->cost;
+            processes.pop();
+            processes.push(done);
+            ret = std::max(ret, done);
+        }
+    }
+    while (!processes.empty()) {
+        ret = std::max(ret, processes.top());
+        processes.pop();
+    }
+    return ret;
+}
+
 void JobScheduler::dump(const std::shared_ptr<Connection> &conn)
 {
-    if (!mPendingJobs.isEmpty()) {
+    if (Server::instance()->options().options & Server::AdaptiveJobs)
+        conn->write("Concurrency: " + mConcurrency.toString());
+    if (!mPendingJobs.empty()) {
         conn->write("Pending:");
         for (const auto &node : mPendingJobs) {
-            conn->write<128>("%s: %s %s",
+            conn->write<256>("%s: %s %s estimated %ums",
                              node->job->sourceFile.constData(),
                              node->job->flags.toString().constData(),
-                             IndexerJob::dumpFlags(node->job->flags).constData());
+                             IndexerJob::dumpFlags(node->job->flags).constData(),
+                             node->cost);
+        }
+    }
+    if (!mParkedJobs.empty()) {
+        conn->write("Parked:");
+        for (const auto &node : mParkedJobs) {
+            conn->write<256>("%s: %s %s header error from %s",
+                             node->job->sourceFile.constData(),
+                             node->job->flags.toString().constData(),
+                             IndexerJob::dumpFlags(node->job->flags).constData(),
+                             Location::path(node->headerError).constData());
         }
     }
     if (!mActiveById.isEmpty()) {
         conn->write("Active:");
+        const uint64_t now = Rct::monoMs();
         for (const auto &node : mActiveById) {
-            conn->write<128>("%s: %s %s",
+            conn->write<256>("%s: %s %s running %llums of estimated %ums",
                              node.second->job->sourceFile.constData(),
                              node.second->job->flags.toString().constData(),
-                             IndexerJob::dumpFlags(node.second->job->flags).constData());
+                             IndexerJob::dumpFlags(node.second->job->flags).constData(),
+                             static_cast<unsigned long long>(now - node.second->started),
+                             node.second->cost);
         }
     }
+    if (!mPendingJobs.empty() || !mParkedJobs.empty() || !mActiveById.isEmpty()) {
+        size_t unknown;
+        const uint64_t remaining = predictedCompletion(&unknown);
+        conn->write<128>("Predicted completion in %.1fs%s",
+                         static_cast<double>(remaining) / 1000.0,
+                         unknown ? String::format<64>(" (%zu jobs without history)", unknown).constData() : "");
+    }
 
     if (!mHeaderErrorJobIds.isEmpty()) {
         conn->write("HeaderErrorJobs:");
@@ -306,38 +555,43 @@ void JobScheduler::abort(const std::shared_ptr<IndexerJob> &job)
     auto node = mActiveById.take(job->id);
     if (!node) {
         debug() << "Aborting inactive job" << job->source.sourceFile() << job->source.key() << job->id << job.get();
-        node = mInactiveById.take(job->id);
+        node = mInactiveById.value(job->id);
         assert(node);
-        mPendingJobs.remove(node);
+        if (!mPendingJobs.erase(node))
+            mParkedJobs.erase(node);
+        removeInactive(node);
     } else {
         debug() << "Aborting active job" << job->source.sourceFile() << job->source.key() << job->id << job.get();
     }
+    mHeaderErrorJobIds.remove(job->id);
     if (node->process) {
         debug() << "Killing process" << node->process;
         node->process->kill();
         mActiveByProcess.remove(node->process);
+        node->process = 0;
     }
 }
 
 void JobScheduler::clearHeaderError(uint32_t file)
 {
-    if (mHeaderErrors.remove(file))
+    if (mHeaderErrors.remove(file)) {
         warning() << Location::path(file) << "was touched, starting jobs";
+        unparkJobs();
+    }
 }
 
-// ### This is a linear lookup
 bool JobScheduler::increasePriority(uint32_t fileId)
 {
-    for (auto node = mPendingJobs.first(); node; node = node->next) {
-        if (node->job->source.fileId == fileId) {
-            if (node->job->priority != IndexerJob::HeaderError) {
-                node->job->priority = MaxPriority;
-                mPendingJobs.moveToFront(node);
-                warning() << "Bumped priority for" << Location::path(fileId);
-            }
-
-            return true;
+    const auto inactive = mInactiveByFile.find(fileId);
+    if (inactive != mInactiveByFile.end()) {
+        const std::shared_ptr<Node> node = mInactiveById.value(*inactive->second.begin());
+        assert(node);
+        if (node->job->priority != IndexerJob::HeaderError && mPendingJobs.erase(node)) {
+            node->job->priority = MaxPriority;
+            mPendingJobs.insert(node);
+            warning() << "Bumped priority for" << Location::path(fileId);
         }
+        return true;
     }
 
     for (auto pair : mActiveByProcess) {
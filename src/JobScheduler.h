@@ -17,10 +17,13 @@
 #define JobScheduler_h
 
 #include <memory>
+#include <set>
 
-#include "rct/EmbeddedLinkedList.h"
-#include "rct/Set.h"
+#include "ConcurrencyController.h"
 #include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/Path.h"
+#include "rct/Set.h"
 #include "rct/String.h"
 
 class Connection;
@@ -28,7 +31,6 @@ class IndexDataMessage;
 class IndexerJob;
 class Process;
 class Project;
-struct DependencyNode;
 class JobScheduler : public std::enable_shared_from_this<JobScheduler>
 {
 public:
@@ -61,24 +63,68 @@ public:
     Set<uint32_t> headerErrors() const { return mHeaderErrors; }
     bool increasePriority(uint32_t fileId);
     void startJobs();
+    size_t jobLimit();
+    String concurrency() const { return mConcurrency.toString(); }
 private:
     enum { HighPriority = 5 };
     void jobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &message);
     struct Node {
         std::shared_ptr<IndexerJob> job;
         Process *process;
-        std::shared_ptr<Node> next, prev;
         String stdOut;
+        uint32_t cost; // estimated ms, see Project::estimatedCost
+        uint64_t started;
+        uint32_t headerError; // while parked
+    };
+    // Higher priority first, then the more expensive job, then the older
+    // one. A node's priority and cost don't change while it's queued.
+    // pickJob() may start a job of the same priority out of this order, but
+    // only one that costs at least half as much as the first one.
+    struct NodeCompare {
+        bool operator()(const std::shared_ptr<Node> &l, const std::shared_ptr<Node> &r) const
+        {
+            if (l->job->priority != r->job->priority)
+                return l->job->priority > r->job->priority;
+            if (l->cost != r->cost)
+                return l->cost > r->cost;
+            return l->job->id < r->job->id;
+        }
+    };
+    typedef std::set<std::shared_ptr<Node>, NodeCompare> NodeQueue;
+
+    uint64_t predictedCompletion(size_t *unknown) const;
+    // what the jobs started in one round of startJobs() will parse
+    struct Claims {
+        Set<uint32_t> files;
+        // for jobs whose includes aren't known yet
+        Set<Path> directories;
+        // job id to its includes that weren't visited when it was looked at
+        Hash<uint64_t, List<uint32_t> > unvisited;
     };
-    uint32_t hasHeaderError(DependencyNode *node, Set<uint32_t> &seen) const;
+    NodeQueue::iterator pickJob(Claims &claims);
+    void removeInactive(const std::shared_ptr<Node> &node);
+    void unparkJobs();
+    Process *startProcess(int priority, String *err);
+    void releaseProcess(const std::shared_ptr<Node> &node);
     uint32_t hasHeaderError(uint32_t file, const std::shared_ptr<Project> &project) const;
 
     int mProcrastination;
+    // the includes of the last job started, see pickJob()
+    std::shared_ptr<const List<uint32_t> > mLastIncludes;
+    ConcurrencyController mConcurrency;
+    bool mConcurrencyTimer;
     Set<uint32_t> mHeaderErrors;
     Set<uint64_t> mHeaderErrorJobIds;
-    EmbeddedLinkedList<std::shared_ptr<Node> > mPendingJobs;
+    NodeQueue mPendingJobs;
+    // Jobs that include a file with errors while all the header error jobs
+    // are running. They're looked at again when mHeaderErrors changes or a
+    // header error job finishes.
+    NodeQueue mParkedJobs;
     Hash<Process *, std::shared_ptr<Node> > mActiveByProcess;
+    Set<Process *> mIdleProcesses;
+    Hash<Process *, int> mProcessJobCounts;
     Hash<uint64_t, std::shared_ptr<Node> > mActiveById, mInactiveById;
+    Hash<uint32_t, Set<uint64_t> > mInactiveByFile;
 };
 
 #endif
@@ -99,11 +99,11 @@ Set<String> ListSymbolsJob::listSymbolsWithPathFilter(const std::shared_ptr<Proj
             continue;
         const int count = symbols->count();
         for (int j=0; j<count; ++j) {
-            const Symbol &symbol = symbols->valueAt(j);
-            if (!filterKind(symbol)) {
+            const SymbolView symbol(symbols->valueData(j));
+            if (!filterKind(symbol.fixedFields())) {
                 continue;
             }
-            const String &symbolName = symbol.symbolName;
+            const String symbolName = symbol.symbolName();
             if (symbolName.isEmpty())
                 continue;
             if (!string.isEmpty()) {
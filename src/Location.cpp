@@ -20,11 +20,18 @@
 #include "Server.h"
 #include "Project.h"
 #include "ClangIndexer.h"
+#include "FileMap.h"
 
 Hash<Path, uint32_t> Location::sPathsToIds;
 Hash<uint32_t, Path> Location::sIdsToPaths;
 uint32_t Location::sLastId = 0;
+bool Location::sHasSnapshot = false;
 std::mutex Location::sMutex;
+
+static Path sSnapshot;
+static std::shared_ptr<FileMap<Path, uint32_t> > sSnapshotPaths;
+static std::shared_ptr<FileMap<uint32_t, Path> > sSnapshotIds;
+static Set<uint32_t> sSnapshotRemoved;
 static inline uint64_t createMask(int startBit, int bitCount)
 {
     uint64_t mask = 0;
@@ -127,6 +134,69 @@ String Location::context(Flags<ToStringFlag> flags, Hash<Path, String> *cache) c
     return ret;
 }
 
+bool Location::initSnapshot(const Path &snapshot, const Set<uint32_t> &removed, String *error)
+{
+    LOCK();
+    sSnapshotRemoved = removed;
+    if (snapshot != sSnapshot) {
+        sSnapshot.clear();
+        sSnapshotPaths.reset();
+        sSnapshotIds.reset();
+        sHasSnapshot = false;
+        if (!snapshot.isEmpty()) {
+            std::shared_ptr<FileMap<Path, uint32_t> > paths(new FileMap<Path, uint32_t>);
+            std::shared_ptr<FileMap<uint32_t, Path> > ids(new FileMap<uint32_t, Path>);
+            if (!paths->load(snapshot, FileMap<Path, uint32_t>::NoLock, error)
+                || !ids->load(snapshot + ".ids", FileMap<uint32_t, Path>::NoLock, error)) {
+                return false;
+            }
+            sSnapshot = snapshot;
+            sSnapshotPaths = paths;
+            sSnapshotIds = ids;
+        }
+    }
+    sHasSnapshot = sSnapshotPaths != 0;
+    return true;
+}
+
+// sMutex must be held
+bool Location::inSnapshot(uint32_t id)
+{
+    LOCK();
+    if (!sHasSnapshot || sSnapshotRemoved.contains(id))
+        return false;
+    bool match;
+    sSnapshotIds->value(id, &match);
+    return match;
+}
+
+uint32_t Location::snapshotFileId(const Path &path)
+{
+    bool match;
+    const uint32_t id = sSnapshotPaths->value(path, &match);
+    if (!match || sSnapshotRemoved.contains(id))
+        return 0;
+    sPathsToIds[path] = id;
+    Path &p = sIdsToPaths[id];
+    if (p.isEmpty())
+        p = path;
+    return id;
+}
+
+// sMutex must be held
+Path Location::snapshotPath(uint32_t id)
+{
+    if (sSnapshotRemoved.contains(id))
+        return Path();
+    bool match;
+    const Path path = sSnapshotIds->value(id, &match);
+    if (!match)
+        return Path();
+    sIdsToPaths[id] = path;
+    sPathsToIds[path] = id;
+    return path;
+}
+
 void Location::saveFileIds()
 {
     assert(Server::instance());
@@ -36,6 +36,7 @@
 #include "rct/Log.h"
 #include "rct/Path.h"
 #include "rct/Serializer.h"
+#include "rct/Set.h"
 #include "rct/String.h"
 #include "rct/StackBuffer.h"
 
@@ -72,12 +73,18 @@ public:
     static inline uint32_t fileId(const Path &path)
     {
         LOCK();
-        return sPathsToIds.value(path);
+        const uint32_t id = sPathsToIds.value(path);
+        if (id || !sHasSnapshot)
+            return id;
+        return snapshotFileId(path);
     }
     static inline Path path(uint32_t id)
     {
         LOCK();
-        return sIdsToPaths.value(id);
+        const Path ret = sIdsToPaths.value(id);
+        if (!ret.isEmpty() || !sHasSnapshot)
+            return ret;
+        return snapshotPath(id);
     }
 
     static uint32_t lastId()
@@ -291,6 +298,12 @@ public:
         }
     }
 
+    // Used by rp to look up file ids in the read-only snapshot written by
+    // Project::writeVisitedFilesSnapshot(). Ids in removed are ignored.
+    static bool initSnapshot(const Path &snapshot, const Set<uint32_t> &removed, String *error = 0);
+    // whether id is in that snapshot, the ids Location::set() adds don't count
+    static bool inSnapshot(uint32_t id);
+
     static void set(const Path &path, uint32_t fileId)
     {
         LOCK();
@@ -305,9 +318,13 @@ private:
     static std::mutex sMutex;
     static void saveFileIds();
 #endif
+    static uint32_t snapshotFileId(const Path &path);
+    static Path snapshotPath(uint32_t id);
+
     static Hash<Path, uint32_t> sPathsToIds;
     static Hash<uint32_t, Path> sIdsToPaths;
     static uint32_t sLastId;
+    static bool sHasSnapshot;
     enum {
         FileBits = 22,
         LineBits = 21,
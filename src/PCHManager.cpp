@@ -0,0 +1,352 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "PCHManager.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "FNV1a.h"
+#include "IndexerJob.h"
+#include "Project.h"
+#include "rct/EventLoop.h"
+#include "rct/Log.h"
+#include "rct/StopWatch.h"
+#include "RTags.h"
+#include "Server.h"
+
+PCHManager::PCHManager(const std::shared_ptr<Project> &project)
+    : mProject(project), mDir(RTags::encodeSourceFilePath(Server::instance()->options().dataDir, project->path()) + "pch/"),
+      mStopped(false), mUpdating(false), mPendingUpdate(false)
+{
+}
+
+PCHManager::~PCHManager()
+{
+    mStopped = true;
+    if (mThread.joinable())
+        mThread.join();
+}
+
+void PCHManager::update()
+{
+    std::shared_ptr<Project> project = mProject.lock();
+    if (!project)
+        return;
+    if (mUpdating) {
+        mPendingUpdate = true;
+        return;
+    }
+    if (mThread.joinable())
+        mThread.join();
+
+    List<Candidate> candidates;
+    const DependencyGraph &dependencies = project->dependencies();
+    for (const auto &it : project->sources()) {
+        const Source &source = it.second;
+        if (!(source.flags & Source::Active) || !dependencies.contains(source.fileId))
+            continue;
+        switch (source.language) {
+        case Source::C:
+        case Source::CPlusPlus:
+        case Source::CPlusPlus11:
+            break;
+        default:
+            continue;
+        }
+        bool fileInclude = false;
+        for (const auto &inc : source.includePaths) {
+            if (inc.type == Source::Include::Type_FileInclude) {
+                fileInclude = true;
+                break;
+            }
+        }
+        if (fileInclude)
+            continue;
+
+        Candidate candidate;
+        candidate.key = source.key();
+        candidate.sourceFile = source.sourceFile();
+        candidate.language = source.language;
+        // build with exactly the arguments rp will parse the source with
+        Source copy = source;
+        IndexerJob::applyServerOptions(copy);
+        candidate.arguments = copy.toCommandLine(Source::Default|Source::ExcludeDefaultArguments
+                                                 |Source::ExcludeDefaultIncludePaths|Source::ExcludeDefaultDefines);
+        dependencies.visit(source.fileId, DependencyGraph::Includes, [&candidate](uint32_t include) {
+                candidate.includes.append(Location::path(include));
+            });
+        candidates.append(std::move(candidate));
+    }
+
+    Set<uint64_t> failed;
+    for (const auto &group : mGroups) {
+        if (!group.second.built)
+            failed.insert(group.first);
+    }
+
+    mUpdating = true;
+    const std::weak_ptr<Project> weak = mProject;
+    const Path dir = mDir;
+    mThread = std::thread([this, weak, candidates, failed, dir]() {
+            const Hash<uint64_t, Group> groups = build(candidates, failed, dir, mStopped);
+            EventLoop::mainEventLoop()->callLater([weak, groups]() {
+                    if (std::shared_ptr<Project> p = weak.lock()) {
+                        if (PCHManager *manager = p->pchManager())
+                            manager->onBuilt(groups);
+                    }
+                });
+        });
+}
+
+bool PCHManager::apply(Source &source) const
+{
+    const auto id = mSources.find(source.key());
+    if (id == mSources.end())
+        return false;
+    const auto group = mGroups.find(id->second);
+    if (group == mGroups.end() || !group->second.built)
+        return false;
+    source.includePaths.insert(source.includePaths.begin(), Source::Include(Source::Include::Type_FileInclude, group->second.pch));
+    return true;
+}
+
+void PCHManager::onFileModified(uint32_t fileId)
+{
+    List<uint64_t> stale;
+    for (const auto &files : mFiles) {
+        if (files.second.contains(fileId))
+            stale.append(files.first);
+    }
+    for (uint64_t id : stale) {
+        debug() << "Removing PCH" << mGroups.value(id).pch << Location::path(fileId) << "was modified";
+        remove(id);
+    }
+}
+
+// A PCH that rp failed to use isn't tried again until one of its files changes
+bool PCHManager::onFailed(uint64_t sourceKey)
+{
+    const auto id = mSources.find(sourceKey);
+    if (id == mSources.end())
+        return false;
+    auto group = mGroups.find(id->second);
+    if (group == mGroups.end() || !group->second.built)
+        return false;
+    error() << "Failed to use PCH" << group->second.pch << "for" << Location::path(static_cast<uint32_t>(sourceKey >> 32));
+    group->second.built = false;
+    Path::rm(group->second.pch + ".gch");
+    return true;
+}
+
+void PCHManager::remove(uint64_t id)
+{
+    const Group group = mGroups.take(id);
+    for (uint64_t source : group.sources)
+        mSources.remove(source);
+    mFiles.remove(id);
+    if (group.built)
+        Path::rm(group.pch + ".gch");
+}
+
+void PCHManager::onBuilt(const Hash<uint64_t, Group> &groups)
+{
+    mUpdating = false;
+    std::shared_ptr<Project> project = mProject.lock();
+    if (!project)
+        return;
+    mGroups = groups;
+    mSources.clear();
+    mFiles.clear();
+    for (const auto &group : mGroups) {
+        for (uint64_t source : group.second.sources)
+            mSources[source] = group.first;
+        Set<uint32_t> &files = mFiles[group.first];
+        for (const Path &header : group.second.headers) {
+            if (const uint32_t fileId = Location::fileId(header))
+                files += project->dependencies(fileId, Project::ArgDependsOn);
+        }
+    }
+    if (mPendingUpdate) {
+        mPendingUpdate = false;
+        update();
+    }
+}
+
+// The headers a source starts with, up to the first thing that isn't a
+// comment, #pragma once or an #include <...> of one of its includes.
+static List<Path> leadingIncludes(const PCHManager::Candidate &candidate)
+{
+    enum { MaxSize = 16 * 1024 };
+    List<Path> ret;
+    FILE *f = fopen(candidate.sourceFile.constData(), "r");
+    if (!f)
+        return ret;
+    char data[MaxSize];
+    const size_t size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+
+    size_t i = 0;
+    while (true) {
+        while (i < size) {
+            if (isspace(static_cast<unsigned char>(data[i]))) {
+                ++i;
+            } else if (i + 1 < size && data[i] == '/' && data[i + 1] == '/') {
+                const char *eol = static_cast<const char*>(memchr(data + i, '\n', size - i));
+                i = eol ? eol - data : size;
+            } else if (i + 1 < size && data[i] == '/' && data[i + 1] == '*') {
+                const char *end = static_cast<const char*>(memmem(data + i + 2, size - i - 2, "*/", 2));
+                if (!end)
+                    return ret;
+                i = end + 2 - data;
+            } else {
+                break;
+            }
+        }
+        if (i >= size || data[i] != '#')
+            break;
+        const char *eol = static_cast<const char*>(memchr(data + i, '\n', size - i));
+        if (!eol)
+            break;
+        String directive(data + i + 1, eol - data - i - 1);
+        i = eol - data;
+        directive = directive.trimmed();
+        if (directive.startsWith("pragma") && directive.contains("once"))
+            continue;
+        if (!directive.startsWith("include"))
+            break;
+        directive = directive.mid(7).trimmed();
+        const size_t close = directive.indexOf('>');
+        if (!directive.startsWith('<') || close == String::npos)
+            break;
+        const String suffix = "/" + directive.mid(1, close - 1);
+        bool found = false;
+        for (const Path &include : candidate.includes) {
+            if (include.endsWith(suffix)) {
+                ret.append(include);
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+            break;
+    }
+    return ret;
+}
+
+static bool buildPCH(const PCHManager::Candidate &candidate, const PCHManager::Group &group)
+{
+    StopWatch sw;
+    String contents;
+    for (const Path &header : group.headers)
+        contents += "#include \"" + header + "\"\n";
+    const Path header = group.pch + ".h";
+    FILE *f = fopen(header.constData(), "w");
+    if (!f)
+        return false;
+    const bool written = fwrite(contents.constData(), 1, contents.size(), f) == contents.size();
+    if (fclose(f) || !written)
+        return false;
+
+    List<String> args = candidate.arguments;
+    args << "-x" << (candidate.language == Source::C ? "c-header" : "c++-header");
+    Flags<CXTranslationUnit_Flags> flags = CXTranslationUnit_DetailedPreprocessingRecord;
+    flags |= CXTranslationUnit_Incomplete;
+    std::shared_ptr<RTags::TranslationUnit> unit = RTags::TranslationUnit::create(header, args, 0, 0, flags, false);
+    if (!unit->unit) {
+        error() << "Failed to build PCH" << unit->clangLine;
+        return false;
+    }
+    const Path gch = group.pch + ".gch";
+    const Path tmp = gch + ".tmp";
+    if (clang_saveTranslationUnit(unit->unit, tmp.constData(), clang_defaultSaveOptions(unit->unit)) != CXSaveError_None
+        || rename(tmp.constData(), gch.constData())) {
+        Path::rm(tmp);
+        error() << "Failed to save PCH" << gch;
+        return false;
+    }
+    warning() << "Built PCH" << gch << "for" << group.sources.size() << "sources in" << sw.elapsed() << "ms";
+    return true;
+}
+
+Hash<uint64_t, PCHManager::Group> PCHManager::build(const List<Candidate> &candidates, const Set<uint64_t> &failed,
+                                                    const Path &dir, const std::atomic<bool> &stopped)
+{
+    enum { MinGroupSize = 4 };
+    // keyed on the arguments, the language and the first header
+    struct Pending {
+        Pending()
+            : candidate(0)
+        {}
+        const Candidate *candidate;
+        Group group;
+    };
+    Hash<uint64_t, Pending> pending;
+    for (const Candidate &candidate : candidates) {
+        if (stopped)
+            return Hash<uint64_t, Group>();
+        const List<Path> headers = leadingIncludes(candidate);
+        if (headers.isEmpty())
+            continue;
+        uint64_t key = RTags::fnv1a(&candidate.language, sizeof(candidate.language));
+        for (const String &arg : candidate.arguments)
+            key = RTags::fnv1a(arg.constData(), arg.size() + 1, key);
+        key = RTags::fnv1a(headers.first().constData(), headers.first().size(), key);
+        Pending &p = pending[key];
+        if (!p.candidate) {
+            p.candidate = &candidate;
+            p.group.headers = headers;
+        } else {
+            size_t common = 0;
+            while (common < p.group.headers.size() && common < headers.size() && p.group.headers.at(common) == headers.at(common))
+                ++common;
+            p.group.headers.resize(common);
+        }
+        p.group.sources.append(candidate.key);
+    }
+
+    Path::mkdir(dir, Path::Recursive);
+    Hash<uint64_t, Group> groups;
+    Set<String> keep;
+    for (auto &it : pending) {
+        if (stopped)
+            return Hash<uint64_t, Group>();
+        Group &group = it.second.group;
+        if (group.sources.size() < MinGroupSize)
+            continue;
+        uint64_t id = it.first;
+        for (const Path &header : group.headers)
+            id = RTags::fnv1a(header.constData(), header.size() + 1, id);
+        group.pch = dir + String::format<32>("%llx.pch", static_cast<unsigned long long>(id));
+        keep.insert(group.pch.fileName());
+        if (failed.contains(id)) {
+            group.built = false;
+        } else {
+            group.built = Path(group.pch + ".gch").isFile() || buildPCH(*it.second.candidate, group);
+        }
+        groups[id] = std::move(group);
+    }
+
+    // clean out the PCHs of groups that are gone
+    dir.visit([&keep](const Path &path) {
+            const String fileName = path.fileName();
+            const size_t dot = fileName.indexOf(".pch");
+            if (dot == String::npos || !keep.contains(fileName.left(dot + 4)))
+                path.rm();
+            return Path::Continue;
+        });
+    return groups;
+}
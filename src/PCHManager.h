@@ -0,0 +1,80 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef PCHManager_h
+#define PCHManager_h
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/Path.h"
+#include "rct/Set.h"
+#include "Source.h"
+
+class Project;
+// Builds shared precompiled headers for groups of sources that are compiled
+// with the same arguments and start with the same <...> includes. The groups
+// are worked out and the PCHs built on a thread once the project's jobs are
+// done, sources in a group get the PCH passed with -include-pch when they are
+// indexed.
+class PCHManager
+{
+public:
+    PCHManager(const std::shared_ptr<Project> &project);
+    ~PCHManager();
+
+    void update();
+    bool apply(Source &source) const;
+    void onFileModified(uint32_t fileId);
+    bool onFailed(uint64_t sourceKey);
+
+    struct Candidate {
+        uint64_t key;
+        Path sourceFile;
+        Source::Language language;
+        List<String> arguments;
+        List<Path> includes;
+    };
+    struct Group {
+        Group()
+            : built(false)
+        {}
+        Path pch;
+        List<uint64_t> sources;
+        List<Path> headers;
+        bool built;
+    };
+private:
+    static Hash<uint64_t, Group> build(const List<Candidate> &candidates, const Set<uint64_t> &failed,
+                                       const Path &dir, const std::atomic<bool> &stopped);
+    void onBuilt(const Hash<uint64_t, Group> &groups);
+    void remove(uint64_t id);
+
+    std::weak_ptr<Project> mProject;
+    const Path mDir;
+    std::thread mThread;
+    std::atomic<bool> mStopped;
+    bool mUpdating, mPendingUpdate;
+    Hash<uint64_t, Group> mGroups;
+    // Source::key() to group id
+    Hash<uint64_t, uint64_t> mSources;
+    // the files each group's PCH depends on
+    Hash<uint64_t, Set<uint32_t> > mFiles;
+};
+
+#endif
@@ -15,6 +15,7 @@
 
 #include "Project.h"
 
+#include <algorithm>
 #include <fnmatch.h>
 #include <memory>
 #include <regex>
@@ -25,7 +26,9 @@
 #include "IndexDataMessage.h"
 #include "JobScheduler.h"
 #include "LogOutputMessage.h"
+#include "PCHManager.h"
 #include "rct/DataFile.h"
+#include "rct/EventLoop.h"
 #include "rct/Log.h"
 #include "rct/MemoryMonitor.h"
 #include "rct/Path.h"
@@ -35,6 +38,7 @@
 #include "rct/Value.h"
 #include "RTags.h"
 #include "RTagsLogOutput.h"
+#include "QueryThreadPool.h"
 #include "Server.h"
 #include "RTagsVersion.h"
 
@@ -120,7 +124,8 @@ public:
         if (mMatch.isEmpty() || mMatch.match(source.sourceFile())) {
             for (auto it : mProject->dependencies(source.fileId, Project::ArgDependsOn)) {
                 const uint64_t depLastModified = lastModified(it);
-                if (!depLastModified || depLastModified > source.parsed) {
+                if (!depLastModified
+                    || (depLastModified > source.parsed && mProject->contentModified(it, depLastModified) > source.parsed)) {
                     // dependency is gone
                     ret = true;
                     insertDirtyFile(it);
@@ -142,7 +147,11 @@ public:
 class WatcherDirty : public ComplexDirty
 {
 public:
-    WatcherDirty(const std::shared_ptr<Project> &project, const Set<uint32_t> &modified)
+    // Sources that are dirty only because of one of the headers in probed
+    // are held back, apart from the first one which is indexed as the probe.
+    WatcherDirty(const std::shared_ptr<Project> &project, const Set<uint32_t> &modified,
+                 const Set<uint32_t> &probed = Set<uint32_t>())
+        : mProject(project), mProbed(probed)
     {
         for (auto it : modified) {
             mModified[it] = project->dependencies(it, Project::DependsOnArg);
@@ -152,82 +161,49 @@ public:
     virtual bool isDirty(const Source &source) override
     {
         bool ret = false;
+        uint32_t reason = 0;
+        int reasons = 0;
 
         for (auto it : mModified) {
             const auto &deps = it.second;
             if (deps.contains(source.fileId)) {
                 const uint64_t depLastModified = lastModified(it.first);
-                if (!depLastModified || depLastModified > source.parsed) {
+                if (!depLastModified
+                    || (depLastModified > source.parsed && mProject->contentModified(it.first, depLastModified) > source.parsed)) {
                     // dependency is gone
                     ret = true;
                     insertDirtyFile(it.first);
+                    reason = it.first;
+                    ++reasons;
                 }
             }
         }
 
+        if (ret && reasons == 1 && mProbed.contains(reason)) {
+            uint64_t &probe = mProbes[reason];
+            if (probe) {
+                mDeferred[reason].insert(source.key());
+                return false;
+            }
+            probe = source.key();
+        }
+
         if (ret)
             insertDirtyFile(source.fileId);
         return ret;
     }
 
+    std::shared_ptr<Project> mProject;
     Hash<uint32_t, Set<uint32_t> > mModified;
+    const Set<uint32_t> mProbed;
+    Hash<uint32_t, uint64_t> mProbes;
+    Hash<uint32_t, Set<uint64_t> > mDeferred;
 };
 
-static bool loadDependencies(DataFile &file, Dependencies &dependencies)
-{
-    int size;
-    file >> size;
-    for (int i=0; i<size; ++i) {
-        uint32_t fileId;
-        file >> fileId;
-        if (!fileId)
-            return false;
-        dependencies[fileId] = new DependencyNode(fileId);
-    }
-    for (int i=0; i<size; ++i) {
-        int links;
-        file >> links;
-        if (links) {
-            uint32_t dependee;
-            file >> dependee;
-            DependencyNode *ee = dependencies[dependee];
-            if (!ee) {
-                return false;
-            }
-            while (links--) {
-                uint32_t dependent;
-                file >> dependent;
-                DependencyNode *ent = dependencies[dependent];
-                if (!ent) {
-                    return false;
-                }
-                ent->include(ee);
-            }
-        }
-    }
-    return true;
-}
-
-static void saveDependencies(DataFile &file, const Dependencies &dependencies)
-{
-    file << static_cast<int>(dependencies.size());
-    for (const auto &it : dependencies) {
-        file << it.first;
-    }
-    for (const auto &it : dependencies) {
-        file << static_cast<int>(it.second->dependents.size());
-        if (!it.second->dependents.isEmpty()) {
-            file << it.first;
-            for (const auto &dep : it.second->dependents) {
-                file << dep.first;
-            }
-        }
-    }
-}
-
 Project::Project(const Path &path)
     : mPath(path), mSourceFilePathBase(RTags::encodeSourceFilePath(Server::instance()->options().dataDir, path)),
-      mJobCounter(0), mJobsStarted(0), mBytesWritten(0), mSaveDirty(false)
+      mVisitedFilesSnapshotVersion(0), mJobCounter(0), mJobsStarted(0), mRebuildingIndexes(false), mNextSegmentId(0), mCompactingSegments(false), mBytesWritten(0),
+      mSaveDirty(false), mCostDuration(0), mCostFiles(0), mApplyingMutations(false), mRestoreStopped(false)
 {
     Path srcPath = mPath;
     RTags::encodePath(srcPath);
@@ -235,40 +211,55 @@ Project::Project(const Path &path)
     const Path tmp = options.dataDir + srcPath;
     mProjectFilePath = tmp + "/project";
     mSourcesFilePath = tmp + "/sources";
+    mSymbolNameIndex.setPath(mSourceFilePathBase + "symnames");
+    mUsrIndex.setPath(mSourceFilePathBase + "usrs");
+    mReferenceIndex.setPath(mSourceFilePathBase + "references");
+    mFileMapScope.reset(new FileMapScope(this, options.maxFileMapScopeCacheSize, options.fileMapCacheBudget));
 }
 
 Project::~Project()
 {
+    // the queued changes hold on to this, and the restore thread could be
+    // waiting for them
+    if (!mPendingMutations.isEmpty()) {
+        mPendingMutations.clear();
+        mQueryLock.cancelQueued();
+    }
+    stopRestore();
     if (mSaveDirty)
         save();
     for (const auto &job : mActiveJobs) {
         assert(job.second);
         Server::instance()->jobScheduler()->abort(job.second);
     }
-    mDependencies.deleteAll();
+    // the jobs were just aborted, nothing reads any of the snapshots anymore
+    for (const auto &it : mVisitedFilesSnapshotUsers)
+        removeVisitedFilesSnapshot(it.first);
+    if (!mVisitedFilesSnapshotPath.isEmpty())
+        removeVisitedFilesSnapshot(mVisitedFilesSnapshotVersion);
 
     assert(EventLoop::isMainThread());
     mDirtyTimer.stop();
 }
 
-static bool hasSourceDependency(const DependencyNode *node, const std::shared_ptr<Project> &project, Set<uint32_t> &seen)
+static bool hasSourceDependency(uint32_t fileId, const std::shared_ptr<Project> &project, Set<uint32_t> &seen)
 {
-    const Path path = Location::path(node->fileId);
+    const Path path = Location::path(fileId);
     // error("%s %d %d", path.constData(), path.isFile(), path.isSource());
-    if (path.isFile() && path.isSource() && project->hasSource(node->fileId)) {
+    if (path.isFile() && path.isSource() && project->hasSource(fileId)) {
         return true;
     }
-    for (auto it : node->dependents) {
-        if (seen.insert(it.first) && hasSourceDependency(it.second, project, seen))
+    for (uint32_t dependent : project->dependencies().edges(fileId, DependencyGraph::Dependents)) {
+        if (seen.insert(dependent) && hasSourceDependency(dependent, project, seen))
             return true;
     }
     return false;
 }
 
-static inline bool hasSourceDependency(const DependencyNode *node, const std::shared_ptr<Project> &project)
+static inline bool hasSourceDependency(uint32_t fileId, const std::shared_ptr<Project> &project)
 {
     Set<uint32_t> seen;
-    return hasSourceDependency(node, project, seen);
+    return hasSourceDependency(fileId, project, seen);
 }
 
 bool Project::readSources(const Path &path, Sources &sources, Hash<Path, CompilationDataBaseInfo> *info, String *err)
@@ -309,6 +300,13 @@ bool Project::readSources(const Path &path, Sources &sources, Hash<Path, Compila
 
 bool Project::init()
 {
+    const std::weak_ptr<Project> weak = shared_from_this();
+    mQueryLock.setReleasedHandler([weak]() {
+            EventLoop::mainEventLoop()->callLater([weak]() {
+                    if (std::shared_ptr<Project> project = weak.lock())
+                        project->onQueryFinished();
+                });
+        });
     const Server::Options &options = Server::instance()->options();
     if (!(options.options & Server::NoFileSystemWatch)) {
         mWatcher.modified().connect(std::bind(&Project::onFileModified, this, std::placeholders::_1));
@@ -320,6 +318,8 @@ bool Project::init()
         mWatcher.removed().connect([this](const Path &path) { if (mWatchedPaths.value(path.parentDir()) & Watch_FileManager) mFileManager->onFileRemoved(path); });
         mWatcher.added().connect([this](const Path &path) { if (mWatchedPaths.value(path.parentDir()) & Watch_FileManager) mFileManager->onFileAdded(path); });
     }
+    if (options.options & Server::AutoPCH)
+        mPCHManager.reset(new PCHManager(shared_from_this()));
 
     mDirtyTimer.timeout().connect(std::bind(&Project::onDirtyTimeout, this, std::placeholders::_1));
 
@@ -332,6 +332,12 @@ bool Project::init()
     }
 
     auto reindex = [this]() {
+        mSymbolNameIndex.clear();
+        mUsrIndex.clear();
+        mReferenceIndex.clear();
+        mSegmentEntries.clear();
+        mSegments.clear();
+        Path::rmdir(mSourceFilePathBase + "segments");
         if (mCompilationDatabaseInfos.isEmpty()) {
             mProjectFilePath.visit([](const Path &path) {
                     if (strcmp(path.fileName(), "sources")) {
@@ -371,8 +377,7 @@ bool Project::init()
     for (const auto &info : mCompilationDatabaseInfos)
         watch(info.first, Watch_CompilationDatabase);
 
-    if (!loadDependencies(file, mDependencies)) {
-        mDependencies.deleteAll();
+    if (!mDependencies.load(file)) {
         mVisitedFiles.clear();
         mDiagnostics.clear();
         error("Restore error %s: Failed to load dependencies.", mPath.constData());
@@ -380,98 +385,321 @@ bool Project::init()
         return true;
     }
 
-    for (const auto &dep : mDependencies) {
-        watchFile(dep.first);
+    file >> mNextSegmentId >> mSegmentEntries >> mFileSignatures >> mSourceCosts;
+    initSegments();
+    for (const auto &cost : mSourceCosts) {
+        mCostDuration += cost.second.duration();
+        mCostFiles += cost.second.files;
     }
 
-    bool needsSave = false;
-    std::unique_ptr<ComplexDirty> dirty;
-
-    if (Server::instance()->suspended()) {
-        dirty.reset(new SuspendedDirty);
-    } else {
-        dirty.reset(new IfModifiedDirty(shared_from_this()));
+    for (uint32_t fileId : mDependencies.files()) {
+        watchFile(fileId);
     }
 
-    Set<uint32_t> missingFileMaps;
+    const bool symbolNameIndexLoaded = mSymbolNameIndex.load();
+    const bool usrIndexLoaded = mUsrIndex.load();
+    if (!mReferenceIndex.load() || !usrIndexLoaded || !symbolNameIndexLoaded)
+        rebuildIndexes();
+
+    for (const auto &source : mSources)
+        watchFile(source.second.fileId);
+
+    startRestore();
+    return true;
+}
+
+void Project::startRestore()
+{
+    assert(!mRestore);
+    const List<uint32_t> files = mDependencies.files();
     {
-        List<uint32_t> removed;
-        int idx = 0;
-        bool outputDirty = false;
-        if (mDependencies.size() >= 100) {
-            logDirect(LogLevel::Error, String::format<128>("Restoring %s ", mPath.constData()), LogOutput::StdOut);
-            outputDirty = true;
-        }
-        const std::shared_ptr<Project> project = shared_from_this();
-        for (auto it : mDependencies) {
-            const Path path = Location::path(it.first);
-            if (!path.isFile()) {
-                warning() << path << "seems to have disappeared";
-                dirty.get()->insertDirtyFile(it.first);
-
-                const Set<uint32_t> dependents = dependencies(it.first, DependsOnArg);
-                for (auto dependent : dependents) {
-                    dirty.get()->insertDirtyFile(dependent);
-                }
-                removed << it.first;
-                needsSave = true;
-            } else {
-                String errorString;
-                if (!validate(it.first,  options.options & Server::ValidateFileMaps ? Validate : StatOnly, &errorString)) {
-                    if (!errorString.isEmpty()) {
-                        if (outputDirty) {
-                            outputDirty = false;
-                            logDirect(LogLevel::Error, String("\n"), LogOutput::StdOut);
+        std::lock_guard<std::mutex> lock(mRestoreMutex);
+        for (uint32_t fileId : files)
+            mUnrestored.insert(fileId);
+    }
+    mRestore.reset(new RestoreState);
+    mRestore->total = files.size();
+    if (files.isEmpty()) {
+        finishRestore();
+        return;
+    }
+    if (files.size() >= 100)
+        error("Restoring %s (%zu files)", mPath.constData(), files.size());
+
+    const ValidateMode mode = Server::instance()->options().options & Server::ValidateFileMaps ? Validate : StatOnly;
+    const std::weak_ptr<Project> weak = shared_from_this();
+    // The thread is joined in stopRestore() so it doesn't need to keep the
+    // project alive, the results are handed to the main thread.
+    mRestoreThread = std::thread([this, weak, files, mode]() {
+            enum { ChunkSize = 256 };
+            for (size_t begin = 0; begin < files.size() && !mRestoreStopped; begin += ChunkSize) {
+                const size_t end = std::min(files.size(), begin + ChunkSize);
+                const List<RestoreResult> results = restoreFiles(files, begin, end, mode);
+                const bool last = end == files.size();
+                EventLoop::mainEventLoop()->callLater([weak, results, last]() {
+                        if (std::shared_ptr<Project> project = weak.lock()) {
+                            project->applyRestoreResults(results);
+                            if (last)
+                                project->finishRestore();
                         }
-                        error() << errorString;
-                    }
-                    if (hasSource(it.first) || hasSourceDependency(it.second, project)) {
-                        missingFileMaps.insert(it.first);
-                    } else {
-                        removed << it.first;
-                        needsSave = true;
-                    }
-                }
+                    });
+            }
+        });
+}
+
+void Project::stopRestore()
+{
+    if (mRestoreThread.joinable()) {
+        mRestoreStopped = true;
+        mRestoreThread.join();
+    }
+}
+
+List<Project::RestoreResult> Project::restoreFiles(const List<uint32_t> &files, size_t begin, size_t end, ValidateMode mode)
+{
+    List<RestoreResult> results;
+    results.resize(end - begin);
+    auto restore = [&](size_t idx) {
+        RestoreResult &result = results[idx];
+        result.fileId = files.at(begin + idx);
+        const Path path = Location::path(result.fileId);
+        result.lastModified = path.lastModifiedMs();
+        result.exists = path.isFile();
+        result.valid = true;
+        if (result.exists) {
+            bool unchecked;
+            {
+                std::lock_guard<std::mutex> lock(mRestoreMutex);
+                unchecked = mUnrestored.contains(result.fileId);
             }
-            if (++idx % 100 == 0) {
-                outputDirty = true;
-                logDirect(LogLevel::Error, ".", 1, LogOutput::StdOut);
-                // error("%d/%d (%.2f%%)", idx, count, (idx / static_cast<double>(count)) * 100.0);
+            if (unchecked)
+                result.valid = validate(result.fileId, mode, &result.error);
+        }
+        std::lock_guard<std::mutex> lock(mRestoreMutex);
+        mUnrestored.remove(result.fileId);
+    };
+
+    QueryLock::ReadLocker lock(mQueryLock);
+    if (QueryThreadPool *pool = Server::instance()->queryThreadPool()) {
+        pool->parallelFor(results.size(), restore);
+    } else {
+        for (size_t i=0; i<results.size(); ++i)
+            restore(i);
+    }
+    return results;
+}
+
+void Project::applyRestoreResults(const List<RestoreResult> &results)
+{
+    assert(mRestore);
+    const std::shared_ptr<Project> project = shared_from_this();
+    for (const RestoreResult &result : results) {
+        mRestore->lastModified[result.fileId] = result.lastModified;
+        if (!result.exists) {
+            warning() << Location::path(result.fileId) << "seems to have disappeared";
+            for (auto dependent : dependencies(result.fileId, DependsOnArg))
+                mRestore->dirty.insert(dependent);
+            mRestore->removed << result.fileId;
+        } else if (!result.valid) {
+            if (!result.error.isEmpty())
+                error() << result.error;
+            if (hasSource(result.fileId) || hasSourceDependency(result.fileId, project)) {
+                mRestore->missingFileMaps.insert(result.fileId);
+            } else {
+                mRestore->removed << result.fileId;
             }
         }
-        if (outputDirty)
-            logDirect(LogLevel::Error, "\n", 1, LogOutput::StdOut);
-        for (uint32_t r : removed) {
-            removeDependencies(r);
+    }
+    mRestore->done += results.size();
+    mRestoreProgressChanged(project, mRestore->done, mRestore->total);
+}
+
+void Project::finishRestore()
+{
+    assert(mRestore);
+    std::shared_ptr<RestoreState> state(std::move(mRestore));
+    stopRestore();
+    if (state->total >= 100)
+        error("Restored %s in %llums", mPath.constData(), static_cast<unsigned long long>(state->timer.elapsed()));
+    applyRestore(state);
+}
+
+void Project::applyRestore(const std::shared_ptr<RestoreState> &state)
+{
+    if (!lockForMutation([this, state]() { applyRestore(state); }))
+        return;
+    QueryLock::WriteLocker lock(mQueryLock, std::adopt_lock);
+    bool needsSave = false;
+    for (uint32_t r : state->removed) {
+        // the restore thread looked a while ago, a file may be back by now
+        if (!state->lastModified.value(r)) {
+            const uint64_t lastModified = Location::path(r).lastModifiedMs();
+            if (lastModified) {
+                state->lastModified[r] = lastModified;
+                state->dirty.insert(r);
+                continue;
+            }
         }
+        removeDependencies(r);
+        needsSave = true;
     }
 
+    std::unique_ptr<ComplexDirty> dirty;
+    if (Server::instance()->suspended()) {
+        dirty.reset(new SuspendedDirty);
+    } else {
+        dirty.reset(new IfModifiedDirty(shared_from_this()));
+    }
+    for (uint32_t fileId : state->dirty)
+        dirty->insertDirtyFile(fileId);
+
     auto it = mSources.begin();
     while (it != mSources.end()) {
         const Source &source = it->second;
-        const Path sourceFile = source.sourceFile();
-        if (!sourceFile.isFile()) {
+        const auto lastModified = state->lastModified.find(source.fileId);
+        if (lastModified != state->lastModified.end() ? !lastModified->second : !source.sourceFile().isFile()) {
             warning() << source.sourceFile() << "seems to have disappeared";
             removeDependencies(source.fileId);
-            dirty.get()->insertDirtyFile(source.fileId);
+            dirty->insertDirtyFile(source.fileId);
             mSources.erase(it++);
             needsSave = true;
         } else {
-            watchFile(source.fileId);
             ++it;
         }
     }
+    // IfModifiedDirty stats the dependencies of every source, reuse what the
+    // restore thread found
+    dirty->mLastModified = std::move(state->lastModified);
 
     reloadCompilationDatabases();
 
     if (needsSave)
         save();
     startDirtyJobs(dirty.get(), IndexerJob::Dirty);
-    if (!missingFileMaps.isEmpty()) {
+    if (!state->missingFileMaps.isEmpty()) {
         SimpleDirty simple;
-        simple.init(missingFileMaps, shared_from_this());
+        simple.init(state->missingFileMaps, shared_from_this());
         startDirtyJobs(&simple, IndexerJob::Dirty);
     }
+    if (mPCHManager && mActiveJobs.isEmpty())
+        mPCHManager->update();
+}
+
+uint64_t Project::contentModified(uint32_t fileId, uint64_t lastModified)
+{
+    assert(EventLoop::isMainThread());
+    if (!lastModified)
+        return 0;
+    FileSignature &signature = mFileSignatures[fileId];
+    if (signature.lastModified == lastModified)
+        return signature.changed;
+    const Path path = Location::path(fileId);
+    uint64_t hash;
+    if (!FileSignature::hashFile(path, &hash)) {
+        mFileSignatures.remove(fileId);
+        mUnhashedFiles.remove(fileId);
+        return lastModified;
+    }
+    const uint64_t size = path.fileSize();
+    // the hash of an unhashed file is that of an older content
+    if (!signature.lastModified || mUnhashedFiles.remove(fileId) || signature.size != size || signature.hash != hash)
+        signature.changed = lastModified;
+    signature.size = size;
+    signature.lastModified = lastModified;
+    signature.hash = hash;
+    mSaveDirty = true;
+    return signature.changed;
+}
+
+// Records what the files looked like when they were parsed without reading
+// them on the main thread. Files that were modified during the parse are left
+// for the next dirty check. The content is hashed on a query thread and until
+// the hash is in the file counts as changed.
+void Project::recordSignatures(const Set<uint32_t> &files, uint64_t parseTime)
+{
+    List<FileHash> pending;
+    for (uint32_t fileId : files) {
+        const Path path = Location::path(fileId);
+        const uint64_t lastModified = path.lastModifiedMs();
+        if (!lastModified || lastModified > parseTime)
+            continue;
+        FileSignature &signature = mFileSignatures[fileId];
+        if (signature.lastModified == lastModified)
+            continue;
+        if (signature.lastModified && !mUnhashedFiles.contains(fileId))
+            mUnhashedFiles[fileId] = signature.changed;
+        signature.size = path.fileSize();
+        signature.lastModified = signature.changed = lastModified;
+        const FileHash hash = { fileId, lastModified, 0 };
+        pending.append(hash);
+    }
+    if (pending.isEmpty())
+        return;
+    mSaveDirty = true;
+
+    // without query threads they stay unhashed until they change again
+    QueryThreadPool *pool = Server::instance()->queryThreadPool();
+    if (!pool)
+        return;
+    const std::weak_ptr<Project> weak = shared_from_this();
+    pool->post([weak, pending]() mutable {
+            for (FileHash &hash : pending) {
+                const Path path = Location::path(hash.fileId);
+                if (!FileSignature::hashFile(path, &hash.hash) || path.lastModifiedMs() != hash.lastModified)
+                    hash.lastModified = 0;
+            }
+            EventLoop::mainEventLoop()->callLater([weak, pending]() {
+                    if (std::shared_ptr<Project> project = weak.lock())
+                        project->applyFileHashes(pending);
+                });
+        });
+}
+
+void Project::applyFileHashes(const List<FileHash> &hashes)
+{
+    for (const FileHash &hash : hashes) {
+        auto signature = mFileSignatures.find(hash.fileId);
+        if (signature == mFileSignatures.end() || signature->second.lastModified != hash.lastModified)
+            continue;
+        auto unhashed = mUnhashedFiles.find(hash.fileId);
+        if (unhashed != mUnhashedFiles.end()) {
+            if (signature->second.hash == hash.hash)
+                signature->second.changed = unhashed->second;
+            mUnhashedFiles.erase(unhashed);
+        }
+        signature->second.hash = hash.hash;
+        mSaveDirty = true;
+    }
+}
+
+bool Project::restoreProgress(size_t *done, size_t *total) const
+{
+    if (!mRestore)
+        return false;
+    *done = mRestore->done;
+    *total = mRestore->total;
+    return true;
+}
+
+bool Project::checkRestored(uint32_t fileId, String *err) const
+{
+    {
+        std::lock_guard<std::mutex> lock(mRestoreMutex);
+        if (!mUnrestored.contains(fileId))
+            return true;
+    }
+    // Failures are left for the restore thread to deal with
+    const Path path = Location::path(fileId);
+    if (!path.isFile()) {
+        if (err)
+            *err = path + " seems to have disappeared";
+        return false;
+    }
+    const ValidateMode mode = Server::instance()->options().options & Server::ValidateFileMaps ? Validate : StatOnly;
+    if (!validate(fileId, mode, err))
+        return false;
+    std::lock_guard<std::mutex> lock(mRestoreMutex);
+    mUnrestored.remove(fileId);
     return true;
 }
 
@@ -663,6 +891,56 @@ static String formatDiagnostics(const Diagnostics &diagnostics, Flags<QueryMessa
 }
 
 void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &msg)
+{
+    recordCost(msg);
+    if (!lockForMutation([this, job, msg]() { applyJobResult(job, msg); }))
+        return;
+    QueryLock::WriteLocker lock(mQueryLock, std::adopt_lock);
+    applyJobResult(job, msg);
+}
+
+// Posted by mQueryLock when the last reader leaves while changes are queued
+void Project::onQueryFinished()
+{
+    if (mPendingMutations.isEmpty() || mApplyingMutations || !mQueryLock.tryLockQueued())
+        return;
+    applyPendingMutations();
+    mQueryLock.unlockForWrite();
+}
+
+// Takes mQueryLock for writing if no query is reading the project and returns
+// true, the caller must release it. Otherwise retry is queued, to be called
+// by onQueryFinished() after the changes queued before it, and false is
+// returned. Queries that start after that wait for the queued changes. The
+// main thread never waits for a query to finish.
+bool Project::lockForMutation(std::function<void()> &&retry)
+{
+    if (!mApplyingMutations && !mPendingMutations.isEmpty()) {
+        mPendingMutations.append(std::move(retry));
+        onQueryFinished();
+        return false;
+    }
+    if (!mQueryLock.tryLockOrQueueForWrite()) {
+        assert(!mApplyingMutations);
+        mPendingMutations.append(std::move(retry));
+        return false;
+    }
+    return true;
+}
+
+// mQueryLock must be held for writing
+void Project::applyPendingMutations()
+{
+    assert(!mApplyingMutations);
+    mApplyingMutations = true;
+    while (!mPendingMutations.isEmpty()) {
+        const std::function<void()> mutation = mPendingMutations.takeFirst();
+        mutation();
+    }
+    mApplyingMutations = false;
+}
+
+void Project::applyJobResult(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &msg)
 {
     mBytesWritten += msg->bytesWritten();
     std::shared_ptr<IndexerJob> restart;
@@ -670,9 +948,11 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
     auto j = mActiveJobs.take(msg->key());
     if (!j) {
         error() << "Couldn't find JobData for" << Location::path(fileId) << msg->key() << job->id << job.get();
+        discardSegments(msg);
         return;
     } else if (j != job) {
         error() << "Wrong IndexerJob for" << Location::path(fileId) << msg->key() << job->id << job.get();
+        discardSegments(msg);
         return;
     }
 
@@ -689,12 +969,25 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
     if (src == mSources.end()) {
         releaseFileIds(job->visited);
         error() << "Can't find source for" << Location::path(fileId);
+        discardSegments(msg);
         return;
     }
+    // clang refuses PCHs that don't match the arguments or are out of date
+    const bool retryWithoutPCH = (mPCHManager && msg->flags() & IndexDataMessage::UsedPCH
+                                  && msg->flags() & IndexDataMessage::ParseFailure
+                                  && mPCHManager->onFailed(job->source.key()));
+    if (success && !(msg->flags() & IndexDataMessage::ParseFailure)) {
+        for (const auto &entry : msg->segmentEntries())
+            setSegmentEntry(entry.first, entry.second);
+    } else {
+        discardSegments(msg);
+    }
     if (!(msg->flags() & IndexDataMessage::ParseFailure)) {
         for (uint32_t file : job->visited) {
             if (!validate(file, Validate)) {
                 releaseFileIds(job->visited);
+                if (!mHeaderProbes.isEmpty())
+                    resolveHeaderProbes(job->source.key(), job->visited, false);
                 dirty(job->source.fileId);
                 return;
             }
@@ -733,8 +1026,13 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
     Set<uint32_t> visited = msg->visitedFiles();
     updateFixIts(visited, msg->fixIts());
     updateDependencies(msg);
+    if (success && !(msg->flags() & IndexDataMessage::ParseFailure))
+        updateIndexes(visited);
+    if (!mHeaderProbes.isEmpty())
+        resolveHeaderProbes(job->source.key(), visited, success && !(msg->flags() & IndexDataMessage::ParseFailure));
     if (success) {
         src->second.parsed = msg->parseTime();
+        recordSignatures(visited, msg->parseTime());
         logDirect(LogLevel::Error, String::format("[%3d%%] %d/%d %s %s. (%s)",
                                                   static_cast<int>(round((double(idx) / double(mJobCounter)) * 100.0)), idx, mJobCounter,
                                                   String::formatTime(time(0), String::Time).constData(),
@@ -752,8 +1050,14 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
                   LogOutput::StdOut|LogOutput::TrailingNewLine);
     }
 
+    if (retryWithoutPCH)
+        dirty(job->source.fileId);
+
     if (mActiveJobs.isEmpty()) {
         save();
+        compactSegments();
+        if (mPCHManager)
+            mPCHManager->update();
         double timerElapsed = (mTimer.elapsed() / 1000.0);
         const double averageJobTime = timerElapsed / mJobsStarted;
         const String m = String::format<1024>("Jobs took %.2fs%s. We're using %lldmb of memory. ",
@@ -807,13 +1111,16 @@ String Project::diagnosticsToString(Flags<QueryMessage::Flag> flags, uint32_t fi
     return formatDiagnostics(mDiagnostics, flags, fileId);
 }
 
-bool Project::save()
+Project::MutationResult Project::save()
 {
+    if (!lockForMutation([this]() { save(); }))
+        return MutationDeferred;
+    QueryLock::WriteLocker lock(mQueryLock, std::adopt_lock);
     {
         DataFile file(mSourcesFilePath, RTags::SourcesFileVersion);
         if (!file.open(DataFile::Write)) {
             error("Save error %s: %s", mProjectFilePath.constData(), file.error().constData());
-            return false;
+            return MutationFailed;
         }
         file << mSources;
         if (Sandbox::root().isEmpty()) {
@@ -830,7 +1137,7 @@ bool Project::save()
         DataFile file(mProjectFilePath, RTags::DatabaseVersion);
         if (!file.open(DataFile::Write)) {
             error("Save error %s: %s", mProjectFilePath.constData(), file.error().constData());
-            return false;
+            return MutationFailed;
         }
         {
             std::lock_guard<std::mutex> lock(mMutex);
@@ -841,14 +1148,21 @@ bool Project::save()
             }
         }
         file << mDiagnostics;
-        saveDependencies(file, mDependencies);
+        mDependencies.save(file);
+        file << mNextSegmentId << mSegmentEntries << mFileSignatures << mSourceCosts;
         if (!file.flush()) {
             error("Save error %s: %s", mProjectFilePath.constData(), file.error().constData());
-            return false;
+            return MutationFailed;
         }
     }
+    // a partly rebuilt index isn't saved, it's rebuilt again on the next start
+    if (!mRebuildingIndexes) {
+        flushIndexUpdates();
+        if (!saveIndexes())
+            error("Save error %s: Failed to write indexes", mPath.constData());
+    }
     mSaveDirty = false;
-    return true;
+    return MutationApplied;
 }
 
 static inline void markActive(Sources::iterator start, uint32_t buildId, const Sources::iterator end)
@@ -872,6 +1186,9 @@ static inline void markActive(Sources::iterator start, uint32_t buildId, const S
 
 void Project::index(const std::shared_ptr<IndexerJob> &job)
 {
+    if (!lockForMutation([this, job]() { index(job); }))
+        return;
+    QueryLock::WriteLocker lock(mQueryLock, std::adopt_lock);
     const Path sourceFile = job->sourceFile;
     static const char *fileFilter = getenv("RTAGS_FILE_FILTER");
     if (fileFilter && !strstr(job->sourceFile.constData(), fileFilter)) {
@@ -946,6 +1263,7 @@ void Project::index(const std::shared_ptr<IndexerJob> &job)
     if (ref) {
         releaseFileIds(ref->visited);
         Server::instance()->jobScheduler()->abort(ref);
+        releaseVisitedFilesSnapshot(ref->id);
         --mJobCounter;
     }
     ref = job;
@@ -989,6 +1307,8 @@ void Project::onFileAddedOrModified(const Path &file)
         return;
     }
     Server::instance()->jobScheduler()->clearHeaderError(fileId);
+    if (mPCHManager)
+        mPCHManager->onFileModified(fileId);
     if (mPendingDirtyFiles.insert(fileId)) {
         mDirtyTimer.restart(DirtyTimeout, Timer::SingleShot);
     }
@@ -1000,7 +1320,12 @@ void Project::onFileRemoved(const Path &file)
     debug() << file << "was removed" << fileId;
     if (!fileId)
         return;
+    if (!lockForMutation([this, file]() { onFileRemoved(file); }))
+        return;
+    QueryLock::WriteLocker lock(mQueryLock, std::adopt_lock);
     Path::rmdir(Project::sourceFilePath(fileId));
+    removeFromIndexes(fileId);
+    removeSegmentEntry(fileId);
 
     const uint64_t key = Source::key(fileId, 0);
     for (auto it = mSources.lower_bound(key); it != mSources.end(); ++it) {
@@ -1012,6 +1337,7 @@ void Project::onFileRemoved(const Path &file)
         if (job) {
             releaseFileIds(job->visited);
             Server::instance()->jobScheduler()->abort(job);
+            releaseVisitedFilesSnapshot(job->id);
         }
         debug() << "Erasing source" << Location::path(f);
     }
@@ -1030,11 +1356,195 @@ void Project::onFileRemoved(const Path &file)
 void Project::onDirtyTimeout(Timer *)
 {
     Set<uint32_t> dirtyFiles = std::move(mPendingDirtyFiles);
-    WatcherDirty dirty(shared_from_this(), dirtyFiles);
+    // Edits to a header that don't change what the files including it can
+    // see (function bodies, comments) shouldn't reindex all of them.
+    List<uint32_t> headers;
+    for (uint32_t fileId : dirtyFiles) {
+        // A header that changed again while its probe was running is
+        // reindexed everywhere, the held back sources are still dirty.
+        if (mHeaderProbes.remove(fileId) || Location::path(fileId).isSource())
+            continue;
+        headers.append(fileId);
+    }
+    declarationSignatures(headers, [this, dirtyFiles](const Hash<uint32_t, uint64_t> &signatures) {
+            startWatcherDirty(dirtyFiles, signatures);
+        });
+}
+
+void Project::startWatcherDirty(const Set<uint32_t> &dirtyFiles, const Hash<uint32_t, uint64_t> &signatures)
+{
+    Set<uint32_t> probed;
+    // what the dependents saw of the header before this change
+    Hash<uint32_t, uint64_t> changed;
+    for (const auto &signature : signatures) {
+        if (signature.second) {
+            probed.insert(signature.first);
+            changed[signature.first] = mFileSignatures.value(signature.first).changed;
+        }
+    }
+    WatcherDirty dirty(shared_from_this(), dirtyFiles, probed);
     const int dirtied = startDirtyJobs(&dirty, IndexerJob::Dirty);
+    for (const auto &deferred : dirty.mDeferred) {
+        HeaderProbe &probe = mHeaderProbes[deferred.first];
+        probe.signature = signatures.value(deferred.first);
+        probe.lastModified = dirty.lastModified(deferred.first);
+        probe.changed = changed.value(deferred.first);
+        probe.probe = dirty.mProbes.value(deferred.first);
+        probe.deferred = deferred.second;
+        debug() << "Holding back" << deferred.second.size() << "dependents of" << Location::path(deferred.first);
+    }
     debug() << "onDirtyTimeout" << dirtyFiles << dirtied;
 }
 
+// A hash of what the files that include fileId can see of it: its
+// declarations and where they are, its macro definitions and its includes. 0
+// if there's no data for the file.
+uint64_t Project::declarationSignature(uint32_t fileId) const
+{
+    FileMap<Location, Symbol> symbols;
+    TokenMap tokens;
+    if (!loadFileMap(fileId, SegmentEntry::Symbols, symbols) || !loadFileMap(fileId, SegmentEntry::Tokens, tokens))
+        return 0;
+
+    uint64_t hash = RTags::FNV1aSeed;
+    auto add = [&hash](const void *data, size_t size) { hash = RTags::fnv1a(data, size, hash); };
+    List<std::pair<int32_t, int32_t> > macros;
+    for (uint32_t i=0; i<symbols.count(); ++i) {
+        const SymbolView symbol(symbols.valueData(i));
+        const CXCursorKind kind = symbol.kind();
+        if (RTags::isReference(kind))
+            continue;
+        const Location loc = symbol.location();
+        const uint32_t values[] = { loc.line(), loc.column(), symbol.symbolLength(), static_cast<uint32_t>(kind), symbol.flags() };
+        add(values, sizeof(values));
+        const String usr = symbol.usr();
+        const String typeName = symbol.typeName();
+        add(usr.constData(), usr.size() + 1);
+        add(typeName.constData(), typeName.size() + 1);
+        if (kind == CXCursor_MacroDefinition) {
+            const int32_t first = symbol.startLine() > 0 ? symbol.startLine() : static_cast<int32_t>(loc.line());
+            macros.append(std::make_pair(first, std::max(first, symbol.endLine())));
+        }
+    }
+
+    // the body of a macro matters to everyone who expands it, both the
+    // symbols and the tokens are sorted on position
+    uint32_t token = 0;
+    for (const auto &macro : macros) {
+        while (token < tokens.count() && static_cast<int32_t>(tokens.locationAt(token).line()) < macro.first)
+            ++token;
+        for (uint32_t i=token; i<tokens.count() && static_cast<int32_t>(tokens.locationAt(i).line()) <= macro.second; ++i) {
+            const String spelling = tokens.spellingAt(i);
+            add(spelling.constData(), spelling.size() + 1);
+        }
+    }
+
+    mDependencies.visit(fileId, DependencyGraph::Includes, [&add](uint32_t include) {
+            add(&include, sizeof(include));
+        });
+    return hash ? hash : 1;
+}
+
+// Works out the declaration signatures of files on a query thread, they read
+// the files' FileMaps. func is called on the main thread.
+void Project::declarationSignatures(const List<uint32_t> &files,
+                                    std::function<void(const Hash<uint32_t, uint64_t> &)> &&func)
+{
+    QueryThreadPool *pool = Server::instance()->queryThreadPool();
+    if (!pool || files.isEmpty()) {
+        Hash<uint32_t, uint64_t> signatures;
+        for (uint32_t fileId : files)
+            signatures[fileId] = declarationSignature(fileId);
+        func(signatures);
+        return;
+    }
+    const std::weak_ptr<Project> weak = shared_from_this();
+    pool->post([weak, files, func]() {
+            std::shared_ptr<Project> project = weak.lock();
+            if (!project)
+                return;
+            Hash<uint32_t, uint64_t> signatures;
+            {
+                QueryLock::ReadLocker lock(project->mQueryLock);
+                for (uint32_t fileId : files)
+                    signatures[fileId] = project->declarationSignature(fileId);
+            }
+            // the project is let go of on the main thread
+            std::function<void()> finish = [project, func, signatures]() { func(signatures); };
+            project.reset();
+            EventLoop::mainEventLoop()->callLater(std::move(finish));
+        });
+}
+
+// Called when a job finishes. Decides the probes the job answers once the
+// signatures of the headers it reindexed are known.
+void Project::resolveHeaderProbes(uint64_t key, const Set<uint32_t> &visited, bool ok)
+{
+    Hash<uint32_t, uint64_t> lastModified;
+    List<uint32_t> headers;
+    for (const auto &probe : mHeaderProbes) {
+        if (visited.contains(probe.first) || probe.second.probe == key) {
+            lastModified[probe.first] = probe.second.lastModified;
+            if (ok && visited.contains(probe.first))
+                headers.append(probe.first);
+        }
+    }
+    if (lastModified.isEmpty())
+        return;
+    declarationSignatures(headers, [this, lastModified](const Hash<uint32_t, uint64_t> &signatures) {
+            finishHeaderProbes(lastModified, signatures);
+        });
+}
+
+// The held back sources are indexed if the header's signature changed. If it
+// didn't they're up to date once the header's FileSignature says its content
+// last changed when it did before this modification.
+void Project::finishHeaderProbes(const Hash<uint32_t, uint64_t> &lastModified, const Hash<uint32_t, uint64_t> &signatures)
+{
+    List<std::pair<HeaderProbe, bool> > resolved;
+    for (const auto &header : lastModified) {
+        auto it = mHeaderProbes.find(header.first);
+        // the header has changed again since, its new probe decides
+        if (it == mHeaderProbes.end() || it->second.lastModified != header.second)
+            continue;
+        bool changed;
+        auto signature = signatures.find(header.first);
+        if (signature != signatures.end()) {
+            changed = signature->second != it->second.signature;
+        } else {
+            // the job failed or another job has the header, don't wait for it
+            changed = true;
+        }
+        debug() << Location::path(header.first) << (changed ? "changed, reindexing" : "didn't change, skipping")
+                << it->second.deferred.size() << "dependents";
+        if (!changed) {
+            auto fileSignature = mFileSignatures.find(header.first);
+            if (fileSignature != mFileSignatures.end() && fileSignature->second.lastModified == it->second.lastModified
+                && it->second.changed) {
+                fileSignature->second.changed = it->second.changed;
+                mSaveDirty = true;
+            }
+        }
+        resolved.append(std::make_pair(std::move(it->second), changed));
+        mHeaderProbes.erase(it);
+    }
+
+    for (const auto &r : resolved) {
+        if (!r.second)
+            continue;
+        for (uint64_t source : r.first.deferred) {
+            auto src = mSources.find(source);
+            if (src == mSources.end() || mActiveJobs.contains(source) || !(src->second.flags & Source::Active))
+                continue;
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                removeVisitedFile(src->second.fileId);
+            }
+            index(std::shared_ptr<IndexerJob>(new IndexerJob(src->second, IndexerJob::Dirty, shared_from_this())));
+        }
+    }
+}
+
 List<Source> Project::sources(uint32_t fileId) const
 {
     List<Source> ret;
@@ -1065,87 +1575,232 @@ bool Project::hasSource(uint32_t fileId) const
 
 Set<uint32_t> Project::dependencies(uint32_t fileId, DependencyMode mode) const
 {
+    const DependencyGraph::Direction direction = (mode == ArgDependsOn ? DependencyGraph::Includes : DependencyGraph::Dependents);
     Set<uint32_t> ret;
+    for (uint32_t dep : *mDependencies.closure(fileId, direction))
+        ret.insert(ret.end(), dep);
     ret.insert(fileId);
-    std::function<void(uint32_t)> fill = [&](uint32_t file) {
-        if (DependencyNode *node = mDependencies.value(file)) {
-            const auto &nodes = (mode == ArgDependsOn ? node->includes : node->dependents);
-            for (const auto &it : nodes) {
-                if (ret.insert(it.first))
-                    fill(it.first);
-            }
-        }
-    };
-    fill(fileId);
     return ret;
 }
 
 bool Project::dependsOn(uint32_t source, uint32_t header) const
 {
-    Set<uint32_t> seen;
-    std::function<bool(DependencyNode *node)> dep = [&](DependencyNode *node) {
-        assert(node);
-        if (!seen.insert(node->fileId))
-            return false;
-        if (node->dependents.contains(source))
-            return true;
-        for (const std::pair<uint32_t, DependencyNode*> &n : node->dependents) {
-            if (dep(n.second))
-                return true;
+    // the closure of source is cached so repeated checks against the same
+    // source are a binary search
+    return mDependencies.reaches(source, header, DependencyGraph::Includes);
+}
+
+void Project::removeDependencies(uint32_t fileId)
+{
+    removeFromIndexes(fileId);
+    removeSegmentEntry(fileId);
+    mFileSignatures.remove(fileId);
+    mUnhashedFiles.remove(fileId);
+    mDependencies.remove(fileId);
+    mDependencies.compactIfNeeded();
+}
+
+template <typename Index>
+static inline void insertIndexValues(Index &index, uint32_t fileId, const String &key, const Set<Location> &locations)
+{
+    for (const Location &loc : locations)
+        index.insert(fileId, key, loc);
+}
+
+static inline void insertIndexValues(ShardedProjectIndex<uint32_t> &index, uint32_t fileId, const String &key, const Set<Location> &)
+{
+    index.insert(fileId, key, fileId);
+}
+
+template <typename Index>
+static void updateIndex(Index &index, uint32_t fileId, const FileMap<String, Set<Location> > &fileMap)
+{
+    index.remove(fileId);
+    const uint32_t count = fileMap.count();
+    for (uint32_t i=0; i<count; ++i)
+        insertIndexValues(index, fileId, fileMap.keyAt(i), fileMap.valueAt(i));
+}
+
+// The project indexes are updated from the FileMaps of files. They are read
+// on a query thread in chunks, one chunk at a time, unless there are no query
+// threads.
+void Project::updateIndexes(const Set<uint32_t> &files)
+{
+    if (!Server::instance()->queryThreadPool()) {
+        applyIndexUpdates(readIndexUpdates(files.toList()));
+        return;
+    }
+    mPendingIndexUpdates.unite(files);
+    startIndexUpdates();
+}
+
+void Project::startIndexUpdates()
+{
+    enum { ChunkSize = 256 };
+    QueryThreadPool *pool = Server::instance()->queryThreadPool();
+    if (!pool || !mIndexUpdateFiles.isEmpty() || mPendingIndexUpdates.isEmpty())
+        return;
+    auto it = mPendingIndexUpdates.begin();
+    while (it != mPendingIndexUpdates.end() && mIndexUpdateFiles.size() < ChunkSize) {
+        mIndexUpdateFiles.append(*it);
+        mPendingIndexUpdates.erase(it++);
+    }
+    const List<uint32_t> files = mIndexUpdateFiles;
+    const std::weak_ptr<Project> weak = shared_from_this();
+    pool->post([weak, files]() {
+            std::shared_ptr<Project> project = weak.lock();
+            if (!project)
+                return;
+            List<IndexUpdate> updates;
+            {
+                QueryLock::ReadLocker lock(project->mQueryLock);
+                updates = project->readIndexUpdates(files);
+            }
+            // the project is let go of on the main thread
+            std::function<void()> finish = [project, updates]() { project->finishIndexUpdates(updates); };
+            project.reset();
+            EventLoop::mainEventLoop()->callLater(std::move(finish));
+        });
+}
+
+// Called with the chunk startIndexUpdates() had read
+void Project::finishIndexUpdates(const List<IndexUpdate> &updates)
+{
+    if (!lockForMutation([this, updates]() { finishIndexUpdates(updates); }))
+        return;
+    QueryLock::WriteLocker lock(mQueryLock, std::adopt_lock);
+    mIndexUpdateFiles.clear();
+    applyIndexUpdates(updates);
+    if (mRebuildingIndexes && mPendingIndexUpdates.isEmpty()) {
+        mRebuildingIndexes = false;
+        if (saveIndexes())
+            warning() << "Rebuilt indexes for" << mPath << "in" << mRebuildTimer.elapsed() << "ms";
+    }
+    startIndexUpdates();
+}
+
+// mQueryLock must be held for reading, or by the main thread
+List<Project::IndexUpdate> Project::readIndexUpdates(const List<uint32_t> &files) const
+{
+    List<IndexUpdate> ret;
+    ret.resize(files.size());
+    for (size_t i=0; i<files.size(); ++i) {
+        IndexUpdate &update = ret[i];
+        update.fileId = files.at(i);
+        update.segment = mSegmentEntries.value(update.fileId).segment;
+        // maps that fail to load are empty which just removes the file from the index
+        update.symbolNames.reset(new FileMap<String, Set<Location> >);
+        update.usrs.reset(new FileMap<String, Set<Location> >);
+        update.targets.reset(new FileMap<String, Set<Location> >);
+        loadFileMap(update.fileId, SegmentEntry::SymbolNames, *update.symbolNames);
+        loadFileMap(update.fileId, SegmentEntry::Usrs, *update.usrs);
+        loadFileMap(update.fileId, SegmentEntry::Targets, *update.targets);
+    }
+    return ret;
+}
+
+// mQueryLock must be held for writing
+void Project::applyIndexUpdates(const List<IndexUpdate> &updates)
+{
+    for (const IndexUpdate &update : updates) {
+        if (mSegmentEntries.value(update.fileId).segment != update.segment) {
+            // reindexed, removed or compacted since it was read
+            mPendingIndexUpdates.insert(update.fileId);
+            continue;
         }
+        updateIndex(mSymbolNameIndex, update.fileId, *update.symbolNames);
+        updateIndex(mUsrIndex, update.fileId, *update.usrs);
+        updateIndex(mReferenceIndex, update.fileId, *update.targets);
+    }
+}
+
+// Makes the updates that are still queued or being read so that the saved
+// indexes match the saved FileMaps. mQueryLock must be held for writing.
+void Project::flushIndexUpdates()
+{
+    Set<uint32_t> files;
+    std::swap(files, mPendingIndexUpdates);
+    for (uint32_t fileId : mIndexUpdateFiles)
+        files.insert(fileId);
+    if (!files.isEmpty())
+        applyIndexUpdates(readIndexUpdates(files.toList()));
+}
+
+bool Project::saveIndexes()
+{
+    bool ret = mSymbolNameIndex.save();
+    if (!mUsrIndex.save())
+        ret = false;
+    if (!mReferenceIndex.save())
+        ret = false;
+    return ret;
+}
+
+bool Project::referencingFiles(const String &usr, Set<uint32_t> &files) const
+{
+    if (mRebuildingIndexes || !mReferenceIndex.isLoaded())
         return false;
-    };
-    DependencyNode *node = mDependencies.value(header);
-    return node && dep(node);
+    files = mReferenceIndex.value(usr);
+    return true;
 }
 
-void Project::removeDependencies(uint32_t fileId)
+void Project::removeFromIndexes(uint32_t fileId)
 {
-    if (DependencyNode *node = mDependencies.take(fileId)) {
-        for (auto it : node->includes)
-            it.second->dependents.remove(fileId);
-        for (auto it : node->dependents)
-            it.second->includes.remove(fileId);
-        delete node;
+    mSymbolNameIndex.remove(fileId);
+    mUsrIndex.remove(fileId);
+    mReferenceIndex.remove(fileId);
+}
+
+// With query threads the indexes are rebuilt in the background, queries go
+// through the FileMaps of every file until it's done.
+void Project::rebuildIndexes()
+{
+    mRebuildTimer.restart();
+    mSymbolNameIndex.clear();
+    mUsrIndex.clear();
+    mReferenceIndex.clear();
+    Set<uint32_t> files;
+    for (uint32_t fileId : mDependencies.files())
+        files.insert(fileId);
+    if (Server::instance()->queryThreadPool() && !files.isEmpty()) {
+        mRebuildingIndexes = true;
+        updateIndexes(files);
+        return;
     }
+    updateIndexes(files);
+    if (saveIndexes())
+        warning() << "Rebuilt indexes for" << mPath << "in" << mRebuildTimer.elapsed() << "ms";
 }
 
 void Project::updateDependencies(const std::shared_ptr<IndexDataMessage> &msg)
 {
     const bool prune = !(msg->flags() & (IndexDataMessage::InclusionError|IndexDataMessage::ParseFailure));
-    Set<uint32_t> files;
+    // visited file -> what it includes now, only rows that differ are touched
+    Hash<uint32_t, List<uint32_t> > includes;
     for (auto pair : msg->files()) {
         assert(pair.first);
-        DependencyNode *&node = mDependencies[pair.first];
-        if (!node) {
-            node = new DependencyNode(pair.first);
-            if (pair.second & IndexDataMessage::Visited)
-                files.insert(pair.first);
-        } else if (pair.second & IndexDataMessage::Visited) {
-            files.insert(pair.first);
-            if (prune) {
-                for (auto it : node->includes)
-                    it.second->dependents.remove(pair.first);
-                node->includes.clear();
-            }
-        }
+        mDependencies.insert(pair.first);
+        if (prune && pair.second & IndexDataMessage::Visited)
+            includes[pair.first];
         watchFile(pair.first);
     }
 
-    // // ### this probably deletes and recreates the same nodes very very often
     for (auto it : msg->includes()) {
         assert(it.first);
         assert(it.second);
-        DependencyNode *&includer = mDependencies[it.first];
-        DependencyNode *&inclusiary = mDependencies[it.second];
-        files.insert(it.first);
-        files.insert(it.second);
-        if (!includer)
-            includer = new DependencyNode(it.first);
-        if (!inclusiary)
-            inclusiary = new DependencyNode(it.second);
-        includer->include(inclusiary);
+        auto visited = includes.find(it.first);
+        if (visited != includes.end()) {
+            visited->second.append(it.second);
+        } else {
+            mDependencies.addInclude(it.first, it.second);
+        }
+    }
+    for (auto &pair : includes) {
+        std::sort(pair.second.begin(), pair.second.end());
+        pair.second.erase(std::unique(pair.second.begin(), pair.second.end()), pair.second.end());
+        mDependencies.setIncludes(pair.first, pair.second);
     }
+    mDependencies.compactIfNeeded();
 }
 
 int Project::reindex(const Match &match,
@@ -1155,10 +1810,9 @@ int Project::reindex(const Match &match,
     if (query->type() == QueryMessage::Reindex) {
         Set<uint32_t> dirtyFiles;
 
-        const auto end = mDependencies.constEnd();
-        for (auto it = mDependencies.constBegin(); it != end; ++it) {
-            if (!dirtyFiles.contains(it->first) && (match.isEmpty() || match.match(Location::path(it->first)))) {
-                dirtyFiles.insert(it->first);
+        for (uint32_t fileId : mDependencies.files()) {
+            if (!dirtyFiles.contains(fileId) && (match.isEmpty() || match.match(Location::path(fileId)))) {
+                dirtyFiles.insert(fileId);
             }
         }
         if (dirtyFiles.isEmpty())
@@ -1173,19 +1827,17 @@ int Project::reindex(const Match &match,
     }
 }
 
-int Project::remove(const Match &match)
+int Project::remove(const Match &match, bool *deferred)
 {
-    int count = 0;
-    auto it = mSources.begin();
-    while (it != mSources.end()) {
-        if (match.match(it->second.sourceFile())) {
-            removeSource(it++);
-            ++count;
-        } else {
-            ++it;
-        }
+    List<uint64_t> keys;
+    for (const auto &source : mSources) {
+        if (match.match(source.second.sourceFile()))
+            keys.append(source.first);
     }
-    return count;
+    const bool queued = !keys.isEmpty() && removeSources(keys) == MutationDeferred;
+    if (deferred)
+        *deferred = queued;
+    return keys.size();
 }
 
 int Project::startDirtyJobs(Dirty *dirty, IndexerJob::Flag flag,
@@ -1193,19 +1845,30 @@ int Project::startDirtyJobs(Dirty *dirty, IndexerJob::Flag flag,
                             const std::shared_ptr<Connection> &wait)
 {
     assert(flag == IndexerJob::Dirty || flag == IndexerJob::Reindex);
-    const JobScheduler::JobScope scope(Server::instance()->jobScheduler());
     List<Source> toIndex;
     for (const auto &source : mSources) {
         if (source.second.flags & Source::Active && dirty->isDirty(source.second)) {
             toIndex << source.second;
         }
     }
-    const Set<uint32_t> dirtyFiles = dirty->dirtied();
+    indexDirty(toIndex, dirty->dirtied(), flag, unsavedFiles, wait);
+    return toIndex.size();
+}
 
+void Project::indexDirty(const List<Source> &toIndex, const Set<uint32_t> &dirtyFiles, IndexerJob::Flag flag,
+                         const UnsavedFiles &unsavedFiles, const std::shared_ptr<Connection> &wait)
+{
+    if (!lockForMutation([this, toIndex, dirtyFiles, flag, unsavedFiles, wait]() {
+                indexDirty(toIndex, dirtyFiles, flag, unsavedFiles, wait);
+            })) {
+        return;
+    }
+    QueryLock::WriteLocker lock(mQueryLock, std::adopt_lock);
+    const JobScheduler::JobScope scope(Server::instance()->jobScheduler());
     {
         std::lock_guard<std::mutex> lock(mMutex);
         for (const auto &fileId : dirtyFiles) {
-            mVisitedFiles.remove(fileId);
+            removeVisitedFile(fileId);
         }
     }
 
@@ -1221,8 +1884,288 @@ int Project::startDirtyJobs(Dirty *dirty, IndexerJob::Flag flag,
         }
         index(job);
     }
+}
 
-    return toIndex.size();
+// mMutex must be held
+void Project::removeVisitedFile(uint32_t fileId)
+{
+    if (mVisitedFiles.remove(fileId)) {
+        mVisitedFilesAdded.remove(fileId);
+        mVisitedFilesRemoved.insert(fileId);
+    }
+}
+
+void Project::encodeVisitedFiles(Serializer &serializer, uint64_t jobId)
+{
+    enum { MinSnapshotDelta = 256 };
+    std::lock_guard<std::mutex> lock(mMutex);
+    const size_t delta = mVisitedFilesAdded.size() + mVisitedFilesRemoved.size();
+    if (mVisitedFilesSnapshotPath.isEmpty() || delta > std::max<size_t>(MinSnapshotDelta, mVisitedFiles.size() / 8))
+        writeVisitedFilesSnapshot();
+    if (!mVisitedFilesSnapshotPath.isEmpty()) {
+        uint32_t &version = mVisitedFilesSnapshotJobs[jobId];
+        if (version != mVisitedFilesSnapshotVersion) {
+            assert(!version);
+            version = mVisitedFilesSnapshotVersion;
+            ++mVisitedFilesSnapshotUsers[version];
+        }
+    }
+    serializer << mVisitedFilesSnapshotPath << mVisitedFilesAdded << mVisitedFilesRemoved;
+}
+
+// Called once the rp for jobId is done with its snapshot, it finished,
+// crashed or was killed. Unknown ids are ignored.
+void Project::releaseVisitedFilesSnapshot(uint64_t jobId)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const uint32_t version = mVisitedFilesSnapshotJobs.take(jobId);
+    if (!version)
+        return;
+    auto it = mVisitedFilesSnapshotUsers.find(version);
+    assert(it != mVisitedFilesSnapshotUsers.end());
+    if (--it->second)
+        return;
+    mVisitedFilesSnapshotUsers.erase(it);
+    if (version != mVisitedFilesSnapshotVersion)
+        removeVisitedFilesSnapshot(version);
+}
+
+Path Project::visitedFilesSnapshotPath(uint32_t version) const
+{
+    return String::format<1024>("%svisited.%u", mSourceFilePathBase.constData(), version);
+}
+
+void Project::removeVisitedFilesSnapshot(uint32_t version)
+{
+    const Path path = visitedFilesSnapshotPath(version);
+    Path::rm(path);
+    Path::rm(path + ".ids");
+}
+
+// mMutex must be held. rp processes map these files read-only so a new
+// snapshot always goes to a new file.
+void Project::writeVisitedFilesSnapshot()
+{
+    Map<Path, uint32_t> paths;
+    Map<uint32_t, Path> ids;
+    for (const auto &it : mVisitedFiles) {
+        paths[it.second] = it.first;
+        ids[it.first] = it.second;
+    }
+    Path::mkdir(mSourceFilePathBase, Path::Recursive);
+    const uint32_t version = mVisitedFilesSnapshotVersion + 1;
+    const Path path = visitedFilesSnapshotPath(version);
+    if (!FileMap<Path, uint32_t>::write(path, paths, FileMap<int, int>::NoLock)
+        || !FileMap<uint32_t, Path>::write(path + ".ids", ids, FileMap<int, int>::NoLock)) {
+        error() << "Failed to write visited files snapshot" << path;
+        Path::rm(path);
+        Path::rm(path + ".ids");
+        if (mVisitedFilesSnapshotPath.isEmpty()) {
+            // send everything in the delta instead
+            mVisitedFilesAdded = mVisitedFiles;
+            mVisitedFilesRemoved.clear();
+        }
+        return;
+    }
+
+    // jobs that were started with the previous snapshot keep it alive until
+    // releaseVisitedFilesSnapshot()
+    if (!mVisitedFilesSnapshotPath.isEmpty() && !mVisitedFilesSnapshotUsers.contains(mVisitedFilesSnapshotVersion))
+        removeVisitedFilesSnapshot(mVisitedFilesSnapshotVersion);
+    mVisitedFilesSnapshotVersion = version;
+    mVisitedFilesSnapshotPath = path;
+    mVisitedFilesAdded.clear();
+    mVisitedFilesRemoved.clear();
+}
+
+void Project::setSegmentEntry(uint32_t fileId, const SegmentEntry &entry)
+{
+    removeSegmentEntry(fileId);
+    mSegmentEntries[fileId] = entry;
+    SegmentInfo &info = mSegments[entry.segment];
+    ++info.files;
+    info.liveBytes += entry.size();
+    // all the entries of a segment are set before any of them can be replaced
+    info.size = std::max(info.size, info.liveBytes);
+}
+
+void Project::discardSegments(const std::shared_ptr<IndexDataMessage> &msg)
+{
+    Set<uint32_t> segments;
+    for (const auto &entry : msg->segmentEntries())
+        segments.insert(entry.second.segment);
+    for (uint32_t segment : segments) {
+        if (!mSegments.contains(segment))
+            Path::rm(segmentPath(segment));
+    }
+}
+
+void Project::removeSegmentEntry(uint32_t fileId)
+{
+    const auto it = mSegmentEntries.find(fileId);
+    if (it == mSegmentEntries.end())
+        return;
+    const uint32_t segment = it->second.segment;
+    const uint64_t size = it->second.size();
+    mSegmentEntries.erase(it);
+    if (mFileMapScope)
+        mFileMapScope->invalidate(fileId);
+    auto seg = mSegments.find(segment);
+    if (seg == mSegments.end())
+        return;
+    seg->second.liveBytes -= size;
+    if (!--seg->second.files) {
+        Path::rm(segmentPath(segment));
+        mSegments.erase(seg);
+    }
+}
+
+// Drops entries whose segment is missing or truncated and removes segments
+// that no file refers to, e.g. ones written by jobs that never finished.
+void Project::initSegments()
+{
+    mSegments.clear();
+    for (const auto &entry : mSegmentEntries) {
+        SegmentInfo &info = mSegments[entry.second.segment];
+        ++info.files;
+        info.liveBytes += entry.second.size();
+    }
+    auto seg = mSegments.begin();
+    while (seg != mSegments.end()) {
+        const Path path = segmentPath(seg->first);
+        seg->second.size = path.fileSize();
+        if (seg->second.size < seg->second.liveBytes) {
+            warning() << "Segment" << path << "is missing or truncated";
+            mSegments.erase(seg++);
+        } else {
+            ++seg;
+        }
+    }
+    auto it = mSegmentEntries.begin();
+    while (it != mSegmentEntries.end()) {
+        if (!mSegments.contains(it->second.segment)) {
+            mSegmentEntries.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    const Path dir = mSourceFilePathBase + "segments/";
+    dir.visit([this](const Path &path) {
+            char *end;
+            const unsigned long segment = strtoul(path.fileName(), &end, 10);
+            if (*end || !mSegments.contains(segment))
+                Path::rm(path);
+            mNextSegmentId = std::max<uint32_t>(mNextSegmentId, segment);
+            return Path::Continue;
+        });
+}
+
+// Copies the maps of entries into the new segment id, returns where they
+// ended up. Runs on a query thread.
+static Hash<uint32_t, SegmentEntry> copySegments(const Path &base, uint32_t id, const Hash<uint32_t, SegmentEntry> &entries)
+{
+    String data;
+    Hash<uint32_t, String> contents;
+    Hash<uint32_t, SegmentEntry> moved;
+    for (const auto &entry : entries) {
+        const uint32_t segment = entry.second.segment;
+        auto c = contents.find(segment);
+        if (c == contents.end())
+            c = contents.insert(std::make_pair(segment, SegmentEntry::path(base, segment).readAll())).first;
+        bool ok = true;
+        for (size_t i=0; i<SegmentEntry::MapCount && ok; ++i)
+            ok = static_cast<uint64_t>(entry.second.offsets[i]) + entry.second.sizes[i] <= c->second.size();
+        if (!ok) {
+            // a segment is removed when its last entry is replaced, a job
+            // may have done that since
+            if (!c->second.isEmpty())
+                error() << "Failed to compact segment" << SegmentEntry::path(base, segment) << "it is truncated";
+            continue;
+        }
+        SegmentEntry &e = moved[entry.first];
+        e.segment = id;
+        for (size_t i=0; i<SegmentEntry::MapCount; ++i) {
+            e.offsets[i] = data.size();
+            e.sizes[i] = entry.second.sizes[i];
+            data.append(c->second.constData() + entry.second.offsets[i], entry.second.sizes[i]);
+        }
+    }
+    if (!moved.isEmpty() && !SegmentEntry::write(SegmentEntry::path(base, id), data)) {
+        error() << "Failed to write segment" << SegmentEntry::path(base, id);
+        moved.clear();
+    }
+    return moved;
+}
+
+// Copies the live data of segments that are mostly garbage into a new
+// segment on a query thread. Only started when no jobs are running, the new
+// entries are swapped in by applyCompaction().
+void Project::compactSegments()
+{
+    enum { MaxCompactionSize = 64 * 1024 * 1024 };
+    if (mCompactingSegments)
+        return;
+    Set<uint32_t> segments;
+    uint64_t total = 0;
+    for (const auto &seg : mSegments) {
+        if (seg.second.liveBytes * 2 < seg.second.size && total + seg.second.liveBytes <= MaxCompactionSize) {
+            segments.insert(seg.first);
+            total += seg.second.liveBytes;
+        }
+    }
+    if (segments.isEmpty())
+        return;
+
+    Hash<uint32_t, SegmentEntry> entries;
+    for (const auto &entry : mSegmentEntries) {
+        if (segments.contains(entry.second.segment))
+            entries[entry.first] = entry.second;
+    }
+    const uint32_t id = nextSegmentId();
+    const Path base = mSourceFilePathBase;
+    QueryThreadPool *pool = Server::instance()->queryThreadPool();
+    if (!pool) {
+        applyCompaction(id, entries, copySegments(base, id, entries));
+        return;
+    }
+    mCompactingSegments = true;
+    const std::weak_ptr<Project> weak = shared_from_this();
+    pool->post([weak, base, id, entries]() {
+            StopWatch sw;
+            const Hash<uint32_t, SegmentEntry> moved = copySegments(base, id, entries);
+            warning() << "Copied" << moved.size() << "files to segment" << SegmentEntry::path(base, id) << "in" << sw.elapsed() << "ms";
+            EventLoop::mainEventLoop()->callLater([weak, id, entries, moved]() {
+                    if (std::shared_ptr<Project> project = weak.lock()) {
+                        project->mCompactingSegments = false;
+                        project->applyCompaction(id, entries, moved);
+                    }
+                });
+        });
+}
+
+// Points the files that still use the entries compactSegments() copied at
+// segment id. The old segments go away with their last entry.
+void Project::applyCompaction(uint32_t id, const Hash<uint32_t, SegmentEntry> &entries,
+                              const Hash<uint32_t, SegmentEntry> &moved)
+{
+    if (!lockForMutation([this, id, entries, moved]() { applyCompaction(id, entries, moved); }))
+        return;
+    QueryLock::WriteLocker lock(mQueryLock, std::adopt_lock);
+    for (const auto &entry : moved) {
+        const auto current = mSegmentEntries.find(entry.first);
+        // jobs that finished since may have replaced it
+        if (current == mSegmentEntries.end() || current->second.segment != entries.value(entry.first).segment)
+            continue;
+        setSegmentEntry(entry.first, entry.second);
+    }
+    auto seg = mSegments.find(id);
+    if (seg == mSegments.end()) {
+        Path::rm(segmentPath(id));
+        return;
+    }
+    seg->second.size = segmentPath(id).fileSize();
+    save();
 }
 
 bool Project::isIndexed(uint32_t fileId) const
@@ -1350,13 +2293,29 @@ void Project::findSymbols(const String &unencoded,
         lowerBound = string;
     }
 
-    auto processFile = [this, &lowerBound, &string, wildcard, cs, &inserter](uint32_t file) {
+    auto processEntry = [&string, wildcard, cs, &inserter](const String &entry, const Set<Location> &locations) {
+        SymbolMatchType type = Exact;
+        if (!string.isEmpty()) {
+            if (wildcard) {
+                if (!Rct::wildCmp(string.constData(), entry.constData(), cs)) {
+                    return true;
+                }
+                type = Wildcard;
+            } else if (!entry.startsWith(string, cs)) {
+                return cs == String::CaseInsensitive;
+            } else if (entry.size() != string.size()) {
+                type = StartsWith;
+            }
+        }
+        inserter(type, entry, locations);
+        return true;
+    };
+
+    auto processFile = [this, &lowerBound, &processEntry](uint32_t file) {
         auto symNames = openSymbolNames(file);
         if (!symNames)
             return;
         const int count = symNames->count();
-        // error() << "Looking at" << count << Location::path(dep.first)
-        //         << lowerBound << string;
         uint32_t idx = 0;
         if (!lowerBound.isEmpty()) {
             idx = symNames->lowerBound(lowerBound);
@@ -1366,35 +2325,18 @@ void Project::findSymbols(const String &unencoded,
         }
 
         for (int i=idx; i<count; ++i) {
-            const String entry = symNames->keyAt(i);
-            // error() << i << count << entry;
-            SymbolMatchType type = Exact;
-            if (!string.isEmpty()) {
-                if (wildcard) {
-                    if (!Rct::wildCmp(string.constData(), entry.constData(), cs)) {
-                        continue;
-                    }
-                    type = Wildcard;
-                } else if (!entry.startsWith(string, cs)) {
-                    if (cs == String::CaseInsensitive) {
-                        continue;
-                    } else {
-                        break;
-                    }
-                    type = StartsWith;
-                } else if (entry.size() != string.size()) {
-                    type = StartsWith;
-                }
-            }
-            inserter(type, entry, symNames->valueAt(i));
+            if (!processEntry(symNames->keyAt(i), symNames->valueAt(i)))
+                break;
         }
     };
 
     if (fileFilter) {
         processFile(fileFilter);
+    } else if (!mRebuildingIndexes && mSymbolNameIndex.isLoaded()) {
+        mSymbolNameIndex.visit(lowerBound, processEntry);
     } else {
-        for (const auto &dep : mDependencies) {
-            processFile(dep.first);
+        for (uint32_t fileId : mDependencies.files()) {
+            processFile(fileId);
         }
     }
 }
@@ -1536,15 +2478,16 @@ Symbol Project::findSymbol(Location location, int *index)
         break;
     }
 
-    const Symbol &ret = symbols->valueAt(idx);
-    if (ret.location.fileId() != location.fileId()
-        || ret.location.line() != location.line()
-        || (location.column() - ret.location.column() >= ret.symbolLength)) {
+    const SymbolView view(symbols->valueData(idx));
+    const Location loc = view.location();
+    if (loc.fileId() != location.fileId()
+        || loc.line() != location.line()
+        || (location.column() - loc.column() >= view.symbolLength())) {
         return Symbol();
     }
     if (index)
         *index = idx;
-    return ret;
+    return view.symbol();
 }
 
 Set<Symbol> Project::findTargets(const Symbol &symbol)
@@ -1595,39 +2538,50 @@ Set<Symbol> Project::findTargets(const Symbol &symbol)
     return ret;
 }
 
+// Runs func for each file, spread over the query threads, and merges the
+// results in file order.
+static Set<Symbol> collectSymbols(const List<uint32_t> &files, const std::function<void(uint32_t, Set<Symbol> &)> &func)
+{
+    List<Set<Symbol> > results;
+    results.resize(files.size());
+    auto process = [&](size_t idx) { func(files.at(idx), results[idx]); };
+    if (QueryThreadPool *pool = Server::instance()->queryThreadPool()) {
+        pool->parallelFor(files.size(), process);
+    } else {
+        for (size_t i=0; i<files.size(); ++i)
+            process(i);
+    }
+    Set<Symbol> ret;
+    for (const Set<Symbol> &result : results)
+        ret.unite(result);
+    return ret;
+}
+
 Set<Symbol> Project::findByUsr(const String &usr, uint32_t fileId, DependencyMode mode, Location filtered)
 {
     assert(fileId);
-    Set<Symbol> ret;
     String tusr = Sandbox::encoded(usr);
-    for (uint32_t file : dependencies(fileId, mode)) {
+    auto process = [this, &tusr](uint32_t file, Set<Symbol> &out) {
         auto usrs = openUsrs(file);
-        // error() << usrs << Location::path(file) << usr;
         if (usrs) {
             // SBROOT
             for (Location loc : usrs->value(tusr)) {
-                // error() << "got a loc" << loc;
                 const Symbol c = findSymbol(loc);
                 if (!c.isNull())
-                    ret.insert(c);
+                    out.insert(c);
             }
-            // for (int i=0; i<usrs->count(); ++i) {
-            //     error() << i << usrs->count() << usrs->keyAt(i) << usrs->valueAt(i);
-            // }
         }
-    }
+    };
+    Set<Symbol> ret = collectSymbols(dependencies(fileId, mode).toList(), process);
     if (ret.isEmpty() || (!filtered.isNull() && ret.size() == 1 && ret.begin()->location == filtered)) {
-        for (const auto &dep : mDependencies) {
-            auto usrs = openUsrs(dep.first);
-            if (usrs) {
-                // SBROOT
-                tusr = Sandbox::encoded(usr);
-                for (Location loc : usrs->value(tusr)) {
-                    const Symbol c = findSymbol(loc);
-                    if (!c.isNull())
-                        ret.insert(c);
-                }
+        if (!mRebuildingIndexes && mUsrIndex.isLoaded()) {
+            for (Location loc : mUsrIndex.value(tusr)) {
+                const Symbol c = findSymbol(loc);
+                if (!c.isNull())
+                    ret.insert(c);
             }
+        } else {
+            ret.unite(collectSymbols(mDependencies.files(), process));
         }
     }
 
@@ -1649,30 +2603,43 @@ static Set<Symbol> findReferences(const Set<Symbol> &inputs,
     // const bool isClazz = s.isClass();
     for (const Symbol &input : inputs) {
         //warning() << "Calling findReferences" << input.location;
-        auto process = [&](uint32_t dep) {
-            // error() << "Looking at file" << Location::path(dep) << "for input" << input.location;
+        // SBROOT
+        const String tusr = Sandbox::encoded(input.usr);
+        Set<uint32_t> referencing;
+        const bool indexed = project->referencingFiles(tusr, referencing);
+        auto process = [&](uint32_t dep, Set<Symbol> &out) {
             auto targets = project->openTargets(dep);
             if (targets) {
-                // SBROOT
-                const String tusr = Sandbox::encoded(input.usr);
                 const Set<Location> locations = targets->value(tusr);
-                // error() << "Got locations for usr" << input.usr << locations;
                 for (const auto &loc : locations) {
                     auto sym = project->findSymbol(loc);
                     if (filter(input, sym))
-                        ret.insert(sym);
+                        out.insert(sym);
                 }
             }
         };
         const Set<uint32_t> deps = project->dependencies(input.location.fileId(), Project::DependsOnArg);
-        for (auto dep : deps)
-            process(dep);
+        List<uint32_t> files;
+        for (auto dep : deps) {
+            if (!indexed || referencing.contains(dep))
+                files.append(dep);
+        }
+        ret.unite(collectSymbols(files, process));
 
         if (ret.isEmpty()) {
-            for (auto dep : project->dependencies()) {
-                if (!deps.contains(dep.first))
-                    process(dep.first);
+            files.clear();
+            if (indexed) {
+                for (auto dep : referencing) {
+                    if (!deps.contains(dep))
+                        files.append(dep);
+                }
+            } else {
+                for (uint32_t dep : project->dependencies().files()) {
+                    if (!deps.contains(dep))
+                        files.append(dep);
+                }
             }
+            ret.unite(collectSymbols(files, process));
         }
     }
     return ret;
@@ -1838,41 +2805,27 @@ Set<String> Project::findTargetUsrs(Location loc)
 Set<Symbol> Project::findSubclasses(const Symbol &symbol)
 {
     assert(symbol.isClass() && symbol.isDefinition());
-    Set<Symbol> ret;
-    for (uint32_t dep : dependencies(symbol.location.fileId(), DependsOnArg)) {
-        auto symbols = openSymbols(dep);
-        if (symbols) {
-            const int count = symbols->count();
-            for (int i=0; i<count; ++i) {
-                const Symbol s = symbols->valueAt(i);
-                if (s.baseClasses.contains(symbol.usr))
-                    ret.insert(s);
+    return collectSymbols(dependencies(symbol.location.fileId(), DependsOnArg).toList(), [this, &symbol](uint32_t dep, Set<Symbol> &out) {
+            auto symbols = openSymbols(dep);
+            if (symbols) {
+                const int count = symbols->count();
+                for (int i=0; i<count; ++i) {
+                    const SymbolView s(symbols->valueData(i));
+                    if (s.hasBaseClass(symbol.usr))
+                        out.insert(s.symbol());
+                }
             }
-        }
-    }
-    return ret;
-}
-
-void Project::beginScope()
-{
-    assert(!mFileMapScope);
-    mFileMapScope.reset(new FileMapScope(shared_from_this(), Server::instance()->options().maxFileMapScopeCacheSize));
-}
-
-void Project::endScope()
-{
-    assert(mFileMapScope);
-    mFileMapScope.reset();
+        });
 }
 
-static String addDeps(const Dependencies &deps)
+static String addDeps(const Set<uint32_t> &deps)
 {
     if (deps.isEmpty())
         return "nil";
     String ret;
     ret << "(list";
-    for (const auto &dep : deps) {
-        ret << " \"" << Location::path(dep.first) << "\"";
+    for (uint32_t dep : deps) {
+        ret << " \"" << Location::path(dep) << "\"";
     }
     ret << ")";
     return ret;
@@ -1882,42 +2835,45 @@ String Project::dumpDependencies(uint32_t fileId, const List<String> &args, Flag
 {
     String ret;
 
-    auto dumpRaw = [&ret, flags](DependencyNode *n) {
+    auto dumpRaw = [this, &ret, flags](uint32_t file) {
+        const Set<uint32_t> includes = mDependencies.edges(file, DependencyGraph::Includes);
+        const Set<uint32_t> dependents = mDependencies.edges(file, DependencyGraph::Dependents);
         if (!(flags & QueryMessage::Elisp)) {
-            ret << Location::path(n->fileId) << "\n";
-            for (const auto &inc : n->includes) {
-                ret << "  " << Location::path(inc.second->fileId) << "\n";
+            ret << Location::path(file) << "\n";
+            for (uint32_t inc : includes) {
+                ret << "  " << Location::path(inc) << "\n";
             }
-            for (const auto &dep : n->dependents) {
-                ret << "    " << Location::path(dep.second->fileId) << "\n";
+            for (uint32_t dep : dependents) {
+                ret << "    " << Location::path(dep) << "\n";
             }
             return;
         }
 
-        ret << " (cons \"" << Location::path(n->fileId) << "\" (cons " << addDeps(n->includes) << ' ' << addDeps(n->dependents) << "))\n";
+        ret << " (cons \"" << Location::path(file) << "\" (cons " << addDeps(includes) << ' ' << addDeps(dependents) << "))\n";
     };
 
     if (fileId) {
-        DependencyNode *node = mDependencies.value(fileId);
-        if (!node)
+        if (!mDependencies.contains(fileId))
             return String::format<128>("Can't find node for %s", Location::path(fileId).constData());
 
-        if (!node->includes.isEmpty() && (args.isEmpty() || args.contains("includes"))) {
+        const Set<uint32_t> includes = mDependencies.edges(fileId, DependencyGraph::Includes);
+        if (!includes.isEmpty() && (args.isEmpty() || args.contains("includes"))) {
             if (args.size() != 1)
                 ret += String::format<256>("  %s includes:\n", Location::path(fileId).constData());
-            for (const auto &include : node->includes) {
-                ret += String::format<256>("    %s\n", Location::path(include.first).constData());
+            for (uint32_t include : includes) {
+                ret += String::format<256>("    %s\n", Location::path(include).constData());
             }
         }
-        if (!node->dependents.isEmpty() && (args.isEmpty() || args.contains("included-by"))) {
+        const Set<uint32_t> dependents = mDependencies.edges(fileId, DependencyGraph::Dependents);
+        if (!dependents.isEmpty() && (args.isEmpty() || args.contains("included-by"))) {
             if (args.size() != 1)
                 ret += String::format<256>("  %s is included by:\n", Location::path(fileId).constData());
-            for (const auto &include : node->dependents) {
-                ret += String::format<256>("    %s\n", Location::path(include.first).constData());
+            for (uint32_t dependent : dependents) {
+                ret += String::format<256>("    %s\n", Location::path(dependent).constData());
             }
         }
 
-        if (args.isEmpty() || args.contains("depends-on")) {
+    if (args.isEmpty() || args.contains("depends-on")) {
             bool first = args.size() != 1;
             for (auto dep : dependencies(fileId, Project::ArgDependsOn)) {
                 if (dep == fileId)
@@ -1944,53 +2900,40 @@ String Project::dumpDependencies(uint32_t fileId, const List<String> &args, Flag
         }
 
         if (args.isEmpty() || args.contains("tree-depends-on")) {
-            Set<DependencyNode*> seen;
-
-            DependencyNode *depNode = mDependencies.value(fileId);
-            if (depNode) {
-                int startDepth = 1;
-                if (args.size() != 1) {
-                    ++startDepth;
-                    ret += String::format<256>("  %s include tree:\n", Location::path(fileId).constData());
-                }
-
-                std::function<void(DependencyNode *, int)> process = [&](DependencyNode *n, int depth) {
-                    ret += String::format<256>("%s%s", String(depth * 2, ' ').constData(), Location::path(n->fileId).constData());
+            Set<uint32_t> seen;
 
-                    if (seen.insert(n) && !n->includes.isEmpty()) {
-                        ret += " includes:\n";
-                        for (const auto &includeNode : n->includes) {
-                            process(includeNode.second, depth + 1);
-                        }
-                    } else {
-                        ret += '\n';
-                    }
-                };
-                process(depNode, startDepth);
+            int startDepth = 1;
+            if (args.size() != 1) {
+                ++startDepth;
+                ret += String::format<256>("  %s include tree:\n", Location::path(fileId).constData());
             }
-        }
-        if (args.size() == 1 && args.contains("raw")) {
-            Set<DependencyNode*> all;
-            std::function<void(DependencyNode *node)> add = [&](DependencyNode *depNode) {
-                assert(depNode);
-                if (!all.insert(depNode))
-                    return;
-                for (const std::pair<uint32_t, DependencyNode*> &n : depNode->includes) {
-                    add(n.second);
+
+            std::function<void(uint32_t, int)> process = [&](uint32_t file, int depth) {
+                ret += String::format<256>("%s%s", String(depth * 2, ' ').constData(), Location::path(file).constData());
+
+                if (seen.insert(file) && mDependencies.edgeCount(file, DependencyGraph::Includes)) {
+                    ret += " includes:\n";
+                    mDependencies.visit(file, DependencyGraph::Includes, [&](uint32_t include) {
+                            process(include, depth + 1);
+                        });
+                } else {
+                    ret += '\n';
                 }
             };
-            add(node);
+            process(fileId, startDepth);
+        }
+        if (args.size() == 1 && args.contains("raw")) {
             ret << "(list\n";
-            for (DependencyNode *n : all) {
-                dumpRaw(n);
+            for (uint32_t file : dependencies(fileId, ArgDependsOn)) {
+                dumpRaw(file);
             }
             ret.chop(1);
             ret << ")\n";
         }
     } else {
         ret << "(list\n";
-        for (const auto &node : mDependencies) {
-            dumpRaw(node.second);
+        for (uint32_t file : mDependencies.files()) {
+            dumpRaw(file);
         }
         ret.chop(1);
         ret << ")\n";
@@ -2010,74 +2953,59 @@ void Project::dirty(uint32_t fileId)
 
 bool Project::validate(uint32_t fileId, ValidateMode mode, String *err) const
 {
+    const auto it = mSegmentEntries.find(fileId);
+    if (it == mSegmentEntries.end()) {
+        Log(err) << "Error during validation:" << Location::path(fileId) << "has no data";
+        return false;
+    }
     if (mode == Validate) {
-        Path path;
         String error;
-        const uint32_t opts = fileMapOptions();
-        {
-            path = sourceFilePath(fileId, fileMapName(SymbolNames));
-            FileMap<String, Set<Location> > fileMap;
-            if (!fileMap.load(path, opts, &error))
-                goto error;
-        }
-        {
-            path = sourceFilePath(fileId, fileMapName(Symbols));
-            FileMap<Location, Symbol> fileMap;
-            if (!fileMap.load(path, opts, &error))
-                goto error;
-        }
-        {
-            path = sourceFilePath(fileId, fileMapName(Targets));
-            FileMap<String, Set<Location> > fileMap;
-            if (!fileMap.load(path, opts, &error))
-                goto error;
-        }
-        {
-            path = sourceFilePath(fileId, fileMapName(Usrs));
-            FileMap<String, Set<Location> > fileMap;
-            if (!fileMap.load(path, opts, &error))
-                goto error;
+        FileMap<String, Set<Location> > symbolNames, targets, usrs;
+        FileMap<Location, Symbol> symbols;
+        if (!readFileMap(fileId, SegmentEntry::SymbolNames, symbolNames, &error)
+            || !readFileMap(fileId, SegmentEntry::Symbols, symbols, &error)
+            || !readFileMap(fileId, SegmentEntry::Targets, targets, &error)
+            || !readFileMap(fileId, SegmentEntry::Usrs, usrs, &error)) {
+            if (err)
+                Log(err) << "Error during validation:" << Location::path(fileId) << error << segmentPath(it->second.segment);
+            return false;
         }
-        return true;
-  error:
-        if (err)
-            Log(err) << "Error during validation:" << Location::path(fileId) << error << path;
-        return false;
     } else {
+        // the segment files themselves are checked once in initSegments()
         assert(mode == StatOnly);
-        for (auto type : { Symbols, SymbolNames, Targets, Usrs }) {
-            const Path p = sourceFilePath(fileId, fileMapName(type));
-            if (!p.isFile()) {
-                Log(err) << "Error during validation:" << Location::path(fileId) << p << "doesn't exist";
-                return false;
-            }
-        }
     }
     return true;
 }
 
 void Project::loadFailed(uint32_t fileId)
 {
-    const Path sourcePath = Location::path(fileId);
-    if (sourcePath.isSource()) {
-        if (Server::instance()->jobScheduler()->increasePriority(fileId))
-            return;
-    } else { // header
-        for (auto dep : dependencies(fileId, Project::DependsOnArg)) {
-            if (Location::path(dep).isSource()) {
-                auto src = mSources.lower_bound(Source::key(dep, 0));
-                if (src != mSources.end()) {
-                    uint32_t f, b;
-                    Source::decodeKey(src->first, f, b);
-                    if (f == dep && Server::instance()->jobScheduler()->increasePriority(dep)) {
-                        return;
+    // Called from openFileMap(), possibly on a query thread.
+    std::weak_ptr<Project> weak = shared_from_this();
+    EventLoop::mainEventLoop()->callLater([weak, fileId]() {
+            std::shared_ptr<Project> project = weak.lock();
+            if (!project)
+                return;
+            const Path sourcePath = Location::path(fileId);
+            if (sourcePath.isSource()) {
+                if (Server::instance()->jobScheduler()->increasePriority(fileId))
+                    return;
+            } else { // header
+                for (auto dep : project->dependencies(fileId, Project::DependsOnArg)) {
+                    if (Location::path(dep).isSource()) {
+                        auto src = project->mSources.lower_bound(Source::key(dep, 0));
+                        if (src != project->mSources.end()) {
+                            uint32_t f, b;
+                            Source::decodeKey(src->first, f, b);
+                            if (f == dep && Server::instance()->jobScheduler()->increasePriority(dep)) {
+                                return;
+                            }
+                        }
                     }
                 }
             }
-        }
-    }
 
-    dirty(fileId); // file might have gone missing
+            project->dirty(fileId); // file might have gone missing
+        });
 }
 
 template <typename T>
@@ -2166,9 +3094,11 @@ static List<String> formatField(const String &value, size_t max)
     }
     return ret;
 }
-template <typename Key, typename Value>
-static String formatTable(const String &name, const std::shared_ptr<FileMap<Key, Value> > &fileMap, size_t width)
+template <typename Map>
+static String formatTable(const String &name, const std::shared_ptr<Map> &fileMap, size_t width)
 {
+    typedef typename Map::KeyType Key;
+    typedef typename Map::ValueType Value;
     width -= 7; // padding
     List<String> keys, values;
     const int count = fileMap->count();
@@ -2209,7 +3139,6 @@ static String formatTable(const String &name, const std::shared_ptr<FileMap<Key,
 
 void Project::dumpFileMaps(const std::shared_ptr<QueryMessage> &msg, const std::shared_ptr<Connection> &conn)
 {
-    beginScope();
     String err;
 
     Path path;
@@ -2259,22 +3188,17 @@ void Project::dumpFileMaps(const std::shared_ptr<QueryMessage> &msg, const std::
             conn->write(err);
         }
     }
-
-
-    endScope();
 }
 
 void Project::prepare(uint32_t fileId)
 {
     if (fileId && isIndexed(fileId)) {
-        beginScope();
         String err;
         openSymbolNames(fileId, &err);
         openSymbols(fileId, &err);
         openTargets(fileId, &err);
         openUsrs(fileId, &err);
         debug() << "Prepared" << Location::path(fileId);
-        endScope();
     }
 }
 
@@ -2407,11 +3331,7 @@ String Project::estimateMemory() const
     add("Pending dirty files", ::estimateMemory(mPendingDirtyFiles));
     add("Sources", ::estimateMemory(mSources));
     add("Suspended files", ::estimateMemory(mSuspendedFiles));
-    size_t deps = ::estimateMemory(mDependencies);
-    for (const auto &dep : mDependencies) {
-        deps += ::estimateMemory(*dep.second);
-    }
-    add("Dependencies", deps);
+    add("Dependencies", mDependencies.memoryUsage());
     add("Total", total);
     return String::join(ret, "\n");
 }
@@ -2430,15 +3350,15 @@ void Project::setCompilationDatabaseInfos(Hash<Path, CompilationDataBaseInfo> &&
         info.second.lastModified = Path(info.first + "compile_commands.json").lastModifiedMs();
         watch(info.first, Watch_CompilationDatabase);
     }
-    Sources::iterator it = mSources.begin();
-    while (it != mSources.end()) {
-        if (!indexed.contains(it->first)) {
-            error() << it->second.sourceFile() << "is no longer in compile_commands.json, removing";
-            removeSource(it++);
-        } else {
-            ++it;
+    List<uint64_t> removed;
+    for (const auto &source : mSources) {
+        if (!indexed.contains(source.first)) {
+            error() << source.second.sourceFile() << "is no longer in compile_commands.json, removing";
+            removed.append(source.first);
         }
     }
+    if (!removed.isEmpty())
+        removeSources(removed);
     mSaveDirty = true;
 }
 
@@ -2456,6 +3376,20 @@ void Project::reloadCompilationDatabases()
     }
 }
 
+Project::MutationResult Project::removeSources(const List<uint64_t> &keys)
+{
+    if (!lockForMutation([this, keys]() { removeSources(keys); }))
+        return MutationDeferred;
+    QueryLock::WriteLocker lock(mQueryLock, std::adopt_lock);
+    for (uint64_t key : keys) {
+        auto it = mSources.find(key);
+        if (it != mSources.end())
+            removeSource(it);
+    }
+    return MutationApplied;
+}
+
+// mQueryLock must be held for writing
 void Project::removeSource(Sources::iterator it)
 {
     const uint64_t key = it->first;
@@ -2463,14 +3397,53 @@ void Project::removeSource(Sources::iterator it)
     if (job) {
         releaseFileIds(job->visited);
         Server::instance()->jobScheduler()->abort(job);
+        releaseVisitedFilesSnapshot(job->id);
     }
     uint32_t fileId, buildRootId;
     Source::decodeKey(key, fileId, buildRootId);
     removeDependencies(fileId);
+    removeCost(key);
     Path::rmdir(sourceFilePath(fileId).constData());
     mSources.erase(it);
 }
 
+void Project::recordCost(const std::shared_ptr<IndexDataMessage> &msg)
+{
+    if (msg->flags() & IndexDataMessage::ParseFailure || !msg->parseDuration())
+        return;
+    removeCost(msg->key());
+    SourceCost &cost = mSourceCosts[msg->key()];
+    cost.parseDuration = msg->parseDuration();
+    cost.visitDuration = msg->visitDuration();
+    cost.writeDuration = msg->writeDuration();
+    cost.files = msg->files().size();
+    cost.bytesWritten = msg->bytesWritten();
+    mCostDuration += cost.duration();
+    mCostFiles += cost.files;
+}
+
+void Project::removeCost(uint64_t key)
+{
+    const SourceCost cost = mSourceCosts.take(key);
+    mCostDuration -= cost.duration();
+    mCostFiles -= cost.files;
+}
+
+uint32_t Project::estimatedCost(const Source &source) const
+{
+    const auto it = mSourceCosts.find(source.key());
+    if (it != mSourceCosts.end())
+        return it->second.duration();
+    if (mSourceCosts.isEmpty())
+        return 0;
+    // Scale by the number of files it includes if we know them, the time
+    // spent in headers dominates
+    const size_t files = mDependencies.closure(source.fileId, DependencyGraph::Includes)->size();
+    if (files > 1 && mCostFiles)
+        return (mCostDuration * files) / mCostFiles;
+    return mCostDuration / mSourceCosts.size();
+}
+
 uint32_t Project::fileMapOptions() const
 {
     uint32_t options = FileMap<int, int>::None;
@@ -16,13 +16,19 @@
 #ifndef Project_h
 #define Project_h
 
+#include <atomic>
 #include <cstdint>
 #include <mutex>
+#include <thread>
 
+#include "DependencyGraph.h"
 #include "Diagnostic.h"
 #include "FileMap.h"
+#include "FileSignature.h"
 #include "IndexerJob.h"
 #include "IndexMessage.h"
+#include "ProjectIndex.h"
+#include "QueryLock.h"
 #include "QueryMessage.h"
 #include "rct/EmbeddedLinkedList.h"
 #include "rct/FileSystemWatcher.h"
@@ -31,15 +37,18 @@
 #include "rct/StopWatch.h"
 #include "rct/Timer.h"
 #include "rct/Serializer.h"
+#include "rct/SignalSlot.h"
 #include "RTags.h"
-#include "Token.h"
+#include "Segment.h"
+#include "SourceCost.h"
+#include "TokenMap.h"
 
 class Connection;
 class Dirty;
 class FileManager;
 class IndexDataMessage;
 class Match;
-class RestoreThread;
+class PCHManager;
 struct DependencyNode
 {
     DependencyNode(uint32_t f)
@@ -65,6 +74,7 @@ public:
     bool init();
 
     std::shared_ptr<FileManager> fileManager() const { return mFileManager; }
+    PCHManager *pchManager() const { return mPCHManager.get(); }
 
     Path path() const { return mPath; }
     void setCompilationDatabaseInfos(Hash<Path, CompilationDataBaseInfo> &&infos, const Set<uint64_t> &indexed);
@@ -73,49 +83,32 @@ public:
 
     bool match(const Match &match, bool *indexed = 0) const;
 
-    enum FileMapType {
-        Symbols,
-        SymbolNames,
-        Targets,
-        Usrs,
-        Tokens
-    };
-    static const char *fileMapName(FileMapType type)
-    {
-        switch (type) {
-        case Symbols: return "symbols";
-        case SymbolNames: return "symnames";
-        case Targets: return "targets";
-        case Usrs: return "usrs";
-        case Tokens: return "tokens";
-        }
-        return 0;
-    }
+    typedef SegmentEntry::FileMapType FileMapType;
     std::shared_ptr<FileMap<String, Set<Location> > > openSymbolNames(uint32_t fileId, String *err = 0)
     {
         assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(SymbolNames, fileId, mFileMapScope->symbolNames, err);
+        return mFileMapScope->openFileMap(SegmentEntry::SymbolNames, fileId, mFileMapScope->symbolNames, err);
     }
     std::shared_ptr<FileMap<Location, Symbol> > openSymbols(uint32_t fileId, String *err = 0)
     {
         assert(mFileMapScope);
-        return mFileMapScope->openFileMap<Location, Symbol>(Symbols, fileId, mFileMapScope->symbols, err);
+        return mFileMapScope->openFileMap(SegmentEntry::Symbols, fileId, mFileMapScope->symbols, err);
     }
     std::shared_ptr<FileMap<String, Set<Location> > > openTargets(uint32_t fileId, String *err = 0)
     {
         assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(Targets, fileId, mFileMapScope->targets, err);
+        return mFileMapScope->openFileMap(SegmentEntry::Targets, fileId, mFileMapScope->targets, err);
     }
     std::shared_ptr<FileMap<String, Set<Location> > > openUsrs(uint32_t fileId, String *err = 0)
     {
         assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(Usrs, fileId, mFileMapScope->usrs, err);
+        return mFileMapScope->openFileMap(SegmentEntry::Usrs, fileId, mFileMapScope->usrs, err);
     }
 
-    std::shared_ptr<FileMap<uint32_t, Token> > openTokens(uint32_t fileId, String *err = 0)
+    std::shared_ptr<TokenMap> openTokens(uint32_t fileId, String *err = 0)
     {
         assert(mFileMapScope);
-        return mFileMapScope->openFileMap<uint32_t, Token>(Tokens, fileId, mFileMapScope->tokens, err);
+        return mFileMapScope->openFileMap(SegmentEntry::Tokens, fileId, mFileMapScope->tokens, err);
     }
 
 
@@ -129,8 +122,7 @@ public:
     String dumpDependencies(uint32_t fileId,
                             const List<String> &args = List<String>(),
                             Flags<QueryMessage::Flag> flags = Flags<QueryMessage::Flag>()) const;
-    const Hash<uint32_t, DependencyNode*> &dependencies() const { return mDependencies; }
-    DependencyNode *dependencyNode(uint32_t fileId) const { return mDependencies.value(fileId); }
+    const DependencyGraph &dependencies() const { return mDependencies; }
 
     static bool readSources(const Path &path, Sources &sources,
                             Hash<Path, CompilationDataBaseInfo> *compileCommands, String *error);
@@ -164,8 +156,13 @@ public:
     Set<Symbol> findSubclasses(const Symbol &symbol);
 
     Set<Symbol> findByUsr(const String &usr, uint32_t fileId, DependencyMode mode, Location filtered = Location());
+    bool referencingFiles(const String &usr, Set<uint32_t> &files) const;
 
     Path sourceFilePath(uint32_t fileId, const char *path = "") const;
+    Path segmentPath(uint32_t segment) const { return SegmentEntry::path(mSourceFilePathBase, segment); }
+    uint32_t nextSegmentId() { return ++mNextSegmentId; }
+    template <typename T>
+    bool loadFileMap(uint32_t fileId, FileMapType type, T &fileMap, String *err = 0) const;
 
     List<RTags::SortedSymbol> sort(const Set<Symbol> &symbols,
                                    Flags<QueryMessage::Flag> flags = Flags<QueryMessage::Flag>());
@@ -184,14 +181,18 @@ public:
     List<Source> sources(uint32_t fileId) const;
     bool hasSource(uint32_t fileId) const;
     bool isActiveJob(uint64_t key) { return !key || mActiveJobs.contains(key); }
-    inline bool visitFile(uint32_t fileId, const Path &path, uint64_t id);
+    inline Set<uint32_t> visitFiles(const List<uint32_t> &fileIds, const List<Path> &paths, uint64_t id);
     inline void releaseFileIds(const Set<uint32_t> &fileIds);
     String fixIts(uint32_t fileId) const;
     int reindex(const Match &match,
                 const std::shared_ptr<QueryMessage> &query,
                 const std::shared_ptr<Connection> &wait);
-    int remove(const Match &match);
+    // *deferred is set if the sources are removed once the running queries
+    // have finished
+    int remove(const Match &match, bool *deferred = 0);
     void onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &msg);
+    // removes the segments written by a job whose results aren't used
+    void discardSegments(const std::shared_ptr<IndexDataMessage> &msg);
     Sources sources() const { return mSources; }
     String toCompilationDatabase() const;
     enum WatchMode {
@@ -216,16 +217,47 @@ public:
         std::lock_guard<std::mutex> lock(mMutex);
         return mVisitedFiles;
     }
-    void encodeVisitedFiles(Serializer &serializer)
+    // records which snapshot the job with jobId was started with, the
+    // snapshot is kept until every job using it has been released
+    void encodeVisitedFiles(Serializer &serializer, uint64_t jobId);
+    void releaseVisitedFilesSnapshot(uint64_t jobId);
+    // the files in fileIds that no job has claimed yet
+    List<uint32_t> unvisited(const List<uint32_t> &fileIds) const
     {
+        List<uint32_t> ret;
         std::lock_guard<std::mutex> lock(mMutex);
-        serializer << mVisitedFiles;
+        for (uint32_t fileId : fileIds) {
+            if (!mVisitedFiles.contains(fileId))
+                ret.append(fileId);
+        }
+        return ret;
     }
 
-    void beginScope();
-    void endScope();
+    // Queries running on the query threads hold the read lock. Changes to
+    // the project are made with the write lock held, changes that come in
+    // while a query is running are queued and made once the last query has
+    // finished. Queries don't start while changes are queued.
+    QueryLock &queryLock() { return mQueryLock; }
+    void onQueryFinished();
+    // what happened to a change that takes the write lock, see
+    // lockForMutation()
+    enum MutationResult {
+        MutationFailed,
+        MutationApplied,
+        MutationDeferred
+    };
+
+    // The files loaded by init() are validated on a background thread. Files
+    // the restore hasn't reached yet are validated when first loaded.
+    bool restoreProgress(size_t *done, size_t *total) const;
+    Signal<std::function<void(const std::shared_ptr<Project> &, size_t, size_t)> > &restoreProgressChanged() { return mRestoreProgressChanged; }
+    void stopRestore();
+
+    // The time the content of fileId last changed, lastModified if it has
+    // changed since we last looked at it and 0 if it's gone.
+    uint64_t contentModified(uint32_t fileId, uint64_t lastModified);
     void dirty(uint32_t fileId);
-    bool save();
+    MutationResult save();
     void prepare(uint32_t fileId);
     String estimateMemory() const;
     String diagnosticsToString(Flags<QueryMessage::Flag> flags, uint32_t fileId);
@@ -235,10 +267,16 @@ public:
     void fixPCH(Source &source);
     void includeCompletions(Flags<QueryMessage::Flag> flags, const std::shared_ptr<Connection> &conn, Source &&source) const;
     size_t bytesWritten() const { return mBytesWritten; }
+    // milliseconds an rp is expected to spend on source, 0 if there's no
+    // history to go by
+    uint32_t estimatedCost(const Source &source) const;
     void destroy() { mSaveDirty = false; }
 private:
+    void recordCost(const std::shared_ptr<IndexDataMessage> &msg);
+    void removeCost(uint64_t key);
     void reloadCompilationDatabases();
     void removeSource(Sources::iterator it);
+    MutationResult removeSources(const List<uint64_t> &keys);
     void onFileAddedOrModified(const Path &path);
     void watchFile(uint32_t fileId);
     enum ValidateMode {
@@ -246,25 +284,81 @@ private:
         Validate
     };
     bool validate(uint32_t fileId, ValidateMode mode, String *error = 0) const;
+    template <typename T>
+    bool readFileMap(uint32_t fileId, FileMapType type, T &fileMap, String *err) const;
+
+    struct RestoreResult {
+        uint32_t fileId;
+        uint64_t lastModified;
+        bool exists, valid;
+        String error;
+    };
+    void startRestore();
+    List<RestoreResult> restoreFiles(const List<uint32_t> &files, size_t begin, size_t end, ValidateMode mode);
+    void applyRestoreResults(const List<RestoreResult> &results);
+    void finishRestore();
+    struct RestoreState;
+    void applyRestore(const std::shared_ptr<RestoreState> &state);
+    bool checkRestored(uint32_t fileId, String *err) const;
+    uint64_t declarationSignature(uint32_t fileId) const;
+    void declarationSignatures(const List<uint32_t> &files,
+                               std::function<void(const Hash<uint32_t, uint64_t> &)> &&func);
+    void resolveHeaderProbes(uint64_t key, const Set<uint32_t> &visited, bool ok);
+    void finishHeaderProbes(const Hash<uint32_t, uint64_t> &lastModified, const Hash<uint32_t, uint64_t> &signatures);
     void removeDependencies(uint32_t fileId);
+    struct FileHash {
+        uint32_t fileId;
+        uint64_t lastModified, hash;
+    };
+    void recordSignatures(const Set<uint32_t> &files, uint64_t parseTime);
+    void applyFileHashes(const List<FileHash> &hashes);
     void updateDependencies(const std::shared_ptr<IndexDataMessage> &msg);
+    void updateIndexes(const Set<uint32_t> &files);
+    struct IndexUpdate {
+        uint32_t fileId, segment;
+        std::shared_ptr<FileMap<String, Set<Location> > > symbolNames, usrs, targets;
+    };
+    void startIndexUpdates();
+    void finishIndexUpdates(const List<IndexUpdate> &updates);
+    List<IndexUpdate> readIndexUpdates(const List<uint32_t> &files) const;
+    void applyIndexUpdates(const List<IndexUpdate> &updates);
+    void flushIndexUpdates();
+    void removeFromIndexes(uint32_t fileId);
+    bool saveIndexes();
+    void rebuildIndexes();
     void loadFailed(uint32_t fileId);
+    bool lockForMutation(std::function<void()> &&retry);
+    void applyPendingMutations();
+    void applyJobResult(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &msg);
+    void removeVisitedFile(uint32_t fileId);
+    void writeVisitedFilesSnapshot();
+    Path visitedFilesSnapshotPath(uint32_t version) const;
+    void removeVisitedFilesSnapshot(uint32_t version);
+    void setSegmentEntry(uint32_t fileId, const SegmentEntry &entry);
+    void removeSegmentEntry(uint32_t fileId);
+    void initSegments();
+    void compactSegments();
+    void applyCompaction(uint32_t id, const Hash<uint32_t, SegmentEntry> &entries,
+                         const Hash<uint32_t, SegmentEntry> &moved);
     void updateFixIts(const Set<uint32_t> &visited, FixIts &fixIts);
     Diagnostics updateDiagnostics(const Diagnostics &diagnostics);
     int startDirtyJobs(Dirty *dirty,
                        IndexerJob::Flag type,
                        const UnsavedFiles &unsavedFiles = UnsavedFiles(),
                        const std::shared_ptr<Connection> &wait = std::shared_ptr<Connection>());
+    void indexDirty(const List<Source> &sources, const Set<uint32_t> &dirtyFiles, IndexerJob::Flag type,
+                    const UnsavedFiles &unsavedFiles, const std::shared_ptr<Connection> &wait);
     void onDirtyTimeout(Timer *);
+    void startWatcherDirty(const Set<uint32_t> &dirtyFiles, const Hash<uint32_t, uint64_t> &signatures);
 
+    // Caches opened FileMaps across queries. Entries are evicted in LRU
+    // order when either the number of maps or their total size goes over the
+    // limit and invalidated when the data for a file changes. Shared by the
+    // query threads, mutex protects the cache but not the loading of maps.
     struct FileMapScope {
-        FileMapScope(const std::shared_ptr<Project> &proj, int m)
-            : project(proj), openedFiles(0), totalOpened(0), max(m)
+        FileMapScope(Project *proj, int m, size_t b)
+            : project(proj), openedFiles(0), bytes(0), max(m), budget(b)
         {}
-        ~FileMapScope()
-        {
-            warning() << "Query opened" << totalOpened << "files for project" << project->path();
-        }
 
         struct LRUKey {
             FileMapType type;
@@ -275,10 +369,11 @@ private:
             }
         };
         struct LRUEntry {
-            LRUEntry(FileMapType t, uint32_t f)
-                : key({ t, f })
+            LRUEntry(FileMapType t, uint32_t f, size_t s)
+                : key({ t, f }), size(s)
             {}
             const LRUKey key;
+            const size_t size;
 
             std::shared_ptr<LRUEntry> next, prev;
         };
@@ -292,62 +387,87 @@ private:
             entryList.append(ptr);
         }
 
-        template <typename Key, typename Value>
-        std::shared_ptr<FileMap<Key, Value> > openFileMap(FileMapType type, uint32_t fileId,
-                                                          Hash<uint32_t, std::shared_ptr<FileMap<Key, Value> > > &cache,
-                                                          String *errPtr)
+        void evict(const std::shared_ptr<LRUEntry> &e)
         {
-            auto it = cache.find(fileId);
-            if (it != cache.end()) {
-                poke(type, fileId);
-                return it->second;
+            entryList.remove(e);
+            entryMap.remove(e->key);
+            switch (e->key.type) {
+            case SegmentEntry::SymbolNames:
+                assert(symbolNames.contains(e->key.fileId));
+                symbolNames.remove(e->key.fileId);
+                break;
+            case SegmentEntry::Symbols:
+                assert(symbols.contains(e->key.fileId));
+                symbols.remove(e->key.fileId);
+                break;
+            case SegmentEntry::Targets:
+                assert(targets.contains(e->key.fileId));
+                targets.remove(e->key.fileId);
+                break;
+            case SegmentEntry::Usrs:
+                assert(usrs.contains(e->key.fileId));
+                usrs.remove(e->key.fileId);
+                break;
+            case SegmentEntry::Tokens:
+                assert(tokens.contains(e->key.fileId));
+                tokens.remove(e->key.fileId);
+                break;
             }
-            const Path path = project->sourceFilePath(fileId, Project::fileMapName(type));
-            std::shared_ptr<FileMap<Key, Value> > fileMap(new FileMap<Key, Value>);
-            String err;
-            if (fileMap->load(path, project->fileMapOptions(), &err)) {
-                ++totalOpened;
-                cache[fileId] = fileMap;
-                std::shared_ptr<LRUEntry> entry(new LRUEntry(type, fileId));
-                entryList.append(entry);
-                entryMap[entry->key] = entry;
-                if (++openedFiles > max) {
-                    const std::shared_ptr<LRUEntry> e = entryList.takeFirst();
-                    assert(e);
-                    entryMap.remove(e->key);
-                    switch (e->key.type) {
-                    case SymbolNames:
-                        assert(symbolNames.contains(e->key.fileId));
-                        symbolNames.remove(e->key.fileId);
-                        break;
-                    case Symbols:
-                        assert(symbols.contains(e->key.fileId));
-                        symbols.remove(e->key.fileId);
-                        break;
-                    case Targets:
-                        assert(targets.contains(e->key.fileId));
-                        targets.remove(e->key.fileId);
-                        break;
-                    case Usrs:
-                        assert(usrs.contains(e->key.fileId));
-                        usrs.remove(e->key.fileId);
-                        break;
-                    case Tokens:
-                        assert(tokens.contains(e->key.fileId));
-                        tokens.remove(e->key.fileId);
-                        break;
-                    }
-                    --openedFiles;
+            bytes -= e->size;
+            --openedFiles;
+        }
+
+        void invalidate(uint32_t fileId)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entryMap.lower_bound({ SegmentEntry::Symbols, fileId });
+            while (it != entryMap.end() && it->first.fileId == fileId) {
+                const std::shared_ptr<LRUEntry> e = (it++)->second;
+                evict(e);
+            }
+        }
+
+        template <typename T>
+        std::shared_ptr<T> openFileMap(FileMapType type, uint32_t fileId,
+                                       Hash<uint32_t, std::shared_ptr<T> > &cache,
+                                       String *errPtr)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = cache.find(fileId);
+                if (it != cache.end()) {
+                    poke(type, fileId);
+                    return it->second;
                 }
-                assert(openedFiles <= max);
-            } else {
+            }
+            // loaded without the lock so query threads can open maps in parallel
+            std::shared_ptr<T> fileMap(new T);
+            String err;
+            if (!project->loadFileMap(fileId, type, *fileMap, &err)) {
                 if (errPtr) {
-                    *errPtr = "Failed to open: " + path + " " + Location::path(fileId) + ": " + err;
+                    *errPtr = "Failed to open: " + Location::path(fileId) + " " + SegmentEntry::fileMapName(type) + ": " + err;
                 } else {
-                    error() << "Failed to open" << path << Location::path(fileId) << err;
+                    error() << "Failed to open" << Location::path(fileId) << SegmentEntry::fileMapName(type) << err;
                 }
                 project->loadFailed(fileId);
-                fileMap.reset();
+                return std::shared_ptr<T>();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = cache.find(fileId);
+            if (it != cache.end()) { // another thread got there first
+                poke(type, fileId);
+                return it->second;
+            }
+            cache[fileId] = fileMap;
+            std::shared_ptr<LRUEntry> entry(new LRUEntry(type, fileId, fileMap->size()));
+            entryList.append(entry);
+            entryMap[entry->key] = entry;
+            bytes += entry->size;
+            ++openedFiles;
+            // never evict the map we just opened
+            while ((openedFiles > max || bytes > budget) && entryList.first() != entry) {
+                const std::shared_ptr<LRUEntry> e = entryList.first();
+                evict(e);
             }
             return fileMap;
         }
@@ -355,13 +475,16 @@ private:
         Hash<uint32_t, std::shared_ptr<FileMap<String, Set<Location> > > > symbolNames;
         Hash<uint32_t, std::shared_ptr<FileMap<Location, Symbol> > > symbols;
         Hash<uint32_t, std::shared_ptr<FileMap<String, Set<Location> > > > targets, usrs;
-        Hash<uint32_t, std::shared_ptr<FileMap<uint32_t, Token> > > tokens;
-        std::shared_ptr<Project> project;
-        int openedFiles, totalOpened;
+        Hash<uint32_t, std::shared_ptr<TokenMap> > tokens;
+        Project *project;
+        int openedFiles;
+        size_t bytes;
         const int max;
+        const size_t budget;
 
         EmbeddedLinkedList<std::shared_ptr<LRUEntry> > entryList;
         Map<LRUKey, std::shared_ptr<LRUEntry> > entryMap;
+        std::mutex mutex;
     };
 
     std::shared_ptr<FileMapScope> mFileMapScope;
@@ -373,6 +496,14 @@ private:
     Files mFiles;
 
     Hash<uint32_t, Path> mVisitedFiles;
+    // changes to mVisitedFiles since the snapshot in mVisitedFilesSnapshotPath
+    Hash<uint32_t, Path> mVisitedFilesAdded;
+    Set<uint32_t> mVisitedFilesRemoved;
+    Path mVisitedFilesSnapshotPath;
+    uint32_t mVisitedFilesSnapshotVersion;
+    // job id -> snapshot version, snapshot version -> number of jobs
+    Hash<uint64_t, uint32_t> mVisitedFilesSnapshotJobs;
+    Hash<uint32_t, uint32_t> mVisitedFilesSnapshotUsers;
     int mJobCounter, mJobsStarted;
 
     Diagnostics mDiagnostics;
@@ -388,35 +519,109 @@ private:
     Sources mSources;
     Hash<Path, Flags<WatchMode> > mWatchedPaths;
     std::shared_ptr<FileManager> mFileManager;
+    std::unique_ptr<PCHManager> mPCHManager;
     FixIts mFixIts;
 
-    Hash<uint32_t, DependencyNode*> mDependencies;
+    DependencyGraph mDependencies;
     Set<uint32_t> mSuspendedFiles;
 
+    ProjectIndex<Location> mSymbolNameIndex;
+    ShardedProjectIndex<Location> mUsrIndex;
+    ShardedProjectIndex<uint32_t> mReferenceIndex;
+    // files whose index entries are waiting to be read, and the ones being
+    // read on a query thread
+    Set<uint32_t> mPendingIndexUpdates;
+    List<uint32_t> mIndexUpdateFiles;
+    bool mRebuildingIndexes;
+    StopWatch mRebuildTimer;
+
+    struct SegmentInfo {
+        SegmentInfo()
+            : files(0), liveBytes(0), size(0)
+        {}
+        uint32_t files;
+        uint64_t liveBytes, size;
+    };
+    Hash<uint32_t, SegmentEntry> mSegmentEntries;
+    Hash<uint32_t, SegmentInfo> mSegments;
+    uint32_t mNextSegmentId;
+    bool mCompactingSegments;
+
+    Hash<uint32_t, FileSignature> mFileSignatures;
+    // files whose signature was recorded after a job and whose hash is being
+    // computed on a query thread, with the changed time to go back to if the
+    // content turns out to be the same
+    Hash<uint32_t, uint64_t> mUnhashedFiles;
+
+    // A modified header whose dependents are held back until one job has
+    // reindexed it and shown whether its declarations changed. If they
+    // didn't the header's FileSignature gets its old changed time back.
+    struct HeaderProbe {
+        uint64_t signature, lastModified, changed, probe;
+        Set<uint64_t> deferred;
+    };
+    Hash<uint32_t, HeaderProbe> mHeaderProbes;
+
     size_t mBytesWritten;
     bool mSaveDirty;
 
+    Hash<uint64_t, SourceCost> mSourceCosts;
+    // sums over mSourceCosts, used to estimate sources that haven't been
+    // indexed yet
+    uint64_t mCostDuration, mCostFiles;
+
+    QueryLock mQueryLock;
+    // changes that came in while queries were running, in order
+    List<std::function<void()> > mPendingMutations;
+    bool mApplyingMutations;
+
+    struct RestoreState {
+        RestoreState()
+            : done(0), total(0)
+        {}
+        size_t done, total;
+        Hash<uint32_t, uint64_t> lastModified;
+        Set<uint32_t> dirty, missingFileMaps;
+        List<uint32_t> removed;
+        StopWatch timer;
+    };
+    std::unique_ptr<RestoreState> mRestore;
+    std::thread mRestoreThread;
+    std::atomic<bool> mRestoreStopped;
+    // files the restore or a lazy check hasn't validated yet
+    mutable Set<uint32_t> mUnrestored;
+    mutable std::mutex mRestoreMutex;
+    Signal<std::function<void(const std::shared_ptr<Project> &, size_t, size_t)> > mRestoreProgressChanged;
+
     mutable std::mutex mMutex;
 };
 
 RCT_FLAGS(Project::WatchMode);
 
-inline bool Project::visitFile(uint32_t visitFileId, const Path &path, uint64_t key)
+inline Set<uint32_t> Project::visitFiles(const List<uint32_t> &fileIds, const List<Path> &paths, uint64_t key)
 {
     assert(key);
+    assert(fileIds.size() == paths.size());
+    Set<uint32_t> ret;
     std::lock_guard<std::mutex> lock(mMutex);
-    assert(visitFileId);
-    Path &p = mVisitedFiles[visitFileId];
-    assert(key);
     assert(mActiveJobs.contains(key));
     std::shared_ptr<IndexerJob> &job = mActiveJobs[key];
     assert(job);
-    if (p.isEmpty()) {
-        p = path;
-        job->visited.insert(visitFileId);
-        return true;
+    for (size_t i=0; i<fileIds.size(); ++i) {
+        const uint32_t fileId = fileIds.at(i);
+        assert(fileId);
+        Path &p = mVisitedFiles[fileId];
+        if (p.isEmpty()) {
+            p = paths.at(i);
+            mVisitedFilesAdded[fileId] = p;
+            mVisitedFilesRemoved.remove(fileId);
+            job->visited.insert(fileId);
+            ret.insert(fileId);
+        } else if (job->visited.contains(fileId)) {
+            ret.insert(fileId);
+        }
     }
-    return job->visited.contains(visitFileId);
+    return ret;
 }
 
 inline void Project::releaseFileIds(const Set<uint32_t> &fileIds)
@@ -425,11 +630,29 @@ inline void Project::releaseFileIds(const Set<uint32_t> &fileIds)
         std::lock_guard<std::mutex> lock(mMutex);
         for (const auto &f : fileIds) {
             // error() << "Returning files" << Location::path(f);
-            mVisitedFiles.remove(f);
+            removeVisitedFile(f);
         }
     }
 }
 
+template <typename T>
+inline bool Project::loadFileMap(uint32_t fileId, FileMapType type, T &fileMap, String *err) const
+{
+    return checkRestored(fileId, err) && readFileMap(fileId, type, fileMap, err);
+}
+
+template <typename T>
+inline bool Project::readFileMap(uint32_t fileId, FileMapType type, T &fileMap, String *err) const
+{
+    const auto it = mSegmentEntries.find(fileId);
+    if (it == mSegmentEntries.end()) {
+        if (err)
+            *err = "No data for " + Location::path(fileId);
+        return false;
+    }
+    return fileMap.load(segmentPath(it->second.segment), it->second.offsets[type], it->second.sizes[type], err);
+}
+
 inline Path Project::sourceFilePath(uint32_t fileId, const char *type) const
 {
     return String::format<1024>("%s%d/%s", mSourceFilePathBase.constData(), fileId, type);
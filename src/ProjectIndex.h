@@ -0,0 +1,420 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ProjectIndex_h
+#define ProjectIndex_h
+
+#include <stdio.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+
+#include "FileMap.h"
+#include "FNV1a.h"
+#include "Location.h"
+#include "rct/DataFile.h"
+#include "rct/Hash.h"
+#include "rct/Map.h"
+#include "rct/Path.h"
+#include "rct/Set.h"
+#include "rct/String.h"
+
+static inline uint32_t indexFileId(Location location) { return location.fileId(); }
+static inline uint32_t indexFileId(uint32_t fileId) { return fileId; }
+
+// A project wide, sorted String -> Set<Value> index. The bulk of the data
+// lives in a FileMap on disk (the base) and changes on top of it are kept in
+// memory (the delta). Files that have been reindexed or removed are marked
+// stale so that their entries in the base are ignored. Saving only writes the
+// delta to a small side file until it has grown large enough to be worth
+// merging into a new base. The per-file FileMaps remain the source of truth,
+// the index can always be rebuilt from them.
+//
+// The base file starts with a generation that goes up every time a new base
+// is written. The delta file records the generation it was written on top of
+// and is ignored with any other base.
+template <typename Value>
+class ProjectIndex
+{
+public:
+    ProjectIndex()
+        : mGeneration(0), mDirty(false)
+    {}
+
+    void setPath(const Path &path) { mPath = path; }
+    const Path &path() const { return mPath; }
+
+    bool load(String *err = 0)
+    {
+        clearDelta();
+        mBaseFiles.clear();
+        if (!loadBase(err)) {
+            mBase.reset();
+            return false;
+        }
+        if (!loadDelta()) {
+            clearDelta();
+            const uint32_t count = mBase->count();
+            for (uint32_t i=0; i<count; ++i) {
+                for (const Value &value : mBase->valueAt(i))
+                    mBaseFiles.insert(indexFileId(value));
+            }
+        }
+        return true;
+    }
+
+    bool isLoaded() const { return mBase || mDirty; }
+    bool isDirty() const { return mDirty; }
+
+    void clear()
+    {
+        mBase.reset();
+        mBaseFiles.clear();
+        clearDelta();
+        mDirty = true;
+        Path::rm(mPath);
+        Path::rm(deltaPath());
+    }
+
+    void remove(uint32_t fileId)
+    {
+        if (mBase && mBaseFiles.contains(fileId) && mStale.insert(fileId))
+            mDirty = true;
+        const Set<String> keys = mDeltaKeys.take(fileId);
+        if (!keys.isEmpty())
+            mDirty = true;
+        for (const String &key : keys) {
+            auto it = mDelta.find(key);
+            if (it == mDelta.end())
+                continue;
+            auto v = it->second.begin();
+            while (v != it->second.end()) {
+                if (indexFileId(*v) == fileId) {
+                    it->second.erase(v++);
+                } else {
+                    ++v;
+                }
+            }
+            if (it->second.isEmpty())
+                mDelta.erase(it);
+        }
+    }
+
+    void insert(uint32_t fileId, const String &key, Value value)
+    {
+        mDirty = true;
+        mDelta[key].insert(value);
+        mDeltaKeys[fileId].insert(key);
+    }
+
+    Set<Value> value(const String &key) const
+    {
+        Set<Value> ret;
+        if (mBase) {
+            bool match;
+            const uint32_t idx = mBase->lowerBound(key, &match);
+            if (match)
+                ret = filtered(mBase->valueAt(idx));
+        }
+        const auto it = mDelta.find(key);
+        if (it != mDelta.end())
+            ret.unite(it->second);
+        return ret;
+    }
+
+    // Visits keys >= lowerBound in sorted order. Return false from func to
+    // stop.
+    void visit(const String &lowerBound, const std::function<bool(const String &, const Set<Value> &)> &func) const
+    {
+        uint32_t idx = 0;
+        const uint32_t count = mBase ? mBase->count() : 0;
+        if (count && !lowerBound.isEmpty()) {
+            idx = mBase->lowerBound(lowerBound);
+            if (idx == std::numeric_limits<uint32_t>::max())
+                idx = count;
+        }
+        auto it = lowerBound.isEmpty() ? mDelta.begin() : mDelta.lower_bound(lowerBound);
+        String baseKey;
+        bool haveBaseKey = false;
+        while (idx < count || it != mDelta.end()) {
+            if (idx < count && !haveBaseKey) {
+                baseKey = mBase->keyAt(idx);
+                haveBaseKey = true;
+            }
+            int cmp;
+            if (idx == count) {
+                cmp = 1;
+            } else if (it == mDelta.end()) {
+                cmp = -1;
+            } else {
+                cmp = compare<String>(baseKey, it->first);
+            }
+            Set<Value> values;
+            String key;
+            if (cmp <= 0) {
+                key = baseKey;
+                values = filtered(mBase->valueAt(idx++));
+                haveBaseKey = false;
+            }
+            if (cmp >= 0) {
+                if (cmp > 0)
+                    key = it->first;
+                values.unite(it->second);
+                ++it;
+            }
+            if (!values.isEmpty() && !func(key, values))
+                break;
+        }
+    }
+
+    // Writes the delta next to the base, or merges it into a new base once
+    // it or the number of stale files has grown large.
+    bool save()
+    {
+        if (!mDirty)
+            return true;
+        if (mBase
+            && mDelta.size() <= std::max<size_t>(MinMergeKeys, mBase->count() / 8)
+            && mStale.size() <= std::max<size_t>(MinMergeFiles, mBaseFiles.size() / 8)) {
+            if (!saveDelta())
+                return false;
+            mDirty = false;
+            return true;
+        }
+
+        Map<String, Set<Value> > merged;
+        Set<uint32_t> files;
+        visit(String(), [&merged, &files](const String &key, const Set<Value> &values) {
+                for (const Value &value : values)
+                    files.insert(indexFileId(value));
+                merged[key] = values;
+                return true;
+            });
+        if (!writeBase(merged, mGeneration + 1))
+            return false;
+        if (!loadBase()) {
+            clear();
+            return false;
+        }
+        mBaseFiles = std::move(files);
+        clearDelta();
+        return saveDelta();
+    }
+
+    size_t deltaSize() const { return mDelta.size(); }
+    size_t staleCount() const { return mStale.size(); }
+private:
+    enum {
+        BaseMagic = 0x78646e69, // "indx"
+        DeltaVersion = 2,
+        MinMergeKeys = 4096,
+        MinMergeFiles = 64
+    };
+    enum { BaseHeaderSize = sizeof(uint32_t) + sizeof(uint64_t) };
+
+    Path deltaPath() const { return mPath + ".delta"; }
+
+    // [magic][generation][FileMap], written under a temporary name and
+    // renamed into place
+    bool writeBase(const Map<String, Set<Value> > &map, uint64_t generation) const
+    {
+        const String data = FileMap<String, Set<Value> >::encode(map);
+        Path::mkdir(mPath.parentDir(), Path::Recursive);
+        const Path tmp = mPath + ".tmp";
+        FILE *f = fopen(tmp.constData(), "w");
+        if (!f)
+            return false;
+        const uint32_t magic = BaseMagic;
+        bool ok = (fwrite(&magic, sizeof(magic), 1, f) == 1
+                   && fwrite(&generation, sizeof(generation), 1, f) == 1
+                   && fwrite(data.constData(), 1, data.size(), f) == data.size());
+        if (fclose(f))
+            ok = false;
+        if (!ok || rename(tmp.constData(), mPath.constData())) {
+            Path::rm(tmp);
+            return false;
+        }
+        return true;
+    }
+
+    bool loadBase(String *err = 0)
+    {
+        FILE *f = fopen(mPath.constData(), "r");
+        if (!f) {
+            if (err)
+                *err = Rct::strerror();
+            return false;
+        }
+        uint32_t magic = 0;
+        uint64_t generation = 0;
+        const bool ok = (fread(&magic, sizeof(magic), 1, f) == 1
+                         && fread(&generation, sizeof(generation), 1, f) == 1);
+        fclose(f);
+        if (!ok || magic != BaseMagic) {
+            if (err)
+                *err = "Invalid index " + mPath;
+            return false;
+        }
+        std::shared_ptr<FileMap<String, Set<Value> > > base(new FileMap<String, Set<Value> >);
+        if (!base->load(mPath, BaseHeaderSize, mPath.fileSize() - BaseHeaderSize, err))
+            return false;
+        mBase = base;
+        mGeneration = generation;
+        return true;
+    }
+
+    bool saveDelta() const
+    {
+        DataFile file(deltaPath(), DeltaVersion);
+        if (!file.open(DataFile::Write))
+            return false;
+        file << mGeneration << mBaseFiles << mStale << mDelta;
+        return file.flush();
+    }
+
+    bool loadDelta()
+    {
+        DataFile file(deltaPath(), DeltaVersion);
+        if (!file.open(DataFile::Read))
+            return false;
+        uint64_t generation;
+        file >> generation;
+        if (generation != mGeneration)
+            return false;
+        file >> mBaseFiles >> mStale >> mDelta;
+        for (const auto &it : mDelta) {
+            for (const Value &value : it.second)
+                mDeltaKeys[indexFileId(value)].insert(it.first);
+        }
+        return true;
+    }
+
+    Set<Value> filtered(const Set<Value> &values) const
+    {
+        if (mStale.isEmpty())
+            return values;
+        Set<Value> ret;
+        for (const Value &value : values) {
+            if (!mStale.contains(indexFileId(value)))
+                ret.insert(value);
+        }
+        return ret;
+    }
+
+    void clearDelta()
+    {
+        mDelta.clear();
+        mDeltaKeys.clear();
+        mStale.clear();
+        mDirty = false;
+    }
+
+    Path mPath;
+    std::shared_ptr<FileMap<String, Set<Value> > > mBase;
+    // of mBase, kept across clear() so that a new base never reuses one
+    uint64_t mGeneration;
+    Map<String, Set<Value> > mDelta;
+    Hash<uint32_t, Set<String> > mDeltaKeys;
+    Set<uint32_t> mStale;
+    // the files with entries in the base
+    Set<uint32_t> mBaseFiles;
+    bool mDirty;
+};
+
+// Splits the keys over a fixed number of ProjectIndex shards so that saving
+// only writes the shards that actually changed. Keys are not ordered across
+// shards so only exact lookups are supported.
+template <typename Value>
+class ShardedProjectIndex
+{
+public:
+    enum { ShardCount = 16 };
+
+    void setPath(const Path &path)
+    {
+        for (size_t i=0; i<ShardCount; ++i)
+            mShards[i].setPath(String::format<1024>("%s.%zu", path.constData(), i));
+    }
+
+    bool load(String *err = 0)
+    {
+        bool ret = true;
+        for (ProjectIndex<Value> &shard : mShards) {
+            if (!shard.load(err))
+                ret = false;
+        }
+        return ret;
+    }
+
+    bool isLoaded() const
+    {
+        for (const ProjectIndex<Value> &shard : mShards) {
+            if (!shard.isLoaded())
+                return false;
+        }
+        return true;
+    }
+
+    bool isDirty() const
+    {
+        for (const ProjectIndex<Value> &shard : mShards) {
+            if (shard.isDirty())
+                return true;
+        }
+        return false;
+    }
+
+    void clear()
+    {
+        for (ProjectIndex<Value> &shard : mShards)
+            shard.clear();
+    }
+
+    void remove(uint32_t fileId)
+    {
+        for (ProjectIndex<Value> &shard : mShards)
+            shard.remove(fileId);
+    }
+
+    void insert(uint32_t fileId, const String &key, Value value)
+    {
+        mShards[shard(key)].insert(fileId, key, value);
+    }
+
+    Set<Value> value(const String &key) const
+    {
+        return mShards[shard(key)].value(key);
+    }
+
+    bool save()
+    {
+        bool ret = true;
+        for (ProjectIndex<Value> &shard : mShards) {
+            if (!shard.save())
+                ret = false;
+        }
+        return ret;
+    }
+private:
+    // this has to be stable since the shards are stored on disk
+    static size_t shard(const String &key)
+    {
+        return RTags::fnv1a(key.constData(), key.size()) % ShardCount;
+    }
+
+    ProjectIndex<Value> mShards[ShardCount];
+};
+
+#endif
@@ -27,10 +27,9 @@
 QueryJob::QueryJob(const std::shared_ptr<QueryMessage> &query,
                    const std::shared_ptr<Project> &proj,
                    Flags<JobFlag> jobFlags)
-    : mAborted(false), mLinesWritten(0), mQueryMessage(query), mJobFlags(jobFlags), mProject(proj), mFileFilter(0)
+    : mAborted(false), mLinesWritten(0), mQueryMessage(query), mJobFlags(jobFlags), mProject(proj), mFileFilter(0),
+      mDeferred(false)
 {
-    if (mProject)
-        mProject->beginScope();
     assert(query);
     if (query->flags() & QueryMessage::SilentQuery)
         setJobFlag(QuietJob);
@@ -58,8 +57,6 @@ QueryJob::QueryJob(const std::shared_ptr<QueryMessage> &query,
 
 QueryJob::~QueryJob()
 {
-    if (mProject)
-        mProject->endScope();
 }
 
 bool QueryJob::write(const String &out, Flags<WriteFlag> flags)
@@ -96,7 +93,7 @@ bool QueryJob::write(const String &out, Flags<WriteFlag> flags)
 
 bool QueryJob::writeRaw(const String &out, Flags<WriteFlag> flags)
 {
-    assert(mConnection);
+    assert(mConnection || mDeferred);
     if (!(flags & IgnoreMax) && mQueryMessage) {
         const int max = mQueryMessage->max();
         if (max != -1 && mLinesWritten == max) {
@@ -115,11 +112,36 @@ bool QueryJob::writeRaw(const String &out, Flags<WriteFlag> flags)
             return false;
         }
         return true;
+    } else if (mDeferred) {
+        if (mDeferredConnection.expired()) {
+            abort();
+            return false;
+        }
+        if (!out.isEmpty()) {
+            if (!mDeferredOutput.isEmpty())
+                mDeferredOutput += '\n';
+            mDeferredOutput += out;
+            if (mDeferredOutput.size() >= 64 * 1024)
+                flushDeferred();
+        }
     }
 
     return true;
 }
 
+void QueryJob::flushDeferred()
+{
+    if (mDeferredOutput.isEmpty())
+        return;
+    std::weak_ptr<Connection> conn = mDeferredConnection;
+    const String output = std::move(mDeferredOutput);
+    mDeferredOutput.clear();
+    EventLoop::mainEventLoop()->callLater([conn, output]() {
+            if (auto c = conn.lock())
+                c->write(output);
+        });
+}
+
 bool QueryJob::locationToString(Location location,
                                 const std::function<void(LocationPiece, const String &)> &cb,
                                 Flags<WriteFlag> writeFlags)
@@ -155,17 +177,17 @@ bool QueryJob::locationToString(Location location,
                 auto fileMap = project()->openSymbols(location.fileId());
                 if (fileMap) {
                     while (idx > 0) {
-                        symbol = fileMap->valueAt(--idx);
-                        if (symbol.location.fileId() != fileId)
+                        const SymbolView view(fileMap->valueData(--idx));
+                        if (view.location().fileId() != fileId)
                             break;
-                        if (symbol.isDefinition()
-                            && RTags::isContainer(symbol.kind)
-                            && comparePosition(line, column, symbol.startLine, symbol.startColumn) >= 0
-                            && comparePosition(line, column, symbol.endLine, symbol.endColumn) <= 0) {
+                        if (view.isDefinition()
+                            && RTags::isContainer(view.kind())
+                            && comparePosition(line, column, view.startLine(), view.startColumn()) >= 0
+                            && comparePosition(line, column, view.endLine(), view.endColumn()) <= 0) {
                             if (containingFunction)
-                                cb(Piece_ContainingFunctionName, symbol.symbolName);
+                                cb(Piece_ContainingFunctionName, view.symbolName());
                             if (containingFunctionLocation)
-                                cb(Piece_ContainingFunctionLocation, symbol.location.toString(locationToStringFlags() & ~Location::ShowContext));
+                                cb(Piece_ContainingFunctionLocation, view.location().toString(locationToStringFlags() & ~Location::ShowContext));
                             break;
                         }
                     }
@@ -283,6 +305,16 @@ int QueryJob::run(const std::shared_ptr<Connection> &connection)
     return ret;
 }
 
+int QueryJob::runDeferred(const std::weak_ptr<Connection> &connection)
+{
+    mDeferredConnection = connection;
+    mDeferred = true;
+    const int ret = execute();
+    flushDeferred();
+    mDeferred = false;
+    return ret;
+}
+
 bool QueryJob::filterLocation(Location loc) const
 {
     if (mFileFilter && loc.fileId() != mFileFilter)
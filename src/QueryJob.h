@@ -91,6 +91,9 @@ public:
     std::shared_ptr<Project> project() const { return mProject; }
     virtual int execute() = 0;
     int run(const std::shared_ptr<Connection> &connection = 0);
+    // Like run() but for jobs running on a query thread. Output is buffered
+    // and handed to the main event loop which owns the connection.
+    int runDeferred(const std::weak_ptr<Connection> &connection);
     bool isAborted() const { std::lock_guard<std::mutex> lock(mMutex); return mAborted; }
     void abort() { std::lock_guard<std::mutex> lock(mMutex); mAborted = true; }
     std::mutex &mutex() const { return mMutex; }
@@ -135,6 +138,7 @@ private:
     bool mAborted;
     int mLinesWritten;
     bool writeRaw(const String &out, Flags<WriteFlag> flags);
+    void flushDeferred();
     std::shared_ptr<QueryMessage> mQueryMessage;
     Flags<JobFlag> mJobFlags;
     Signal<std::function<void(const String &)> > mOutput;
@@ -144,6 +148,9 @@ private:
     QueryMessage::KindFilters mKindFilters;
     String mBuffer;
     std::shared_ptr<Connection> mConnection;
+    std::weak_ptr<Connection> mDeferredConnection;
+    bool mDeferred;
+    String mDeferredOutput;
     Hash<Path, String> mContextCache;
 };
 
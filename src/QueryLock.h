@@ -0,0 +1,156 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#ifndef QueryLock_h
+#define QueryLock_h
+
+#include <assert.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+// Read/write lock between queries running on the query threads and the main
+// thread that updates the project. Only the main thread takes the write lock
+// and it may do so recursively. Waiting and queued writers block new readers.
+class QueryLock
+{
+public:
+    QueryLock()
+        : mReaders(0), mWriteDepth(0), mWaitingWriters(0), mWriteQueued(false)
+    {}
+
+    // Called by the last reader to leave while a write is queued, on the
+    // reader's thread. Has to be set before there are readers.
+    void setReleasedHandler(std::function<void()> &&handler) { mReleasedHandler = std::move(handler); }
+
+    void lockForRead()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (mWriteDepth || mWaitingWriters || mWriteQueued)
+            mCondition.wait(lock);
+        ++mReaders;
+    }
+
+    void unlockForRead()
+    {
+        bool released = false;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            assert(mReaders > 0);
+            if (!--mReaders) {
+                mCondition.notify_all();
+                released = mWriteQueued;
+            }
+        }
+        if (released && mReleasedHandler)
+            mReleasedHandler();
+    }
+
+    // Takes the write lock if there are no readers. Otherwise the write is
+    // queued, new readers wait until it has been taken with tryLockQueued()
+    // and the released handler is called once the readers are gone.
+    bool tryLockOrQueueForWrite()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mReaders) {
+            mWriteQueued = true;
+            return false;
+        }
+        ++mWriteDepth;
+        return true;
+    }
+
+    bool tryLockQueued()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        assert(mWriteQueued);
+        if (mReaders)
+            return false;
+        mWriteQueued = false;
+        ++mWriteDepth;
+        return true;
+    }
+
+    // drops a queued write that will never be taken
+    void cancelQueued()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mWriteQueued = false;
+        mCondition.notify_all();
+    }
+
+    void lockForWrite()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        ++mWaitingWriters;
+        while (mReaders)
+            mCondition.wait(lock);
+        --mWaitingWriters;
+        ++mWriteDepth;
+    }
+
+    void unlockForWrite()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        assert(mWriteDepth > 0);
+        if (!--mWriteDepth)
+            mCondition.notify_all();
+    }
+
+    int readers() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mReaders;
+    }
+
+    class ReadLocker
+    {
+    public:
+        ReadLocker(QueryLock &lock)
+            : mLock(lock)
+        {
+            mLock.lockForRead();
+        }
+        ~ReadLocker() { mLock.unlockForRead(); }
+    private:
+        QueryLock &mLock;
+    };
+
+    class WriteLocker
+    {
+    public:
+        WriteLocker(QueryLock &lock)
+            : mLock(lock)
+        {
+            mLock.lockForWrite();
+        }
+        // takes over a write lock that is already held
+        WriteLocker(QueryLock &lock, std::adopt_lock_t)
+            : mLock(lock)
+        {}
+        ~WriteLocker() { mLock.unlockForWrite(); }
+    private:
+        QueryLock &mLock;
+    };
+private:
+    mutable std::mutex mMutex;
+    std::condition_variable mCondition;
+    int mReaders, mWriteDepth, mWaitingWriters;
+    bool mWriteQueued;
+    std::function<void()> mReleasedHandler;
+};
+
+#endif
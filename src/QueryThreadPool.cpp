@@ -0,0 +1,108 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#include "QueryThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+
+QueryThreadPool::QueryThreadPool(int threads)
+    : mStopped(false)
+{
+    for (int i=0; i<threads; ++i)
+        mThreads.append(std::thread(std::bind(&QueryThreadPool::run, this)));
+}
+
+QueryThreadPool::~QueryThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopped = true;
+        mCondition.notify_all();
+    }
+    for (std::thread &thread : mThreads)
+        thread.join();
+}
+
+void QueryThreadPool::post(std::function<void()> &&work)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mQueue.push_back(std::move(work));
+    mCondition.notify_one();
+}
+
+void QueryThreadPool::parallelFor(size_t count, const std::function<void(size_t)> &func)
+{
+    if (count < 2 || mThreads.isEmpty()) {
+        for (size_t i=0; i<count; ++i)
+            func(i);
+        return;
+    }
+
+    struct State {
+        State(size_t c, const std::function<void(size_t)> &f)
+            : next(0), count(c), done(0), func(f)
+        {}
+        std::atomic<size_t> next;
+        const size_t count;
+        size_t done;
+        const std::function<void(size_t)> func;
+        std::mutex mutex;
+        std::condition_variable condition;
+    };
+    std::shared_ptr<State> state = std::make_shared<State>(count, func);
+    // helpers that start after everything has been claimed return right away
+    std::function<void()> work = [state]() {
+        size_t finished = 0;
+        size_t index;
+        while ((index = state->next++) < state->count) {
+            state->func(index);
+            ++finished;
+        }
+        if (finished) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->done += finished;
+            if (state->done == state->count)
+                state->condition.notify_all();
+        }
+    };
+    const size_t helpers = std::min<size_t>(mThreads.size(), count - 1);
+    for (size_t i=0; i<helpers; ++i) {
+        std::function<void()> helper = work;
+        post(std::move(helper));
+    }
+    work();
+    std::unique_lock<std::mutex> lock(state->mutex);
+    while (state->done < state->count)
+        state->condition.wait(lock);
+}
+
+void QueryThreadPool::run()
+{
+    while (true) {
+        std::function<void()> work;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            while (!mStopped && mQueue.empty())
+                mCondition.wait(lock);
+            if (mStopped)
+                return;
+            work = std::move(mQueue.front());
+            mQueue.pop_front();
+        }
+        work();
+    }
+}
@@ -0,0 +1,53 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#ifndef QueryThreadPool_h
+#define QueryThreadPool_h
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "rct/List.h"
+
+// Runs read-only queries off the main event loop. Work items are run in the
+// order they were posted.
+class QueryThreadPool
+{
+public:
+    QueryThreadPool(int threads);
+    ~QueryThreadPool();
+
+    void post(std::function<void()> &&work);
+    // Calls func(index) for every index below count. The calling thread takes
+    // part and the pool threads claim indexes as they get to it so this can
+    // be called from a pool thread without deadlocking.
+    void parallelFor(size_t count, const std::function<void(size_t)> &func);
+    int threadCount() const { return mThreads.size(); }
+private:
+    void run();
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<std::function<void()> > mQueue;
+    List<std::thread> mThreads;
+    bool mStopped;
+};
+
+#endif
@@ -29,15 +29,16 @@
 #include "IndexDataMessage.h"
 #include "LogOutputMessage.h"
 #include "QueryMessage.h"
+#include "QueryThreadPool.h"
 #include "rct/Rct.h"
 #include "rct/StopWatch.h"
 #include "Server.h"
 #include "ClangIndexer.h"
+#include "CompileCommandsReader.h"
 #include "Project.h"
 #include "VisitFileMessage.h"
 #include "VisitFileResponseMessage.h"
 #include "RTagsVersion.h"
-#include <clang-c/CXCompilationDatabase.h>
 
 namespace RTags {
 String versionString()
@@ -755,129 +756,215 @@ String typeString(const CXType &type)
     return ret;
 }
 
+// Reads the compilation databases on a query thread. Entries are parsed into
+// Sources in parallel and the ones the project already has with the same
+// arguments are left out, the rest are handed to Server::index on the main
+// thread a few milliseconds at a time. The operation is only ever released
+// on the main thread.
 class CompileCommandsOperation
 {
 public:
     CompileCommandsOperation(const Hash<Path, CompilationDataBaseInfo> &i, const Path &p)
         : infos(i), projectRootOverride(p), indexIndex(0)
     {}
-    ~CompileCommandsOperation()
+
+    // main thread, once everything has been handed to Server::index
+    void finish()
     {
-        if (project) {
-            for (auto &info : infos) {
-                info.second.lastModified = Path(info.first + "compile_commands.json").lastModifiedMs();
-                if (info.second.indexFlags & IndexMessage::AppendCompilationDatabase) {
-                    assert(infos.size() == 1);
-                    info.second.indexFlags &= ~IndexMessage::AppendCompilationDatabase;
-                    project->addCompilationDatabaseInfo(std::move(info.first), std::move(info.second));
-                    return;
-                }
+        if (!project)
+            return;
+        for (auto &info : infos) {
+            info.second.lastModified = Path(info.first + "compile_commands.json").lastModifiedMs();
+            if (info.second.indexFlags & IndexMessage::AppendCompilationDatabase) {
+                assert(infos.size() == 1);
+                info.second.indexFlags &= ~IndexMessage::AppendCompilationDatabase;
+                project->addCompilationDatabaseInfo(std::move(info.first), std::move(info.second));
+                return;
             }
-            project->setCompilationDatabaseInfos(std::move(infos), indexed);
         }
+        project->setCompilationDatabaseInfos(std::move(infos), indexed);
     }
 
     struct Index {
+        Source source;
+        Path unresolvedPath, dir, compileCommandsDir;
+        // set instead of source when the arguments have to go through
+        // --arg-transform or be guessed
         String args;
-        Path dir, compileCommandsDir;
     };
 
-    void work()
+    // Takes op's reference and passes it on to work() on the main thread
+    static void load(std::shared_ptr<CompileCommandsOperation> op)
     {
         Server *server = Server::instance();
-        if (!server) {
-            delete this;
-            return;
+        if (server)
+            parse(op.get(), server);
+        std::function<void()> next = [op]() { work(op); };
+        op.reset();
+        EventLoop::mainEventLoop()->callLater(std::move(next));
+    }
+
+    static void parse(CompileCommandsOperation *op, Server *server)
+    {
+        QueryThreadPool *pool = server->queryThreadPool();
+        const bool transform = !server->options().argTransform.isEmpty();
+        for (const auto &info : op->infos) {
+            const Path file = info.first + "compile_commands.json";
+            CompileCommandsReader reader;
+            String err;
+            if (!reader.open(file, &err)) {
+                error("Can't load compilation database from %s: %s", file.constData(), err.constData());
+                continue;
+            }
+            List<std::pair<const char *, const char *> > entries;
+            const char *begin, *end;
+            while (reader.next(&begin, &end))
+                entries.append(std::make_pair(begin, end));
+            if (!reader.error().isEmpty())
+                error("Error reading %s: %s", file.constData(), reader.error().constData());
+
+            const bool raw = transform || info.second.indexFlags & IndexMessage::GuessFlags;
+            List<List<Index> > indexes(entries.size());
+            List<List<uint64_t> > unchanged(entries.size());
+            std::function<void(size_t)> parseEntry = [&](size_t idx) {
+                    CompileCommandsReader::Command command;
+                    if (!CompileCommandsReader::parse(entries.at(idx).first, entries.at(idx).second, command)) {
+                        error("Invalid entry in %s", file.constData());
+                        return;
+                    }
+                    const Path dir = command.directory.ensureTrailingSlash();
+                    if (raw) {
+                        String args = command.command;
+                        if (args.isEmpty()) {
+                            for (const String &arg : command.arguments) {
+                                if (!args.isEmpty())
+                                    args += ' ';
+                                if (arg.contains(' ')) {
+                                    args += '"' + arg + '"';
+                                } else {
+                                    args += arg;
+                                }
+                            }
+                        }
+                        indexes[idx].append(Index { Source(), Path(), dir, info.first, args });
+                        return;
+                    }
+                    List<Path> unresolvedPaths;
+                    List<Source> sources;
+                    if (command.arguments.isEmpty()) {
+                        sources = Source::parse(command.command, dir, info.second.environment, &unresolvedPaths);
+                    } else {
+                        sources = Source::parse(std::move(command.arguments), dir, info.second.environment, &unresolvedPaths);
+                    }
+                    for (size_t i=0; i<sources.size(); ++i) {
+                        const auto it = op->existing.find(sources.at(i).key());
+                        if (it != op->existing.end() && it->second.compareArguments(sources.at(i))) {
+                            unchanged[idx].append(it->first);
+                        } else {
+                            indexes[idx].append(Index { std::move(sources[i]), unresolvedPaths.at(i), dir, info.first, String() });
+                        }
+                    }
+                };
+            if (pool) {
+                pool->parallelFor(entries.size(), parseEntry);
+            } else {
+                for (size_t i=0; i<entries.size(); ++i)
+                    parseEntry(i);
+            }
+            for (size_t i=0; i<entries.size(); ++i) {
+                for (Index &index : indexes[i])
+                    op->indexes.append(std::move(index));
+                for (uint64_t key : unchanged.at(i))
+                    op->unchanged.append(key);
+            }
         }
-        const size_t max = std::min(indexIndex + 5, indexes.size());
-        while (indexIndex < max) {
-            const Index &idx = indexes.at(indexIndex);
-            const auto it = infos.find(idx.compileCommandsDir);
-            assert(it != infos.end());
-            server->index(idx.args,
-                          idx.dir,
-                          it->second.environment,
-                          projectRootOverride,
-                          it->second.indexFlags,
-                          &project,
-                          &indexed);
-            ++indexIndex;
+        op->existing.clear();
+    }
+
+    static void work(const std::shared_ptr<CompileCommandsOperation> &op)
+    {
+        Server *server = Server::instance();
+        if (!server)
+            return;
+        for (uint64_t key : op->unchanged)
+            op->indexed.insert(key);
+        op->unchanged.clear();
+        StopWatch sw;
+        while (op->indexIndex < op->indexes.size() && sw.elapsed() < MaxWorkTime) {
+            Index &idx = op->indexes[op->indexIndex++];
+            const auto it = op->infos.find(idx.compileCommandsDir);
+            assert(it != op->infos.end());
+            if (!idx.args.isEmpty()) {
+                server->index(idx.args,
+                              idx.dir,
+                              it->second.environment,
+                              op->projectRootOverride,
+                              it->second.indexFlags,
+                              &op->project,
+                              &op->indexed);
+            } else {
+                server->index(std::move(idx.source),
+                              idx.unresolvedPath,
+                              idx.dir,
+                              op->projectRootOverride,
+                              &op->project,
+                              &op->indexed);
+            }
         }
-        if (indexIndex == indexes.size()) {
-            EventLoop::deleteLater(this);
+        if (op->indexIndex < op->indexes.size()) {
+            EventLoop::eventLoop()->callLater([op]() { work(op); });
         } else {
-            EventLoop::eventLoop()->callLater(std::bind(&CompileCommandsOperation::work, this));
+            op->finish();
         }
     }
+
+    enum { MaxWorkTime = 10 };
+
     Hash<Path, CompilationDataBaseInfo> infos;
     const Path projectRootOverride;
+    // the sources of the project we're reloading
+    Sources existing;
     Set<uint64_t> indexed;
     std::shared_ptr<Project> project;
     List<Index> indexes;
+    List<uint64_t> unchanged;
     size_t indexIndex;
 };
 
 bool loadCompileCommands(const Hash<Path, CompilationDataBaseInfo> &infos, const Path &projectRootOverride)
 {
-#if CINDEX_VERSION >= CINDEX_VERSION_ENCODE(0, 20)
     if (Sandbox::hasRoot() && !projectRootOverride.isEmpty() && !projectRootOverride.startsWith(Sandbox::root())) {
         error("Invalid --project-root '%s', must be inside --sandbox-root '%s'",
               projectRootOverride.constData(), Sandbox::root().constData());
         return false;
     }
-    CompileCommandsOperation *op = 0;
+    bool found = false;
     for (const auto &info : infos) {
-        CXCompilationDatabase_Error err;
-        CXCompilationDatabase db = clang_CompilationDatabase_fromDirectory(info.first.constData(), &err);
-        if (err != CXCompilationDatabase_NoError) {
-            error("Can't load compilation database from %scompile_Commands.json", info.first.constData());
-            continue;
-        }
-        CXCompileCommands cmds = clang_CompilationDatabase_getAllCompileCommands(db);
-        const unsigned int sz = clang_CompileCommands_getSize(cmds);
-        if (!op) {
-            op = new CompileCommandsOperation(infos, projectRootOverride);
-            op->indexes.reserve(sz);
+        if (Path(info.first + "compile_commands.json").isFile()) {
+            found = true;
         } else {
-            op->indexes.reserve(op->indexes.size() + sz);
-        }
-        for (unsigned int i = 0; i < sz; ++i) {
-            CXCompileCommand cmd = clang_CompileCommands_getCommand(cmds, i);
-            String args;
-            CXString str = clang_CompileCommand_getDirectory(cmd);
-            const Path compileDir = clang_getCString(str);
-            clang_disposeString(str);
-            const unsigned int num = clang_CompileCommand_getNumArgs(cmd);
-            for (unsigned int j = 0; j < num; ++j) {
-                str = clang_CompileCommand_getArg(cmd, j);
-                const char *ch = clang_getCString(str);
-                if (strchr(ch, ' ')) {
-                    args += '"';
-                    args += ch;
-                    args += '"';
-                } else {
-                    args += ch;
-                }
-                clang_disposeString(str);
-                if (j < num - 1)
-                    args += ' ';
-            }
-            op->indexes.push_back(CompileCommandsOperation::Index { args, compileDir.ensureTrailingSlash(), info.first } );
+            error("Can't load compilation database from %scompile_commands.json", info.first.constData());
         }
-        clang_CompileCommands_dispose(cmds);
-        clang_CompilationDatabase_dispose(db);
-    };
-
+    }
+    if (!found)
+        return false;
 
-    if (op) {
-        EventLoop::eventLoop()->callLater(std::bind(&CompileCommandsOperation::work, op));
-        return true;
+    std::shared_ptr<CompileCommandsOperation> op(new CompileCommandsOperation(infos, projectRootOverride));
+    if (!projectRootOverride.isEmpty()) {
+        // Only what changed since the last load is indexed again, the project
+        // also has to be known when nothing did so it gets the new infos
+        op->project = Server::instance()->project(projectRootOverride.ensureTrailingSlash());
+        if (op->project)
+            op->existing = op->project->sources();
     }
-#else
-    (void)infos;
-    (void)projectRootOverride;
-#endif
-    return false;
+    if (QueryThreadPool *pool = Server::instance()->queryThreadPool()) {
+        std::shared_ptr<CompileCommandsOperation> pending = op;
+        op.reset();
+        pool->post([pending]() mutable { CompileCommandsOperation::load(std::move(pending)); });
+    } else {
+        CompileCommandsOperation::load(std::move(op));
+    }
+    return true;
 }
 
 #define OUTPUT_LITERAL(string)                  \
@@ -0,0 +1,108 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef Segment_h
+#define Segment_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rct/Path.h"
+#include "rct/Serializer.h"
+#include "rct/String.h"
+
+// Every indexer job writes the FileMaps of all the files it visited into one
+// append-only segment file. A SegmentEntry records where the maps of a single
+// file live inside its segment. The maps are indexed by FileMapType.
+struct SegmentEntry
+{
+    enum FileMapType {
+        Symbols,
+        SymbolNames,
+        Targets,
+        Usrs,
+        Tokens
+    };
+    enum { MapCount = Tokens + 1 };
+    static const char *fileMapName(FileMapType type)
+    {
+        switch (type) {
+        case Symbols: return "symbols";
+        case SymbolNames: return "symnames";
+        case Targets: return "targets";
+        case Usrs: return "usrs";
+        case Tokens: return "tokens";
+        }
+        return 0;
+    }
+
+    SegmentEntry()
+        : segment(0)
+    {
+        memset(offsets, 0, sizeof(offsets));
+        memset(sizes, 0, sizeof(sizes));
+    }
+
+    uint64_t size() const
+    {
+        uint64_t ret = 0;
+        for (size_t i=0; i<MapCount; ++i)
+            ret += sizes[i];
+        return ret;
+    }
+
+    static Path path(const Path &base, uint32_t segment)
+    {
+        return String::format<1024>("%ssegments/%u", base.constData(), segment);
+    }
+
+    // Segments are written under a temporary name and renamed into place so
+    // that a partially written segment is never visible.
+    static bool write(const Path &path, const String &data)
+    {
+        Path::mkdir(path.parentDir(), Path::Recursive);
+        const Path tmp = path + ".tmp";
+        FILE *f = fopen(tmp.constData(), "w");
+        if (!f)
+            return false;
+        bool ok = fwrite(data.constData(), 1, data.size(), f) == data.size();
+        if (fclose(f))
+            ok = false;
+        if (!ok || rename(tmp.constData(), path.constData())) {
+            Path::rm(tmp);
+            return false;
+        }
+        return true;
+    }
+
+    uint32_t segment;
+    uint32_t offsets[MapCount];
+    uint32_t sizes[MapCount];
+};
+
+template <> inline Serializer &operator<<(Serializer &s, const SegmentEntry &t)
+{
+    s.write(reinterpret_cast<const char*>(&t), sizeof(SegmentEntry));
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, SegmentEntry &t)
+{
+    s.read(reinterpret_cast<char*>(&t), sizeof(SegmentEntry));
+    return s;
+}
+
+#endif
@@ -42,6 +42,7 @@
 #include "Preprocessor.h"
 #include "Project.h"
 #include "QueryMessage.h"
+#include "QueryThreadPool.h"
 #include "RClient.h"
 #include "rct/Connection.h"
 #include "rct/DataFile.h"
@@ -98,6 +99,10 @@ Server::~Server()
         delete mCompletionThread;
         mCompletionThread = 0;
     }
+    // restores use the query threads
+    for (const auto &project : mProjects)
+        project.second->stopRestore();
+    mQueryThreadPool.reset();
 
     stopServers();
     mProjects.clear(); // need to be destroyed before sInstance is set to 0
@@ -182,6 +187,8 @@ bool Server::init(const Options &options)
     }
 
     mJobScheduler.reset(new JobScheduler);
+    if (mOptions.queryThreadCount > 0)
+        mQueryThreadPool.reset(new QueryThreadPool(mOptions.queryThreadCount));
 
     if (!load())
         return false;
@@ -309,6 +316,9 @@ std::shared_ptr<Project> Server::addProject(const Path &path)
     std::shared_ptr<Project> &project = mProjects[path];
     if (!project) {
         project.reset(new Project(path));
+        project->restoreProgressChanged().connect([](const std::shared_ptr<Project> &p, size_t done, size_t total) {
+                debug("Restoring %s %zu/%zu", p->path().constData(), done, total);
+            });
         project->init();
     }
     return project;
@@ -497,51 +507,61 @@ bool Server::index(const String &args,
     bool ret = (sources.isEmpty() && unresolvedPaths.size() == 1 && unresolvedPaths.front() == "-");
     int idx = 0;
     for (Source &source : sources) {
-        const Path path = source.sourceFile();
+        if (index(std::move(source), unresolvedPaths.at(idx++), pwd, projectRootOverride, projectPtr, indexed))
+            ret = true;
+    }
+    return ret;
+}
 
-        std::shared_ptr<Project> current = currentProject();
-        Path root;
-        const Path unresolvedPath = unresolvedPaths.at(idx++);
-        if (current && (current->match(unresolvedPath) || (path != unresolvedPath && current->match(path)))) {
-            root = current->path();
-        } else {
-            for (const auto &proj : mProjects) {
-                if (proj.second->match(unresolvedPath) || (path != unresolvedPath && proj.second->match(path))) {
-                    root = proj.first;
-                    break;
-                }
+bool Server::index(Source &&source,
+                   const Path &unresolvedPath,
+                   const Path &pwd,
+                   const Path &projectRootOverride,
+                   std::shared_ptr<Project> *projectPtr,
+                   Set<uint64_t> *indexed)
+{
+    const Path path = source.sourceFile();
+
+    std::shared_ptr<Project> current = currentProject();
+    Path root;
+    if (current && (current->match(unresolvedPath) || (path != unresolvedPath && current->match(path)))) {
+        root = current->path();
+    } else {
+        for (const auto &proj : mProjects) {
+            if (proj.second->match(unresolvedPath) || (path != unresolvedPath && proj.second->match(path))) {
+                root = proj.first;
+                break;
             }
         }
+    }
 
+    if (root.isEmpty()) {
+        root = projectRootOverride.ensureTrailingSlash();
         if (root.isEmpty()) {
-            root = projectRootOverride.ensureTrailingSlash();
-            if (root.isEmpty()) {
-                root = RTags::findProjectRoot(unresolvedPath, RTags::SourceRoot);
-                if (root.isEmpty() && path != unresolvedPath) {
-                    root = RTags::findProjectRoot(path, RTags::SourceRoot);
-                }
+            root = RTags::findProjectRoot(unresolvedPath, RTags::SourceRoot);
+            if (root.isEmpty() && path != unresolvedPath) {
+                root = RTags::findProjectRoot(path, RTags::SourceRoot);
             }
         }
+    }
 
-        root.resolve(Path::RealPath, pwd);
+    root.resolve(Path::RealPath, pwd);
 
-        if (shouldIndex(source, root)) {
-            std::shared_ptr<Project> &project = mProjects[root];
-            if (!project) {
-                addProject(root);
-                assert(project);
-            }
-            if (indexed)
-                indexed->insert(source.key());
-            if (!mCurrentProject.lock())
-                setCurrentProject(project);
-            project->index(std::shared_ptr<IndexerJob>(new IndexerJob(source, IndexerJob::Compile, project)));
-            if (projectPtr)
-                *projectPtr = project;
-            ret = true;
-        }
-    }
-    return ret;
+    if (!shouldIndex(source, root))
+        return false;
+    std::shared_ptr<Project> &project = mProjects[root];
+    if (!project) {
+        addProject(root);
+        assert(project);
+    }
+    if (indexed)
+        indexed->insert(source.key());
+    if (!mCurrentProject.lock())
+        setCurrentProject(project);
+    project->index(std::shared_ptr<IndexerJob>(new IndexerJob(source, IndexerJob::Compile, project)));
+    if (projectPtr)
+        *projectPtr = project;
+    return true;
 }
 
 void Server::handleIndexMessage(const std::shared_ptr<IndexMessage> &message, const std::shared_ptr<Connection> &conn)
@@ -794,9 +814,12 @@ void Server::removeFile(const std::shared_ptr<QueryMessage> &query, const std::s
         return;
     }
 
-    const int count = project->remove(match);
+    bool deferred;
+    const int count = project->remove(match, &deferred);
     // error() << count << query->query();
-    if (count) {
+    if (count && deferred) {
+        conn->write<128>("Removing %d files once the running queries have finished", count);
+    } else if (count) {
         conn->write<128>("Removed %d files", count);
     } else {
         conn->write("No matches");
@@ -939,8 +962,6 @@ void Server::generateTest(const std::shared_ptr<QueryMessage> &query, const std:
         conn->finish();
         return;
     }
-    project->beginScope();
-
     const Source source = project->sources(fileId).value(query->buildIndex());
     if (!source.isNull()) {
         const Flags<Source::CommandLineFlag> flags = (Source::Default
@@ -959,8 +980,8 @@ void Server::generateTest(const std::shared_ptr<QueryMessage> &query, const std:
 
         Value tests;
 
-        for (const auto &dep : project->dependencies()) {
-            auto symbols = project->openSymbols(dep.first);
+        for (uint32_t dep : project->dependencies().files()) {
+            auto symbols = project->openSymbols(dep);
             if (!symbols)
                 continue;
             const int count = symbols->count();
@@ -989,7 +1010,6 @@ void Server::generateTest(const std::shared_ptr<QueryMessage> &query, const std:
         conn->write<256>("%s build: %d not found", query->query().constData(), query->buildIndex());
         conn->finish();
     }
-    project->endScope();
 }
 
 void Server::symbolInfo(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1107,9 +1127,7 @@ void Server::referencesForLocation(const std::shared_ptr<QueryMessage> &query, c
         return;
     }
 
-    ReferencesJob job(loc, query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    runQueryJob(std::make_shared<ReferencesJob>(loc, query, project), conn);
 }
 
 void Server::referencesForName(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1126,9 +1144,7 @@ void Server::referencesForName(const std::shared_ptr<QueryMessage> &query, const
         return;
     }
 
-    ReferencesJob job(name, query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    runQueryJob(std::make_shared<ReferencesJob>(name, query, project), conn);
 }
 
 void Server::findSymbols(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1139,15 +1155,13 @@ void Server::findSymbols(const std::shared_ptr<QueryMessage> &query, const std::
     if (!project)
         project = currentProject();
 
-    int ret = 0;
     if (!project) {
-        ret = 1;
         error("No project");
-    } else {
-        FindSymbolsJob job(query, project);
-        ret = job.run(conn);
+        conn->finish(1);
+        return;
     }
-    conn->finish(ret);
+
+    runQueryJob(std::make_shared<FindSymbolsJob>(query, project), conn);
 }
 
 void Server::listSymbols(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1164,9 +1178,7 @@ void Server::listSymbols(const std::shared_ptr<QueryMessage> &query, const std::
         return;
     }
 
-    ListSymbolsJob job(query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    runQueryJob(std::make_shared<ListSymbolsJob>(query, project), conn);
 }
 
 void Server::status(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1495,6 +1507,8 @@ void Server::jobCount(const std::shared_ptr<QueryMessage> &query, const std::sha
     String q = query->query();
     if (q.isEmpty()) {
         conn->write<128>("Running with %zu/%zu jobs", mOptions.jobCount, mOptions.headerErrorJobCount);
+        if (mOptions.options & AdaptiveJobs)
+            conn->write("Adaptive: " + mJobScheduler->concurrency());
     } else {
         const bool header = q.startsWith('h');
         if (header)
@@ -1556,21 +1570,18 @@ void Server::sources(const std::shared_ptr<QueryMessage> &query, const std::shar
                 if (sources.isEmpty() && path.isHeader()) {
                     Set<uint32_t> seen;
                     std::function<uint32_t(uint32_t)> findSource = [&findSource, &project, &seen](uint32_t file) {
-                        DependencyNode *node = project->dependencyNode(file);
                         uint32_t ret = 0;
-                        if (node) {
-                            for (const auto &dep : node->dependents) {
-                                if (!seen.insert(dep.first))
-                                    continue;
-
-                                if (Location::path(dep.first).isSource()) {
-                                    ret = dep.first;
+                        for (uint32_t dep : project->dependencies().edges(file, DependencyGraph::Dependents)) {
+                            if (!seen.insert(dep))
+                                continue;
+
+                            if (Location::path(dep).isSource()) {
+                                ret = dep;
+                                break;
+                            } else {
+                                ret  = findSource(dep);
+                                if (ret)
                                     break;
-                                } else {
-                                    ret  = findSource(dep.first);
-                                    if (ret)
-                                        break;
-                                }
                             }
                         }
                         return ret;
@@ -1806,17 +1817,24 @@ void Server::tokens(const std::shared_ptr<QueryMessage> &query, const std::share
 
 void Server::handleVisitFileMessage(const std::shared_ptr<VisitFileMessage> &message, const std::shared_ptr<Connection> &conn)
 {
-    uint32_t fileId = 0;
-    bool visit = false;
+    const List<Path> &files = message->files();
+    List<uint32_t> fileIds;
+    fileIds.reserve(files.size());
+    Set<uint32_t> visit;
 
     std::shared_ptr<Project> project = mProjects.value(message->project());
     const uint64_t key = message->key();
     if (project && project->isActiveJob(key)) {
-        assert(message->file() == message->file().resolved());
-        fileId = Location::insertFile(message->file());
-        visit = project->visitFile(fileId, message->file(), key);
+        for (const Path &file : files) {
+            assert(file == file.resolved());
+            fileIds << Location::insertFile(file);
+        }
+        visit = project->visitFiles(fileIds, files, key);
+    } else {
+        for (size_t i=0; i<files.size(); ++i)
+            fileIds << 0;
     }
-    VisitFileResponseMessage msg(fileId, visit);
+    VisitFileResponseMessage msg(fileIds, visit);
     conn->send(msg);
 }
 
@@ -2264,3 +2282,32 @@ void Server::prepareCompletion(const std::shared_ptr<QueryMessage> &query, uint3
         }
     }
 }
+
+void Server::runQueryJob(const std::shared_ptr<QueryJob> &job, const std::shared_ptr<Connection> &conn)
+{
+    if (!mQueryThreadPool) {
+        const int ret = job->run(conn);
+        conn->finish(ret);
+        return;
+    }
+
+    // The job, and with it the project, is handed back to the main thread
+    // before the query thread lets go of it so neither is destroyed on the
+    // query thread.
+    std::weak_ptr<Connection> weakConn = conn;
+    std::shared_ptr<QueryJob> pending = job;
+    mQueryThreadPool->post([pending, weakConn]() mutable {
+            std::shared_ptr<QueryJob> queryJob = std::move(pending);
+            int ret;
+            {
+                QueryLock::ReadLocker lock(queryJob->project()->queryLock());
+                ret = queryJob->runDeferred(weakConn);
+            }
+            std::function<void()> finish = [queryJob, weakConn, ret]() {
+                if (auto c = weakConn.lock())
+                    c->finish(ret);
+            };
+            queryJob.reset();
+            EventLoop::mainEventLoop()->callLater(std::move(finish));
+        });
+}
@@ -42,6 +42,7 @@ class Message;
 class OutputMessage;
 class Project;
 class QueryMessage;
+class QueryThreadPool;
 class VisitFileMessage;
 class JobScheduler;
 class Server
@@ -83,15 +84,17 @@ public:
         AllowWErrorAndWFatalErrors = (1ull << 29),
         NoRealPath = (1ull << 30),
         Separate32BitAnd64Bit = (1ull << 31),
-        SourceIgnoreIncludePathDifferencesInUsr = (1ull << 32)
+        SourceIgnoreIncludePathDifferencesInUsr = (1ull << 32),
+        AutoPCH = (1ull << 33),
+        AdaptiveJobs = (1ull << 34)
     };
     struct Options {
         Options()
             : jobCount(0), headerErrorJobCount(0), maxIncludeCompletionDepth(0),
               rpVisitFileTimeout(0), rpIndexDataMessageTimeout(0), rpConnectTimeout(0),
-              rpConnectAttempts(0), rpNiceValue(0), maxCrashCount(0),
+              rpConnectAttempts(0), rpNiceValue(0), rpJobsPerProcess(1), maxCrashCount(0),
               completionCacheSize(0), testTimeout(60 * 1000 * 5),
-              maxFileMapScopeCacheSize(512), tcpPort(0)
+              maxFileMapScopeCacheSize(512), queryThreadCount(0), fileMapCacheBudget(256 * 1024 * 1024), tcpPort(0)
         {
         }
 
@@ -99,8 +102,9 @@ public:
         Flags<Option> options;
         size_t jobCount, headerErrorJobCount, maxIncludeCompletionDepth;
         int rpVisitFileTimeout, rpIndexDataMessageTimeout,
-            rpConnectTimeout, rpConnectAttempts, rpNiceValue, maxCrashCount,
-            completionCacheSize, testTimeout, maxFileMapScopeCacheSize, errorLimit;
+            rpConnectTimeout, rpConnectAttempts, rpNiceValue, rpJobsPerProcess, maxCrashCount,
+            completionCacheSize, testTimeout, maxFileMapScopeCacheSize, queryThreadCount, errorLimit;
+        size_t fileMapCacheBudget;
         uint16_t tcpPort;
         List<String> defaultArguments, excludeFilters;
         Set<String> blockedArguments;
@@ -120,6 +124,7 @@ public:
     void stopServers();
     void dumpJobs(const std::shared_ptr<Connection> &conn);
     std::shared_ptr<JobScheduler> jobScheduler() const { return mJobScheduler; }
+    QueryThreadPool *queryThreadPool() const { return mQueryThreadPool.get(); }
     const Set<uint32_t> &activeBuffers() const { return mActiveBuffers; }
     bool isActiveBuffer(uint32_t fileId) const { return mActiveBuffers.contains(fileId); }
     int exitCode() const { return mExitCode; }
@@ -133,6 +138,14 @@ public:
                Flags<IndexMessage::Flag> flags = Flags<IndexMessage::Flag>(),
                std::shared_ptr<Project> *projectPtr = 0,
                Set<uint64_t> *indexed = 0);
+    // a source that has already been parsed, unresolvedPath is the input
+    // as it appeared on the command line
+    bool index(Source &&source,
+               const Path &unresolvedPath,
+               const Path &pwd,
+               const Path &projectRootOverride,
+               std::shared_ptr<Project> *projectPtr = 0,
+               Set<uint64_t> *indexed = 0);
     enum FileIdsFileFlag {
         None = 0x0,
         HasSandboxRoot = 0x1
@@ -194,6 +207,7 @@ private:
     bool initServers();
     void removeSocketFile();
     void prepareCompletion(const std::shared_ptr<QueryMessage> &query, uint32_t fileId, const std::shared_ptr<Project> &project);
+    void runQueryJob(const std::shared_ptr<QueryJob> &job, const std::shared_ptr<Connection> &conn);
 
     typedef Hash<Path, std::shared_ptr<Project> > ProjectsMap;
     ProjectsMap mProjects;
@@ -209,6 +223,7 @@ private:
     uint32_t mLastFileId;
     std::shared_ptr<JobScheduler> mJobScheduler;
     CompletionThread *mCompletionThread;
+    std::unique_ptr<QueryThreadPool> mQueryThreadPool;
     Set<uint32_t> mActiveBuffers;
     Set<std::shared_ptr<Connection> > mConnections;
 
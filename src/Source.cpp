@@ -403,15 +403,6 @@ List<Source> Source::parse(const String &cmdLine,
                            const List<String> &environment,
                            List<Path> *unresolvedInputLocations)
 {
-    List<Path> pathEnvironment;
-    for (const String &env : environment) {
-        if (env.startsWith("PATH=")) {
-            pathEnvironment = env.mid(5).split(':', String::SkipEmpty);
-            break;
-        }
-    }
-    assert(cwd.endsWith('/'));
-    assert(!unresolvedInputLocations || unresolvedInputLocations->isEmpty());
     String args = cmdLine;
     char quote = '\0';
     List<String> split;
@@ -455,6 +446,23 @@ List<Source> Source::parse(const String &cmdLine,
             split.append(trim(prev, cur - prev));
     }
     debug() << "Source::parse (" << args << ") => " << split << cwd;
+    return parse(std::move(split), cwd, environment, unresolvedInputLocations);
+}
+
+List<Source> Source::parse(List<String> split,
+                           const Path &cwd,
+                           const List<String> &environment,
+                           List<Path> *unresolvedInputLocations)
+{
+    List<Path> pathEnvironment;
+    for (const String &env : environment) {
+        if (env.startsWith("PATH=")) {
+            pathEnvironment = env.mid(5).split(':', String::SkipEmpty);
+            break;
+        }
+    }
+    assert(cwd.endsWith('/'));
+    assert(!unresolvedInputLocations || unresolvedInputLocations->isEmpty());
 
     for (size_t i=0; i<split.size(); ++i) {
         if (split.at(i) == "cd" || !findFileInPath(split.at(i), cwd, pathEnvironment).isEmpty()) {
@@ -466,7 +474,7 @@ List<Source> Source::parse(const String &cmdLine,
     }
 
     if (split.isEmpty()) {
-        warning() << "Source::parse No args" << cmdLine;
+        warning() << "Source::parse No args";
         return List<Source>();
     }
 
@@ -478,7 +486,7 @@ List<Source> Source::parse(const String &cmdLine,
         path = cwd;
     }
     if (split.isEmpty()) {
-        warning() << "Source::parse No args" << cmdLine;
+        warning() << "Source::parse No args";
         return List<Source>();
     }
 
@@ -508,7 +516,7 @@ List<Source> Source::parse(const String &cmdLine,
         // ### is this even right?
         if (arg.size() > 1 && arg.startsWith('-')) {
             if (arg == "-E") {
-                warning() << "Preprocessing, ignore" << cmdLine;
+                warning() << "Preprocessing, ignore" << split;
                 return List<Source>();
             } else if (arg.startsWith("-x")) {
                 String a;
@@ -700,7 +708,7 @@ List<Source> Source::parse(const String &cmdLine,
     }
 
     if (inputs.isEmpty()) {
-        warning() << "Source::parse No file for" << cmdLine;
+        warning() << "Source::parse No file for" << split;
         return List<Source>();
     }
 
@@ -185,6 +185,11 @@ struct Source
                               const Path &pwd,
                               const List<String> &environment,
                               List<Path> *unresolvedInputLocation = 0);
+    // args already split, as in the "arguments" of a compile_commands.json
+    static List<Source> parse(List<String> args,
+                              const Path &pwd,
+                              const List<String> &environment,
+                              List<Path> *unresolvedInputLocation = 0);
     enum EncodeMode {
         IgnoreSandbox,
         EncodeSandbox
@@ -0,0 +1,49 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef SourceCost_h
+#define SourceCost_h
+
+#include <stdint.h>
+
+#include "rct/Serializer.h"
+
+// What the last job for a source cost, as measured by rp. The scheduler uses
+// it to start the most expensive jobs of a priority first.
+struct SourceCost
+{
+    SourceCost()
+        : parseDuration(0), visitDuration(0), writeDuration(0), files(0), bytesWritten(0)
+    {}
+
+    uint32_t duration() const { return parseDuration + visitDuration + writeDuration; }
+
+    uint32_t parseDuration, visitDuration, writeDuration, files;
+    uint64_t bytesWritten;
+};
+
+template <> inline Serializer &operator<<(Serializer &s, const SourceCost &t)
+{
+    s.write(reinterpret_cast<const char*>(&t), sizeof(SourceCost));
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, SourceCost &t)
+{
+    s.read(reinterpret_cast<char*>(&t), sizeof(SourceCost));
+    return s;
+}
+
+#endif
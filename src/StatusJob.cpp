@@ -122,14 +122,14 @@ int StatusJob::execute()
         }
     }
 
-    const Dependencies &deps = proj->dependencies();
+    const List<uint32_t> &deps = proj->dependencies().files();
     if (query.isEmpty() || match("dependencies")) {
         matched = true;
         if (!write(delimiter) || !write("dependencies") || !write(delimiter))
             return 1;
 
-        for (auto it : deps) {
-            write(proj->dumpDependencies(it.first));
+        for (uint32_t fileId : deps) {
+            write(proj->dumpDependencies(fileId));
         }
         if (isAborted())
             return 1;
@@ -141,8 +141,8 @@ int StatusJob::execute()
         write("symbols");
         write(delimiter);
 
-        for (const auto &dep : deps) {
-            auto symbols = proj->openSymbols(dep.first);
+        for (uint32_t dep : deps) {
+            auto symbols = proj->openSymbols(dep);
             if (!symbols)
                 continue;
             const int count = symbols->count();
@@ -161,15 +161,15 @@ int StatusJob::execute()
         write(delimiter);
         write("targets");
         write(delimiter);
-        for (const auto &dep : deps) {
-            auto targets = proj->openTargets(dep.first);
+        for (uint32_t dep : deps) {
+            auto targets = proj->openTargets(dep);
             if (!targets)
                 continue;
             const int count = targets->count();
             for (int i=0; i<count; ++i) {
                 const String usr = targets->keyAt(i);
                 write<128>("  %s", usr.constData());
-                for (const auto &t : proj->findByUsr(usr, dep.first, Project::ArgDependsOn)) {
+                for (const auto &t : proj->findByUsr(usr, dep, Project::ArgDependsOn)) {
                     write<1024>("      %s\t%s", t.location.toString(locationToStringFlags()).constData(),
                                 t.kindSpelling().constData());
                 }
@@ -188,8 +188,8 @@ int StatusJob::execute()
         write(delimiter);
         write("symbolnames");
         write(delimiter);
-        for (const auto &dep : deps) {
-            auto symNames = proj->openSymbolNames(dep.first);
+        for (uint32_t dep : deps) {
+            auto symNames = proj->openSymbolNames(dep);
             if (!symNames)
                 continue;
             const int count = symNames->count();
@@ -255,6 +255,9 @@ int StatusJob::execute()
         if (!write(delimiter) || !write("project") || !write(delimiter))
             return 1;
         write(String::format<1024>("Path: %s", proj->path().constData()));
+        size_t restored, total;
+        if (proj->restoreProgress(&restored, &total))
+            write(String::format<128>("Restoring: %zu/%zu files", restored, total));
         bool first = true;
         for (const auto &info : proj->compilationDataBaseInfos()) {
             if (first) {
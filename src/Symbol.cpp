@@ -369,12 +369,12 @@ Value Symbol::toValue(const std::shared_ptr<Project> &project,
                 const unsigned int line = symbol.location.line();
                 const unsigned int column = symbol.location.column();
                 while (idx-- > 0) {
-                    const Symbol s = syms->valueAt(idx);
+                    const SymbolView s(syms->valueData(idx));
                     if (s.isDefinition()
-                        && s.isContainer()
-                        && comparePosition(line, column, s.startLine, s.startColumn) >= 0
-                        && comparePosition(line, column, s.endLine, s.endColumn) <= 0) {
-                        ret["parent"] = toValue(s, IncludeParents);
+                        && RTags::isContainer(s.kind())
+                        && comparePosition(line, column, s.startLine(), s.startColumn()) >= 0
+                        && comparePosition(line, column, s.endLine(), s.endColumn()) <= 0) {
+                        ret["parent"] = toValue(s.symbol(), IncludeParents);
                         break;
                     }
                 }
@@ -207,14 +207,15 @@ template <> inline Deserializer &operator>>(Deserializer &s, Symbol::ArgumentUsa
     return s;
 }
 
+// The fixed size fields come first, SymbolView relies on this layout
 template <> inline Serializer &operator<<(Serializer &s, const Symbol &t)
 {
-    s << t.location << t.argumentUsage << t.symbolName << t.usr
-      << t.typeName << t.baseClasses << t.arguments << t.symbolLength
-      << static_cast<uint16_t>(t.kind) << static_cast<uint16_t>(t.type)
-      << static_cast<uint8_t>(t.linkage) << t.flags << t.briefComment << t.xmlComment
+    s << t.location << t.symbolLength << static_cast<uint16_t>(t.kind)
+      << static_cast<uint16_t>(t.type) << static_cast<uint8_t>(t.linkage) << t.flags
       << t.enumValue << t.startLine << t.endLine << t.startColumn << t.endColumn
-      << t.size << t.fieldOffset << t.alignment;
+      << t.size << t.fieldOffset << t.alignment
+      << t.symbolName << t.usr << t.typeName << t.baseClasses
+      << t.argumentUsage << t.arguments << t.briefComment << t.xmlComment;
     return s;
 }
 
@@ -222,12 +223,11 @@ template <> inline Deserializer &operator>>(Deserializer &s, Symbol &t)
 {
     uint16_t kind, type;
     uint8_t linkage;
-    s >> t.location >> t.argumentUsage >> t.symbolName
-      >> t.usr >> t.typeName >> t.baseClasses >> t.arguments
-      >> t.symbolLength >> kind >> type >> linkage >> t.flags
-      >> t.briefComment >> t.xmlComment >> t.enumValue
-      >> t.startLine >> t.endLine >> t.startColumn >> t.endColumn
-      >> t.size >> t.fieldOffset >> t.alignment;
+    s >> t.location >> t.symbolLength >> kind >> type >> linkage >> t.flags
+      >> t.enumValue >> t.startLine >> t.endLine >> t.startColumn >> t.endColumn
+      >> t.size >> t.fieldOffset >> t.alignment
+      >> t.symbolName >> t.usr >> t.typeName >> t.baseClasses
+      >> t.argumentUsage >> t.arguments >> t.briefComment >> t.xmlComment;
 
     t.kind = static_cast<CXCursorKind>(kind);
     t.type = static_cast<CXTypeKind>(type);
@@ -241,6 +241,127 @@ template <> inline Deserializer &operator>>(Deserializer &s, Symbol &t)
     return s;
 }
 
+// Read-only access to a Symbol serialized in a FileMap<Location, Symbol>. The
+// fixed size fields are read in place and strings are only decoded when asked
+// for. Use symbol() to get the full Symbol for results.
+class SymbolView
+{
+public:
+    SymbolView(const char *data = 0)
+        : mData(data)
+    {}
+
+    bool isNull() const { return !mData || location().isNull() || clang_isInvalid(kind()); }
+    Location location() const { return read<Location>(LocationOffset); }
+    uint16_t symbolLength() const { return read<uint16_t>(SymbolLengthOffset); }
+    CXCursorKind kind() const { return static_cast<CXCursorKind>(read<uint16_t>(KindOffset)); }
+    uint16_t flags() const { return read<uint16_t>(FlagsOffset); }
+    int32_t startLine() const { return read<int32_t>(StartLineOffset); }
+    int32_t endLine() const { return read<int32_t>(EndLineOffset); }
+    int16_t startColumn() const { return read<int16_t>(StartColumnOffset); }
+    int16_t endColumn() const { return read<int16_t>(EndColumnOffset); }
+    bool isDefinition() const { return flags() & Symbol::Definition; }
+
+    // strings and lists are left empty
+    Symbol fixedFields() const
+    {
+        Symbol ret;
+        ret.location = location();
+        ret.symbolLength = symbolLength();
+        ret.kind = kind();
+        ret.type = static_cast<CXTypeKind>(read<uint16_t>(TypeOffset));
+        ret.linkage = static_cast<CXLinkageKind>(read<uint8_t>(LinkageOffset));
+        ret.flags = flags();
+        ret.enumValue = read<int64_t>(EnumValueOffset);
+        ret.startLine = startLine();
+        ret.endLine = endLine();
+        ret.startColumn = startColumn();
+        ret.endColumn = endColumn();
+        ret.size = read<int32_t>(SizeOffset);
+        ret.fieldOffset = read<int16_t>(FieldOffsetOffset);
+        ret.alignment = read<int16_t>(AlignmentOffset);
+        return ret;
+    }
+
+    String symbolName() const { return string(0); }
+    String usr() const { return string(1); }
+    String typeName() const { return string(2); }
+
+    bool hasBaseClass(const String &usr) const
+    {
+        const char *data = skipString(skipString(skipString(mData + StringsOffset)));
+        uint32_t count;
+        memcpy(&count, data, sizeof(count));
+        data += sizeof(count);
+        for (uint32_t i=0; i<count; ++i) {
+            uint32_t size;
+            memcpy(&size, data, sizeof(size));
+            if (size == usr.size() && !memcmp(data + sizeof(size), usr.constData(), size))
+                return true;
+            data += sizeof(size) + size;
+        }
+        return false;
+    }
+
+    Symbol symbol() const
+    {
+        Symbol ret;
+        if (mData) {
+            Deserializer deserializer(mData, INT_MAX);
+            deserializer >> ret;
+        }
+        return ret;
+    }
+private:
+    enum {
+        LocationOffset = 0,
+        SymbolLengthOffset = LocationOffset + sizeof(uint64_t),
+        KindOffset = SymbolLengthOffset + sizeof(uint16_t),
+        TypeOffset = KindOffset + sizeof(uint16_t),
+        LinkageOffset = TypeOffset + sizeof(uint16_t),
+        FlagsOffset = LinkageOffset + sizeof(uint8_t),
+        EnumValueOffset = FlagsOffset + sizeof(uint16_t),
+        StartLineOffset = EnumValueOffset + sizeof(int64_t),
+        EndLineOffset = StartLineOffset + sizeof(int32_t),
+        StartColumnOffset = EndLineOffset + sizeof(int32_t),
+        EndColumnOffset = StartColumnOffset + sizeof(int16_t),
+        SizeOffset = EndColumnOffset + sizeof(int16_t),
+        FieldOffsetOffset = SizeOffset + sizeof(int32_t),
+        AlignmentOffset = FieldOffsetOffset + sizeof(int16_t),
+        StringsOffset = AlignmentOffset + sizeof(int16_t)
+    };
+
+    template <typename T>
+    T read(size_t offset) const
+    {
+        T t;
+        memcpy(&t, mData + offset, sizeof(T));
+        return t;
+    }
+
+    // Strings are serialized as a uint32_t size followed by the data
+    static const char *skipString(const char *data)
+    {
+        uint32_t size;
+        memcpy(&size, data, sizeof(size));
+        return data + sizeof(size) + size;
+    }
+
+    String string(int index) const
+    {
+        const char *data = mData + StringsOffset;
+        while (index--)
+            data = skipString(data);
+        uint32_t size;
+        memcpy(&size, data, sizeof(size));
+        String ret(data + sizeof(size), size);
+        Sandbox::decode(ret);
+        return ret;
+    }
+
+    const char *mData;
+};
+
 static inline Log operator<<(Log dbg, const Symbol &symbol)
 {
     const String out = "Symbol(" + symbol.toString() + ")";
@@ -0,0 +1,187 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef TokenMap_h
+#define TokenMap_h
+
+#include "FileMap.h"
+#include "Location.h"
+#include "rct/Hash.h"
+#include "rct/Map.h"
+#include "rct/String.h"
+#include "Token.h"
+
+// The tokens of a file in columnar form:
+// [count][fileId][spellingCount]
+// [offsets][lengths][lines][columns][spellings] (uint32_t * count each)
+// [kinds] (uint8_t * count)
+// [spelling offsets] (uint32_t * (spellingCount + 1))
+// [spelling data]
+// Tokens are sorted on offset and each distinct spelling is stored once.
+class TokenMap
+{
+public:
+    typedef uint32_t KeyType;
+    typedef Token ValueType;
+
+    TokenMap()
+        : mPointer(0), mSize(0), mCount(0), mFileId(0), mSpellingCount(0), mMapped(0), mMappedSize(0)
+    {}
+
+    ~TokenMap()
+    {
+        if (mMapped)
+            munmap(mMapped, mMappedSize);
+    }
+
+    bool load(const Path &path, uint64_t offset, uint32_t size, String *error = 0)
+    {
+        const char *pointer = mapSlice(path, offset, size, &mMapped, &mMappedSize, error);
+        if (!pointer)
+            return false;
+        init(pointer, size);
+        return true;
+    }
+
+    void init(const char *pointer, uint32_t size)
+    {
+        mPointer = pointer;
+        mSize = size;
+        mCount = readAt(0, 0);
+        mFileId = readAt(0, 1);
+        mSpellingCount = readAt(0, 2);
+    }
+
+    uint32_t count() const { return mCount; }
+    uint32_t size() const { return mSize; }
+
+    uint32_t offsetAt(uint32_t index) const { return readAt(column(Offsets), index); }
+    uint32_t lengthAt(uint32_t index) const { return readAt(column(Lengths), index); }
+    CXTokenKind kindAt(uint32_t index) const
+    {
+        return static_cast<CXTokenKind>(static_cast<uint8_t>(mPointer[column(Kinds) + index]));
+    }
+    Location locationAt(uint32_t index) const
+    {
+        return Location(mFileId, readAt(column(Lines), index), readAt(column(Columns), index));
+    }
+    String spellingAt(uint32_t index) const
+    {
+        const uint32_t spelling = readAt(column(Spellings), index);
+        const size_t offsets = column(Kinds) + mCount;
+        const uint32_t start = readAt(offsets, spelling);
+        const uint32_t end = readAt(offsets, spelling + 1);
+        return String(mPointer + offsets + ((mSpellingCount + 1) * sizeof(uint32_t)) + start, end - start);
+    }
+
+    Token valueAt(uint32_t index) const
+    {
+        Token token;
+        token.kind = kindAt(index);
+        token.spelling = spellingAt(index);
+        token.location = locationAt(index);
+        token.offset = offsetAt(index);
+        token.length = lengthAt(index);
+        return token;
+    }
+    uint32_t keyAt(uint32_t index) const { return offsetAt(index); }
+
+    // Index of the first token with an offset >= offset, count() if there is
+    // none.
+    uint32_t lowerBound(uint32_t offset) const
+    {
+        const size_t offsets = column(Offsets);
+        uint32_t lower = 0;
+        uint32_t upper = mCount;
+        while (lower < upper) {
+            const uint32_t mid = lower + ((upper - lower) / 2);
+            if (readAt(offsets, mid) < offset) {
+                lower = mid + 1;
+            } else {
+                upper = mid;
+            }
+        }
+        return lower;
+    }
+
+    static String encode(uint32_t fileId, const Map<uint32_t, Token> &tokens)
+    {
+        const uint32_t count = tokens.size();
+        List<uint32_t> columns[Kinds];
+        for (List<uint32_t> &c : columns)
+            c.reserve(count);
+        String kinds;
+        Hash<String, uint32_t> spellingIds;
+        List<uint32_t> spellingOffsets;
+        String spellings;
+        for (const auto &it : tokens) {
+            const Token &token = it.second;
+            columns[Offsets].append(token.offset);
+            columns[Lengths].append(token.length);
+            columns[Lines].append(token.location.line());
+            columns[Columns].append(token.location.column());
+            uint32_t &id = spellingIds[token.spelling];
+            if (!id) {
+                spellingOffsets.append(spellings.size());
+                spellings.append(token.spelling);
+                id = spellingOffsets.size();
+            }
+            columns[Spellings].append(id - 1);
+            kinds.append(static_cast<char>(token.kind));
+        }
+        spellingOffsets.append(spellings.size());
+
+        String out;
+        auto append = [&out](uint32_t value) { out.append(reinterpret_cast<const char*>(&value), sizeof(value)); };
+        append(count);
+        append(fileId);
+        append(spellingOffsets.size() - 1);
+        for (const List<uint32_t> &c : columns) {
+            for (uint32_t value : c)
+                append(value);
+        }
+        out.append(kinds);
+        for (uint32_t offset : spellingOffsets)
+            append(offset);
+        out.append(spellings);
+        return out;
+    }
+private:
+    enum Column {
+        Offsets,
+        Lengths,
+        Lines,
+        Columns,
+        Spellings,
+        Kinds // the uint8_t column comes after the uint32_t ones
+    };
+
+    // byte offset of a column
+    size_t column(Column c) const { return (3 + (c * mCount)) * sizeof(uint32_t); }
+
+    uint32_t readAt(size_t base, uint32_t index) const
+    {
+        uint32_t ret;
+        memcpy(&ret, mPointer + base + (index * sizeof(uint32_t)), sizeof(ret));
+        return ret;
+    }
+
+    const char *mPointer;
+    uint32_t mSize, mCount, mFileId, mSpellingCount;
+    void *mMapped;
+    size_t mMappedSize;
+};
+
+#endif
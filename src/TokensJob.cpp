@@ -43,11 +43,8 @@ int TokensJob::execute()
     uint32_t i = 0;
     if (mFrom != 0) {
         i = map->lowerBound(mFrom);
-        if (i > 0 && i < count) {
-            const Token val = map->valueAt(i - 1);
-            if (val.offset + val.length >= mFrom)
-                --i;
-        }
+        if (i > 0 && i < count && map->offsetAt(i - 1) + map->lengthAt(i - 1) >= mFrom)
+            --i;
     }
 
     std::function<bool(const Token &)> writeToken;
@@ -85,11 +82,8 @@ int TokensJob::execute()
         };
     }
 
-    while (i < count) {
-        const Token token = map->valueAt(i++);
-        if (token.offset > mTo)
-            break;
-        if (!writeToken(token))
+    while (i < count && map->offsetAt(i) <= mTo) {
+        if (!writeToken(map->valueAt(i++)))
             return 4;
     }
 
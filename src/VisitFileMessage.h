@@ -23,18 +23,19 @@ class VisitFileMessage : public RTagsMessage
 public:
     enum { MessageId = VisitFileId };
 
-    VisitFileMessage(const Path &file = Path(), const Path &project = Path(), uint64_t key = 0)
-        : RTagsMessage(MessageId), mFile(file), mProject(project), mKey(key)
+    VisitFileMessage(const List<Path> &files = List<Path>(), const Path &project = Path(), uint64_t key = 0)
+        : RTagsMessage(MessageId), mFiles(files), mProject(project), mKey(key)
     {
     }
 
     Path project() const { return mProject; }
-    Path file() const { return mFile; }
+    const List<Path> &files() const { return mFiles; }
     uint64_t key() const { return mKey; }
-    void encode(Serializer &serializer) const { serializer << mProject << mFile << mKey; }
-    void decode(Deserializer &deserializer) { deserializer >> mProject >> mFile >> mKey; }
+    void encode(Serializer &serializer) const { serializer << mProject << mFiles << mKey; }
+    void decode(Deserializer &deserializer) { deserializer >> mProject >> mFiles >> mKey; }
 private:
-    Path mFile, mProject;
+    List<Path> mFiles;
+    Path mProject;
     uint64_t mKey;
 };
 
@@ -23,19 +23,21 @@ class VisitFileResponseMessage : public RTagsMessage
 public:
     enum { MessageId = VisitFileResponseId };
 
-    VisitFileResponseMessage(uint32_t fileId = 0, bool visit = false)
-        : RTagsMessage(MessageId), mFileId(fileId), mVisit(visit)
+    // fileIds are in the same order as the files in the VisitFileMessage, 0
+    // means the job is no longer active.
+    VisitFileResponseMessage(const List<uint32_t> &fileIds = List<uint32_t>(), const Set<uint32_t> &visit = Set<uint32_t>())
+        : RTagsMessage(MessageId), mFileIds(fileIds), mVisit(visit)
     {
     }
 
-    uint32_t fileId() const { return mFileId; }
-    bool visit() const { return mVisit; }
+    const List<uint32_t> &fileIds() const { return mFileIds; }
+    const Set<uint32_t> &visit() const { return mVisit; }
 
-    void encode(Serializer &serializer) const { serializer << mFileId << mVisit; }
-    void decode(Deserializer &deserializer) { deserializer >> mFileId >> mVisit; }
+    void encode(Serializer &serializer) const { serializer << mFileIds << mVisit; }
+    void decode(Deserializer &deserializer) { deserializer >> mFileIds >> mVisit; }
 private:
-    uint32_t mFileId;
-    bool mVisit;
+    List<uint32_t> mFileIds;
+    Set<uint32_t> mVisit;
 };
 
 #endif
@@ -78,6 +78,7 @@ static void signalHandler(int signal)
 #define DEFAULT_COMPILER_WRAPPERS "ccache"
 #define DEFAULT_RP_VISITFILE_TIMEOUT 60000
 #define DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE 500
+#define DEFAULT_RDM_FILE_MAP_CACHE_BUDGET 256 // mb
 #define DEFAULT_RP_INDEXER_MESSAGE_TIMEOUT 60000
 #define DEFAULT_RP_CONNECT_TIMEOUT 0 // won't time out
 #define DEFAULT_RP_CONNECT_ATTEMPTS 3
@@ -85,6 +86,7 @@ static void signalHandler(int signal)
 #define DEFAULT_ERROR_LIMIT 50
 #define DEFAULT_MAX_INCLUDE_COMPLETION_DEPTH 3
 #define DEFAULT_MAX_CRASH_COUNT 5
+#define DEFAULT_RP_JOBS_PER_PROCESS 50
 #define XSTR(s) #s
 #define STR(s) XSTR(s)
 #ifdef NDEBUG
@@ -160,6 +162,7 @@ enum OptionType {
     RpConnectTimeout,
     RpConnectAttempts,
     RpNiceValue,
+    RpJobsPerProcess,
     SuspendRpOnCrash,
     RpLogToSyslog,
     StartSuspended,
@@ -177,6 +180,8 @@ enum OptionType {
     EnableNDEBUG,
     Progress,
     MaxFileMapCacheSize,
+    FileMapCacheBudget,
+    QueryThreads,
 #ifdef OS_FreeBSD
     FileManagerWatch,
 #else
@@ -185,6 +190,8 @@ enum OptionType {
     NoFileManager,
     NoFileLock,
     PchEnabled,
+    AutoPch,
+    AdaptiveJobs,
     NoFilesystemWatcher,
     ArgTransform,
     NoComments,
@@ -230,8 +237,12 @@ int main(int argc, char** argv)
     serverOpts.rpConnectTimeout = DEFAULT_RP_CONNECT_TIMEOUT;
     serverOpts.rpConnectAttempts = DEFAULT_RP_CONNECT_ATTEMPTS;
     serverOpts.maxFileMapScopeCacheSize = DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE;
+    serverOpts.fileMapCacheBudget = DEFAULT_RDM_FILE_MAP_CACHE_BUDGET * 1024 * 1024;
+    // the rp processes already have the cores, queries mostly wait on disk
+    serverOpts.queryThreadCount = std::max(1, std::min(4, ThreadPool::idealThreadCount() / 4));
     serverOpts.errorLimit = DEFAULT_ERROR_LIMIT;
     serverOpts.rpNiceValue = INT_MIN;
+    serverOpts.rpJobsPerProcess = DEFAULT_RP_JOBS_PER_PROCESS;
     serverOpts.options = Server::Wall|Server::SpellChecking;
     serverOpts.maxCrashCount = DEFAULT_MAX_CRASH_COUNT;
     serverOpts.completionCacheSize = DEFAULT_COMPLETION_CACHE_SIZE;
@@ -294,6 +305,7 @@ int main(int argc, char** argv)
         { RpConnectTimeout, "rp-connect-timeout", 'O', CommandLineParser::Required, "Timeout for connection from rp to rdm in ms (0 means no timeout) (default " STR(DEFAULT_RP_CONNECT_TIMEOUT) ")." },
         { RpConnectAttempts, "rp-connect-attempts", 0, CommandLineParser::Required, "Number of times rp attempts to connect to rdm before giving up. (default " STR(DEFAULT_RP_CONNECT_ATTEMPTS) ")." },
         { RpNiceValue, "rp-nice-value", 'a', CommandLineParser::Required, "Nice value to use for rp (nice(2)) (default is no nicing)." },
+        { RpJobsPerProcess, "rp-jobs-per-process", 0, CommandLineParser::Required, "Number of jobs an rp process handles before it is replaced, 1 starts a new rp for every job (default " STR(DEFAULT_RP_JOBS_PER_PROCESS) ")." },
         { SuspendRpOnCrash, "suspend-rp-on-crash", 'q', CommandLineParser::NoValue, "Suspend rp in SIGSEGV handler (default " DEFAULT_SUSPEND_RP ")." },
         { RpLogToSyslog, "rp-log-to-syslog", 0, CommandLineParser::NoValue, "Make rp log to syslog." },
         { StartSuspended, "start-suspended", 'Q', CommandLineParser::NoValue, "Start out suspended (no reindexing enabled)." },
@@ -310,7 +322,9 @@ int main(int argc, char** argv)
         { EnableCompilerManager, "enable-compiler-manager", 'R', CommandLineParser::NoValue, "Query compilers for their actual include paths instead of letting clang use its own." },
         { EnableNDEBUG, "enable-NDEBUG", 'g', CommandLineParser::NoValue, "Don't remove -DNDEBUG from compile lines." },
         { Progress, "progress", 'p', CommandLineParser::NoValue, "Report compilation progress in diagnostics output." },
-        { MaxFileMapCacheSize, "max-file-map-cache-size", 'y', CommandLineParser::Required, "Max files to cache per query (Should not exceed maximum number of open file descriptors allowed per process) (default " STR(DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE) ")." },
+        { MaxFileMapCacheSize, "max-file-map-cache-size", 'y', CommandLineParser::Required, "Max number of file maps each project keeps cached between queries (default " STR(DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE) ")." },
+        { FileMapCacheBudget, "file-map-cache-budget", 0, CommandLineParser::Required, "Max size in megabytes of the file maps each project keeps mapped between queries (default " STR(DEFAULT_RDM_FILE_MAP_CACHE_BUDGET) ")." },
+        { QueryThreads, "query-threads", 0, CommandLineParser::Required, "Number of threads running reference and symbol queries and the per-file searches they fan out to, 0 runs them on the main thread (default a quarter of the cores, between 1 and 4)." },
 #ifdef FILEMANAGER_OPT_IN
         { FileManagerWatch, "filemanager-watch", 'M', CommandLineParser::NoValue, "Use a file system watcher for filemanager." },
 #else
@@ -319,6 +333,8 @@ int main(int argc, char** argv)
         { NoFileManager, "no-filemanager", 0, CommandLineParser::NoValue, "Don't scan project directory for files. (rc -P won't work)." },
         { NoFileLock, "no-file-lock", 0, CommandLineParser::NoValue, "Disable file locking. Not entirely safe but might improve performance on certain systems." },
         { PchEnabled, "pch-enabled", 0, CommandLineParser::NoValue, "Enable PCH (experimental)." },
+        { AutoPch, "auto-pch", 0, CommandLineParser::NoValue, "Build shared PCHs for groups of sources with the same arguments and leading includes (experimental)." },
+        { AdaptiveJobs, "adaptive-jobs", 0, CommandLineParser::NoValue, "Run fewer jobs than --job-count when the system is low on memory or overloaded." },
         { NoFilesystemWatcher, "no-filesystem-watcher", 'B', CommandLineParser::NoValue, "Disable file system watching altogether. Reindexing has to be triggered manually." },
         { ArgTransform, "arg-transform", 'V', CommandLineParser::Required, "Use arg to transform arguments. [arg] should be executable with (execv(3))." },
         { NoComments, "no-comments", 0, CommandLineParser::NoValue, "Don't parse/store doxygen comments." },
@@ -510,6 +526,12 @@ int main(int argc, char** argv)
                 return { String::format<1024>("Can't parse argument to -a %s.", value.constData()), CommandLineParser::Parse_Error };
             }
             break; }
+        case RpJobsPerProcess: {
+            serverOpts.rpJobsPerProcess = atoi(value.constData());
+            if (serverOpts.rpJobsPerProcess <= 0) {
+                return { String::format<1024>("Invalid argument to --rp-jobs-per-process %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
         case SuspendRpOnCrash: {
             serverOpts.options |= Server::SuspendRPOnCrash;
             break; }
@@ -570,6 +592,21 @@ int main(int argc, char** argv)
                 return { String::format<1024>("Invalid argument to -y %s", value.constData()), CommandLineParser::Parse_Error };
             }
             break; }
+        case FileMapCacheBudget: {
+            bool ok;
+            const size_t budget = value.toULongLong(&ok);
+            if (!ok || !budget) {
+                return { String::format<1024>("Invalid argument to --file-map-cache-budget %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            serverOpts.fileMapCacheBudget = budget * 1024 * 1024;
+            break; }
+        case QueryThreads: {
+            bool ok;
+            serverOpts.queryThreadCount = String(value).toULong(&ok);
+            if (!ok) {
+                return { String::format<1024>("Can't parse argument to --query-threads %s. --query-threads must be a non-negative integer.", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
 #ifdef FILEMANAGER_OPT_IN
         case FileManagerWatch: {
             serverOpts.options &= ~Server::NoFileManagerWatch;
@@ -588,6 +625,12 @@ int main(int argc, char** argv)
         case PchEnabled: {
             serverOpts.options |= Server::PCHEnabled;
             break; }
+        case AutoPch: {
+            serverOpts.options |= Server::AutoPCH;
+            break; }
+        case AdaptiveJobs: {
+            serverOpts.options |= Server::AdaptiveJobs;
+            break; }
         case NoFilesystemWatcher: {
             serverOpts.options |= Server::NoFileSystemWatch;
             break; }
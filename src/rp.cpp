@@ -14,12 +14,17 @@
    along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
 
 #define RTAGS_SINGLE_THREAD
+#include <climits>
 #include <signal.h>
 #include <syslog.h>
+#include <unistd.h>
 
 #include "ClangIndexer.h"
 #include "Project.h"
+#include "RClient.h"
+#include "rct/Connection.h"
 #include "rct/Log.h"
+#include "rct/Rct.h"
 #include "rct/StopWatch.h"
 #include "rct/String.h"
 #include "RTags.h"
@@ -56,16 +61,31 @@ public:
     }
 };
 
+static bool readJob(String &data)
+{
+    uint32_t size;
+    if (!fread(&size, sizeof(size), 1, stdin))
+        return false;
+    data.resize(size);
+    return fread(&data[0], size, 1, stdin);
+}
+
 int main(int argc, char **argv)
 {
     LogLevel logLevel = LogLevel::Error;
     Path file;
+    bool worker = false;
+    int niceValue = INT_MIN;
 
     for (int i=1; i<argc; ++i) {
         if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
             ++logLevel;
         } else if (!strcmp(argv[i], "--priority")) { // ignore, only for wrapping purposes
             ++i;
+        } else if (!strcmp(argv[i], "--worker")) {
+            worker = true;
+        } else if (!strcmp(argv[i], "--nice")) {
+            niceValue = atoi(argv[++i]);
         } else {
             file = argv[i];
         }
@@ -85,27 +105,37 @@ int main(int argc, char **argv)
     initLogging(argv[0], logFlags, logLevel);
     (void)closer;
 
+    if (niceValue != INT_MIN) {
+        errno = 0;
+        if (nice(niceValue) == -1) {
+            error() << "Failed to nice rp" << Rct::strerror();
+        }
+    }
+
     RTags::initMessages();
     std::shared_ptr<EventLoop> eventLoop(new EventLoop);
     eventLoop->init(EventLoop::MainEventLoop);
     String data;
 
+    if (worker && file.isEmpty()) {
+        // rdm writes one job at a time and closes stdin when it wants us to
+        // exit. The connection and the file ids are kept between jobs.
+        const std::shared_ptr<Connection> connection = Connection::create(RClient::NumOptions);
+        while (readJob(data)) {
+            ClangIndexer indexer(connection);
+            if (!indexer.exec(data)) {
+                error() << "ClangIndexer error";
+                return 3;
+            }
+        }
+        return 0;
+    }
+
     if (!file.isEmpty()) {
         data = file.readAll();
-    } else {
-        uint32_t size;
-        if (!fread(&size, sizeof(size), 1, stdin)) {
-            error() << "Failed to read from stdin";
-            return 1;
-        }
-        data.resize(size);
-        if (!fread(&data[0], size, 1, stdin)) {
-            error() << "Failed to read from stdin";
-            return 2;
-        }
-        // FILE *f = fopen("/tmp/data", "w");
-        // fwrite(data.constData(), data.size(), 1, f);
-        // fclose(f);
+    } else if (!readJob(data)) {
+        error() << "Failed to read from stdin";
+        return 1;
     }
     ClangIndexer indexer;
     if (!indexer.exec(data)) {